@@ -10,10 +10,11 @@ parser.add_argument("--size", nargs=2, type=int, default=[320, 240], help="If pr
 parser.add_argument("--fps_max", type=int, default=20, help="The maximum target FPS to allow.")
 parser.add_argument("--fps_min", type=int, default=6, help="The minimum target FPS to allow.")
 parser.add_argument("--frame_drop", type=float, default=0.5, help="The aggresiveness of the frame dropping filter (from 0.0 to 1.0). Lower values drop less frames, higher values drop more.")
-parser.add_argument("--audio_rate", type=int, default=16000, help="The audio rate to use for the output video. This must match the audio rate set in your platformio.ini file.")
+parser.add_argument("--audio_rate", type=int, default=16000, help="The audio rate to use for the output video.")
 parser.add_argument("--quality", type=int, default=31, help="The jpeg quality to use for the video. Should be a value from 0-31, where lower numbers are higher quality, and higher numbers have a smaller file size.")
 parser.add_argument("--crt", type=str, default="True", help="If True, enable the CRT filter.")
 parser.add_argument("--sharpen", type=str, default="True", help="If True, adds a sharpening filter to the video, which can improve detail on the low-resolution output.")
+parser.add_argument("--restart_markers", type=str, default="True", help="If True, put a restart marker after every row of each frame, so the player can decode the top and bottom halves of a frame at the same time.")
 parser.add_argument("--normalize_audio", type=str, default="False", help="If True, apply loudness normalization to the audio track.")
 parser.add_argument("--relpath", action="store_true", help="Keep the relative directory structure for output files (otherwise collapse output files into one folder).")
 parser.add_argument("--dry_run", action="store_true", help="Just print the changes that would be made without actually making them.")
@@ -41,6 +42,7 @@ jpeg_quality = args.quality
 enable_crt = smart_str_bool(args.crt)
 enable_sharpen = smart_str_bool(args.sharpen)
 enable_audio_normalization = smart_str_bool(args.normalize_audio)
+enable_restart_markers = smart_str_bool(args.restart_markers)
 keep_relpath = args.relpath
 force_overwrite = args.force
 dry_run = args.dry_run
@@ -97,6 +99,7 @@ def process_video_file(
         jpeg_quality=31,
         audio_rate=16000,
         normalize_audio=True,
+        restart_markers=True,
     ):
     
     # Ensure the target directory exists
@@ -117,7 +120,11 @@ def process_video_file(
 
     normalize_audio_filter = '-filter:a "loudnorm"' if normalize_audio else ''
 
-    ffmpeg_cmd = f"""ffmpeg -i "{input_path}" -y {_shader_init_hw} {filter_string} -c:v mjpeg -q:v {jpeg_quality} -fps_mode vfr -acodec pcm_u8 {normalize_audio_filter} -ar {audio_rate} -ac 1 "{output_path}" """
+    # ffmpeg's mjpeg encoder writes a restart interval (DRI) and a restart marker after every row of MCUs
+    # when it encodes with slice threads.
+    _restart_markers = "-threads 4 -thread_type slice" if restart_markers else ""
+
+    ffmpeg_cmd = f"""ffmpeg -i "{input_path}" -y {_shader_init_hw} {filter_string} -c:v mjpeg -q:v {jpeg_quality} {_restart_markers} -fps_mode vfr -acodec pcm_u8 {normalize_audio_filter} -ar {audio_rate} -ac 1 "{output_path}" """
 
     print()
     print(ffmpeg_cmd)
@@ -288,6 +295,7 @@ if __name__ == "__main__":
         print(f"enable_crt:      {enable_crt}")
         print(f"enable_sharpen:  {enable_sharpen}")
         print(f"enable_audio_normalization: {enable_audio_normalization}")
+        print(f"enable_restart_markers: {enable_restart_markers}")
         print(f"keep_relpath: {keep_relpath}")
         print(f"force_overwrite: {force_overwrite}")
         print("---")
@@ -309,4 +317,5 @@ if __name__ == "__main__":
                 jpeg_quality=jpeg_quality,
                 audio_rate=audio_rate,
                 normalize_audio=enable_audio_normalization,
+                restart_markers=enable_restart_markers,
             )
@@ -2,7 +2,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <esp_heap_caps.h>
 #include "AVIParser.h"
+#include "../FileCache/FileCache.h"
 
 
 // Store some channel information in RTC ram so it persists through deep sleep.
@@ -11,10 +15,29 @@ RTC_DATA_ATTR bool isFilePlaying = false;
 // The hash of the current file name
 RTC_DATA_ATTR uint32_t currentFileNameHash = 0;
 // The current file position
-RTC_DATA_ATTR long currentFilePosition = 0;
+RTC_DATA_ATTR int64_t currentFilePosition = 0;
 // The current remaining movi list length
-RTC_DATA_ATTR long currentMoviListLength = 0;
+RTC_DATA_ATTR int64_t currentMoviListLength = 0;
+// What the header scan found in the current file, so it can be skipped when waking up.
+typedef struct
+{
+  uint32_t fileNameHash;
+  uint32_t fileSize;
+  uint32_t fileModified;
+  int64_t moviListPosition;
+  int64_t moviListEnd;
+  int64_t nextRiffPosition;
+  AVIHeaderInfo headerInfo;
+  AVIStreamInfo videoStream;
+  AVIStreamInfo audioStream;
+} AVIResumeState;
+RTC_DATA_ATTR AVIResumeState resumeState = {};
+
+// The headers are read a few bytes at a time, so probing them only needs a small read ring.
+#define AVI_PROBE_RING_SIZE (AVI_READ_BLOCK_SIZE * 2)
 
+// The strf format tag of uncompressed audio.
+#define WAVE_FORMAT_PCM 1
 
 
 // 32-bit FNV-1 hash function (http://www.isthe.com/chongo/tech/comp/fnv/index.html#FNV-1)
@@ -34,93 +57,391 @@ uint32_t fnvHash(const char *str)
 }
 
 
-void readChunk(FILE *file, ChunkHeader *header)
+chunk_type chunkTypeFromId(uint32_t chunkId)
+{
+  switch (chunkId)
+  {
+    case FOURCC('0', '0', 'd', 'c'): return VIDEO_CHUNK;
+    case FOURCC('0', '1', 'w', 'b'): return AUDIO_CHUNK;
+    case FOURCC('R', 'I', 'F', 'F'): return RIFF_CHUNK;
+    case FOURCC('L', 'I', 'S', 'T'): return LIST_CHUNK;
+    default: return OTHER_CHUNK;
+  }
+}
+
+// Could this id start a chunk inside a movi list? (##dc, ##wb, ix##, LIST, JUNK, ...)
+bool isPlausibleChunkId(uint32_t chunkId)
+{
+  char c0 = chunkId & 0xFF, c1 = (chunkId >> 8) & 0xFF, c2 = (chunkId >> 16) & 0xFF, c3 = chunkId >> 24;
+  if (isdigit(c0) && isdigit(c1) && isalpha(c2) && isalpha(c3)) {
+    return true;
+  }
+  return chunkId == FOURCC('L', 'I', 'S', 'T') || chunkId == FOURCC('J', 'U', 'N', 'K')
+    || (c0 == 'i' && c1 == 'x' && isalnum(c2) && isalnum(c3));
+}
+
+// Is this a stream data chunk header (##dc, ##db or ##wb)?
+bool isStreamChunk(const uint8_t *data)
+{
+  return isdigit(data[0]) && isdigit(data[1])
+    && ((data[2] == 'd' && (data[3] == 'c' || data[3] == 'b')) || (data[2] == 'w' && data[3] == 'b'));
+}
+
+
+// Read a four character code (as a little endian uint32). Returns 0 at the end of the file.
+uint32_t readFourCC(BlockReader &reader)
 {
-  char chunkId[4];
-  fread(chunkId, 4, 1, file);
-  fread(&header->chunkSize, 4, 1, file);
+  const uint8_t *data = reader.view(4);
+  uint32_t fourCC = 0;
+  if (data) {
+    // chunk data is only 2 byte aligned, so copy rather than cast
+    memcpy(&fourCC, data, 4);
+  }
+  return fourCC;
+}
 
-  if (strncmp(chunkId, "00dc", 4) == 0){
-    header->chunkType = VIDEO_CHUNK;
-  } 
-  else if (strncmp(chunkId, "01wb", 4) == 0){
-    // Serial.println("Reading AudioChunkHeader.");
-    header->chunkType = AUDIO_CHUNK;
+
+// Read a chunk header. Returns false at the end of the file.
+bool readChunk(BlockReader &reader, ChunkHeader *header, uint32_t *chunkId = NULL)
+{
+  const uint8_t *data = reader.view(8);
+  if (!data) {
+    *header = EMPTY_HEADER;
+    return false;
   }
-  else if (strncmp(chunkId, "RIFF", 4) == 0){
-    header->chunkType = RIFF_CHUNK;
+  uint32_t id;
+  memcpy(&id, data, 4);
+  memcpy(&header->chunkSize, data + 4, 4);
+  header->chunkType = chunkTypeFromId(id);
+  if (chunkId) {
+    *chunkId = id;
   }
-  else if (strncmp(chunkId, "LIST", 4) == 0){
-    header->chunkType = LIST_CHUNK;
+  return true;
+}
+
+
+// Grow an index array (in PSRAM if we have it) so that it can hold at least `length + 1` entries.
+template <typename T>
+bool growIndex(T **index, uint32_t length, uint32_t &capacity)
+{
+  if (length < capacity) {
+    return true;
   }
-  else {
-    header->chunkType = OTHER_CHUNK;
+  uint32_t newCapacity = capacity ? capacity * 2 : 1024;
+  T *newIndex = (T *)heap_caps_realloc_prefer(*index, newCapacity * sizeof(T), 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+  if (!newIndex) {
+    Serial.printf("Failed to allocate %u index entries.\n", newCapacity);
+    return false;
   }
-  
+  *index = newIndex;
+  capacity = newCapacity;
+  return true;
 }
 
 AVIParser::AVIParser(std::string fname, AVIChunkType requiredChunkType): mFileName(fname), mRequiredChunkType(requiredChunkType)
 {
 }
 
+AVIParser::AVIParser(ByteSource *source, AVIChunkType requiredChunkType): mRequiredChunkType(requiredChunkType), mSource(source)
+{
+}
+
+AVIParser::AVIParser(std::string fname, size_t readRingSize)
+: mFileName(fname), mRequiredChunkType(AVIChunkType::VIDEO), mReader(readRingSize)
+{
+}
+
 AVIParser::~AVIParser()
 {
-  if (mFile)
-  {
-    fclose(mFile);
-  }
+  delete mAudioReader;
+  delete mSource;
+  _freeIndex();
 }
 
-bool AVIParser::isMoviListChunk(unsigned int chunkSize)
+bool AVIParser::_readList(unsigned int chunkSize)
 {
-  char listType[4];
-  fread(&listType, 4, 1, mFile);
+  uint32_t listType = readFourCC(mReader);
   chunkSize -= 4;
-  Serial.printf("LIST type %c%c%c%c\n",
-                listType[0], listType[1],
-                listType[2], listType[3]);
+  int64_t listEnd = mReader.tell() + chunkSize + (chunkSize % 2);
+  Serial.printf("LIST type %.4s\n", (char *)&listType);
   // check for the movi list - contains the video frames and audio data
-  if (strncmp(listType, "movi", 4) == 0)
+  if (listType == FOURCC('m', 'o', 'v', 'i'))
   {
     Serial.printf("Found movi list.\n");
-    Serial.printf("List Chunk Length: %d\n", chunkSize);
-    mMoviListPosition = ftell(mFile);
+    Serial.printf("List Chunk Length: %u\n", chunkSize);
+    mMoviListPosition = mReader.tell();
     mMoviListLength = chunkSize;
+    mMoviListEnd = mMoviListPosition + chunkSize;
+    mSegments.push_back({mMoviListPosition, mMoviListEnd});
     return true;
   }
-  else
+  if (listType == FOURCC('h', 'd', 'r', 'l'))
   {
-    // skip the rest of the bytes
-    fseek(mFile, chunkSize, SEEK_CUR);
+    _parseHeaderList(listEnd);
   }
+  // skip the rest of the bytes
+  mReader.seek(listEnd);
   return false;
 }
 
-bool AVIParser::open()
+
+void AVIParser::_parseHeaderList(int64_t listEnd)
 {
-  
-  mFile = fopen(mFileName.c_str(), "rb");
-  if (!mFile)
+  // AVIMAINHEADER (without the chunk header)
+  typedef struct
   {
-    Serial.printf("Failed to open file.\n");
-    return false;
+    uint32_t microSecondsPerFrame;
+    uint32_t maxBytesPerSecond;
+    uint32_t paddingGranularity;
+    uint32_t flags;
+    uint32_t totalFrames;
+    uint32_t initialFrames;
+    uint32_t streams;
+    uint32_t suggestedBufferSize;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved[4];
+  } MainHeader;
+
+  ChunkHeader header;
+  uint32_t chunkId;
+  while (mReader.tell() + 8 <= listEnd && readChunk(mReader, &header, &chunkId))
+  {
+    int64_t chunkEnd = mReader.tell() + header.chunkSize + (header.chunkSize % 2);
+    if (chunkId == FOURCC('a', 'v', 'i', 'h'))
+    {
+      MainHeader mainHeader = {};
+      mReader.read(&mainHeader, min((size_t)header.chunkSize, sizeof(mainHeader)));
+      mHeaderInfo.microSecondsPerFrame = mainHeader.microSecondsPerFrame;
+      mHeaderInfo.totalFrames = mainHeader.totalFrames;
+      mHeaderInfo.width = mainHeader.width;
+      mHeaderInfo.height = mainHeader.height;
+      mHeaderInfo.videoBufferSize = mainHeader.suggestedBufferSize;
+    }
+    // each stream has its own strl list
+    else if (header.chunkType == LIST_CHUNK && readFourCC(mReader) == FOURCC('s', 't', 'r', 'l'))
+    {
+      _parseStreamList(chunkEnd);
+    }
+    mReader.seek(chunkEnd);
   }
 
-  #ifdef FILE_BUFFER_SIZE
-  // Increase size of file buffer if needed.
-  Serial.printf("Setting file buffer size to %d bytes.\n", FILE_BUFFER_SIZE);
-  setvbuf(mFile, NULL, _IOFBF, FILE_BUFFER_SIZE);
-  #endif
+  // the video stream header is more specific than the main header
+  if (mVideoStream.suggestedBufferSize) {
+    mHeaderInfo.videoBufferSize = mVideoStream.suggestedBufferSize;
+  }
+  if (mVideoStream.length) {
+    // (avih only counts the frames in the first RIFF segment of OpenDML files)
+    mHeaderInfo.totalFrames = mVideoStream.length;
+  }
+  Serial.printf("AVI headers: %ux%u, %uus per frame, %u frames, %u byte video buffer, %uHz %u bit %u channel audio\n",
+                mHeaderInfo.width, mHeaderInfo.height, mHeaderInfo.microSecondsPerFrame, mHeaderInfo.totalFrames,
+                mHeaderInfo.videoBufferSize, mHeaderInfo.audioSampleRate, mHeaderInfo.audioBitsPerSample, mHeaderInfo.audioChannels);
+}
+
+
+void AVIParser::_parseStreamList(int64_t listEnd)
+{
+  // AVISTREAMHEADER (without the chunk header)
+  typedef struct
+  {
+    uint32_t fccType;
+    uint32_t fccHandler;
+    uint32_t flags;
+    uint16_t priority;
+    uint16_t language;
+    uint32_t initialFrames;
+    uint32_t scale;
+    uint32_t rate;
+    uint32_t start;
+    uint32_t length;
+    uint32_t suggestedBufferSize;
+    uint32_t quality;
+    uint32_t sampleSize;
+    int16_t frame[4];
+  } StreamHeader;
+
+  // BITMAPINFOHEADER (start of a video strf)
+  typedef struct
+  {
+    uint32_t size;
+    int32_t width;
+    int32_t height;
+    uint16_t planes;
+    uint16_t bitCount;
+    uint32_t compression;
+  } BitmapInfoHeader;
+  // WAVEFORMATEX (start of an audio strf)
+  typedef struct
+  {
+    uint16_t formatTag;
+    uint16_t channels;
+    uint32_t samplesPerSecond;
+    uint32_t averageBytesPerSecond;
+    uint16_t blockAlign;
+    uint16_t bitsPerSample;
+  } WaveFormat;
+
+  ChunkHeader header;
+  uint32_t chunkId;
+  bool isVideo = false;
+  bool isAudio = false;
+  while (mReader.tell() + 8 <= listEnd && readChunk(mReader, &header, &chunkId))
+  {
+    int64_t chunkEnd = mReader.tell() + header.chunkSize + (header.chunkSize % 2);
+    if (chunkId == FOURCC('s', 't', 'r', 'h'))
+    {
+      StreamHeader streamHeader = {};
+      mReader.read(&streamHeader, min((size_t)header.chunkSize, sizeof(streamHeader)));
+      AVIStreamInfo info = {streamHeader.scale, streamHeader.rate, streamHeader.sampleSize, streamHeader.length, streamHeader.suggestedBufferSize};
+      // we only play the first video and audio streams
+      if (streamHeader.fccType == FOURCC('v', 'i', 'd', 's') && mVideoStream.rate == 0)
+      {
+        mVideoStream = info;
+        isVideo = true;
+      }
+      else if (streamHeader.fccType == FOURCC('a', 'u', 'd', 's') && mAudioStream.rate == 0)
+      {
+        mAudioStream = info;
+        isAudio = true;
+      }
+    }
+    else if (chunkId == FOURCC('s', 't', 'r', 'f') && isVideo)
+    {
+      BitmapInfoHeader bitmapInfo = {};
+      mReader.read(&bitmapInfo, min((size_t)header.chunkSize, sizeof(bitmapInfo)));
+      if (!mHeaderInfo.width) {mHeaderInfo.width = bitmapInfo.width;}
+      if (!mHeaderInfo.height) {mHeaderInfo.height = abs(bitmapInfo.height);}
+    }
+    else if (chunkId == FOURCC('s', 't', 'r', 'f') && isAudio)
+    {
+      WaveFormat waveFormat = {};
+      mReader.read(&waveFormat, min((size_t)header.chunkSize, sizeof(waveFormat)));
+      mHeaderInfo.audioSampleRate = waveFormat.samplesPerSecond;
+      mHeaderInfo.audioChannels = waveFormat.channels;
+      mHeaderInfo.audioBitsPerSample = waveFormat.bitsPerSample;
+      // (only PCM can be played, so anything else is left with no block alignment and turned down)
+      if (waveFormat.formatTag == WAVE_FORMAT_PCM) {
+        mHeaderInfo.audioBlockAlign = waveFormat.blockAlign;
+      }
+    }
+    else if (chunkId == FOURCC('i', 'n', 'd', 'x') && isVideo)
+    {
+      _loadSuperIndex(header.chunkSize);
+    }
+    mReader.seek(chunkEnd);
+  }
+}
+
+
+void AVIParser::_loadSuperIndex(unsigned int chunkSize)
+{
+  // AVISUPERINDEX header
+  typedef struct
+  {
+    uint16_t longsPerEntry;
+    uint8_t indexSubType;
+    uint8_t indexType;
+    uint32_t entriesInUse;
+    uint32_t chunkId;
+    uint32_t reserved[3];
+  } SuperIndexHeader;
+  // one AVISUPERINDEX entry
+  typedef struct
+  {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t duration;
+  } SuperIndexEntry;
+
+  SuperIndexHeader header;
+  if (chunkSize < sizeof(header) || mReader.read(&header, sizeof(header)) < sizeof(header)) {
+    return;
+  }
+  // AVI_INDEX_OF_INDEXES
+  if (header.indexType != 0 || header.longsPerEntry != 4) {
+    Serial.println("Unsupported OpenDML super index.");
+    return;
+  }
+  uint32_t maxEntries = (chunkSize - sizeof(header)) / sizeof(SuperIndexEntry);
+  for (uint32_t i = 0; i < header.entriesInUse && i < maxEntries; i++)
+  {
+    SuperIndexEntry entry;
+    if (mReader.read(&entry, sizeof(entry)) < sizeof(entry)) {
+      break;
+    }
+    mVideoSuperIndex.push_back({entry.offset, entry.duration, mSuperIndexFrameCount});
+    mSuperIndexFrameCount += entry.duration;
+  }
+  Serial.printf("Found OpenDML super index: %d standard indexes, %u frames.\n", mVideoSuperIndex.size(), mSuperIndexFrameCount);
+}
+
+
+void AVIParser::_findSegments(int64_t position)
+{
+  ChunkHeader header;
+  while (mReader.seek(position) && readChunk(mReader, &header) && header.chunkType == RIFF_CHUNK
+    && readFourCC(mReader) == FOURCC('A', 'V', 'I', 'X'))
+  {
+    int64_t riffEnd = position + 8 + header.chunkSize;
+    // the extension's movi list is usually the first chunk, but don't rely on it
+    ChunkHeader listHeader;
+    while (mReader.tell() + 8 <= riffEnd && readChunk(mReader, &listHeader))
+    {
+      int64_t chunkEnd = mReader.tell() + listHeader.chunkSize + (listHeader.chunkSize % 2);
+      if (listHeader.chunkType == LIST_CHUNK && readFourCC(mReader) == FOURCC('m', 'o', 'v', 'i'))
+      {
+        mSegments.push_back({mReader.tell(), mReader.tell() + listHeader.chunkSize - 4});
+        break;
+      }
+      mReader.seek(chunkEnd);
+    }
+    position = riffEnd + (riffEnd % 2);
+    // a forward-only source has to play this segment before it can look for the next one
+    if (!mSource->isSeekable()) {
+      break;
+    }
+  }
+  mNextRiffPosition = position;
+  if (mSegments.size() > 1) {
+    Serial.printf("Found %d OpenDML RIFF segments.\n", mSegments.size());
+  }
+}
+
+
+bool AVIParser::_nextSegment()
+{
+  if (mCurrentSegment + 1 >= mSegments.size() && !mSource->isSeekable()) {
+    _findSegments(mNextRiffPosition);
+  }
+  // (segments in a corrupt file can overlap, so step through them rather than looking them up by position)
+  while (mCurrentSegment + 1 < mSegments.size())
+  {
+    mCurrentSegment++;
+    AVISegment &segment = mSegments[mCurrentSegment];
+    if (segment.moviListEnd > segment.moviListPosition && mReader.seek(segment.moviListPosition))
+    {
+      Serial.printf("Moving to RIFF segment %d\n", mCurrentSegment);
+      mMoviListPosition = segment.moviListPosition;
+      mMoviListEnd = segment.moviListEnd;
+      mMoviListLength = mMoviListEnd - mMoviListPosition;
+      return true;
+    }
+  }
+  return false;
+}
 
+
+bool AVIParser::_readHeaders()
+{
   // check the file is valid
   ChunkHeader header;
   // Read RIFF header
-  readChunk(mFile, &header);
+  readChunk(mReader, &header);
+  int64_t riffEnd = 8 + (int64_t)header.chunkSize;
   if (header.chunkType != RIFF_CHUNK)
   {
     Serial.println("Not a valid AVI file.");
-    fclose(mFile);
-    mFile = NULL;
     return false;
   }
   else
@@ -128,13 +449,9 @@ bool AVIParser::open()
     Serial.printf("RIFF header found.\n");
   }
   // next four bytes are the RIFF type which should be 'AVI '
-  char riffType[4];
-  fread(&riffType, 4, 1, mFile);
-  if (strncmp(riffType, "AVI ", 4) != 0)
+  if (readFourCC(mReader) != FOURCC('A', 'V', 'I', ' '))
   {
     Serial.println("Not a valid AVI file.");
-    fclose(mFile);
-    mFile = NULL;
     return false;
   }
   else
@@ -143,17 +460,12 @@ bool AVIParser::open()
   }
 
   // now read each chunk and find the movi list
-  while (!feof(mFile) && !ferror(mFile))
+  while (readChunk(mReader, &header))
   {
-    readChunk(mFile, &header);
-    if (feof(mFile) || ferror(mFile))
-    {
-      break;
-    }
     // is it a LIST chunk?
     if (header.chunkType == LIST_CHUNK)
     {
-      if (isMoviListChunk(header.chunkSize))
+      if (_readList(header.chunkSize))
       {
         break;
       }
@@ -161,44 +473,203 @@ bool AVIParser::open()
     else
     {
       // skip the chunk data bytes
-      fseek(mFile, header.chunkSize, SEEK_CUR);
+      mReader.skip(header.chunkSize + (header.chunkSize % 2));
     }
   }
   // did we find the list?
   if (mMoviListPosition == 0)
   {
     Serial.printf("Failed to find the movi list.\n");
-    fclose(mFile);
-    mFile = NULL;
     return false;
   }
 
+  // the player converts 8 or 16 bit PCM (with any number of channels) to the 8 bit mono its outputs take
+  const AVIHeaderInfo &info = mHeaderInfo;
+  if (mAudioStream.rate && (info.audioBlockAlign == 0 || (info.audioBitsPerSample != 8 && info.audioBitsPerSample != 16)
+                            || info.audioBlockAlign != info.audioChannels * info.audioBitsPerSample / 8))
+  {
+    Serial.printf("Can't play %u bit %u channel audio (%u bytes per sample). Only 8 or 16 bit PCM is supported.\n",
+                  info.audioBitsPerSample, info.audioChannels, info.audioBlockAlign);
+    return false;
+  }
+
+  // files over 1GB continue in OpenDML 'RIFF AVIX' extensions
+  mNextRiffPosition = riffEnd + (riffEnd % 2);
+  if (mSource->isSeekable()) {
+    _findSegments(mNextRiffPosition);
+  }
+  return true;
+}
+
+
+bool AVIParser::_restoreHeaders()
+{
+  if (!isFilePlaying || !resumeState.fileNameHash || mFileName.empty() || !mSource->isSeekable()
+    || fnvHash(mFileName.c_str()) != resumeState.fileNameHash) {
+    return false;
+  }
+  // make sure the file hasn't changed while we were asleep
+  struct stat fileStat;
+  if (stat(mFileName.c_str(), &fileStat) != 0 || (uint32_t)fileStat.st_size != resumeState.fileSize
+    || (uint32_t)fileStat.st_mtime != resumeState.fileModified) {
+    return false;
+  }
+  mMoviListPosition = resumeState.moviListPosition;
+  mMoviListEnd = resumeState.moviListEnd;
+  mMoviListLength = mMoviListEnd - mMoviListPosition;
+  mSegments.push_back({mMoviListPosition, mMoviListEnd});
+  mNextRiffPosition = resumeState.nextRiffPosition;
+  mHeaderInfo = resumeState.headerInfo;
+  mVideoStream = resumeState.videoStream;
+  mAudioStream = resumeState.audioStream;
+  Serial.println("Restored AVI headers from before sleep.");
+  return true;
+}
+
+
+bool AVIParser::probe(std::string fileName, AVIHeaderInfo *headerInfo, uint32_t *durationMs)
+{
+  AVIParser parser(fileName, AVI_PROBE_RING_SIZE);
+  if (!parser.mReader.isValid()) {
+    return false;
+  }
+  parser.mSource = ByteSource::openFile(fileName);
+  if (!parser.mSource) {
+    return false;
+  }
+  parser.mReader.setSource(parser.mSource);
+  if (!parser._readHeaders()) {
+    return false;
+  }
+  *headerInfo = parser.mHeaderInfo;
+  *durationMs = parser.getDurationMs();
+  return true;
+}
+
+
+bool AVIParser::open(bool resume)
+{
+  unsigned long openStartTime = millis();
+  if (!mReader.isValid())
+  {
+    Serial.println("No memory for the read buffer.");
+    return false;
+  }
+  #ifndef DISABLE_FILE_CACHE
+  // short files we've played before may be in memory
+  if (!mSource) {
+    mSource = FileCache::openCached(mFileName);
+  }
+  #endif
+  if (!mSource) {
+    mSource = ByteSource::openFile(mFileName);
+  }
+  if (!mSource)
+  {
+    Serial.printf("Failed to open file.\n");
+    return false;
+  }
+
+  // all reads go through the block reader
+  mReader.setSource(mSource);
+
+  // a file we were playing before deep sleep doesn't need its headers scanning again
+  if (!(resume && _restoreHeaders()) && !_readHeaders())
+  {
+    delete mSource;
+    mSource = NULL;
+    return false;
+  }
+
+  // load the frame index so we can seek
+  // (OpenDML files are indexed by their super index, without loading it all into RAM)
+  if (!mSource->isSeekable())
+  {
+    // the index is at the end of the stream, and we couldn't seek with it anyway
+    Serial.println("Streaming input. Seeking is disabled.");
+    mVideoSuperIndex.clear();
+  }
+  else if (isOpenDML())
+  {
+    Serial.println("Using OpenDML index.");
+  }
+  else if (!_loadIndexCache())
+  {
+    if (_loadIndex() || _buildIndex())
+    {
+      _saveIndexCache();
+    }
+    else
+    {
+      Serial.println("Failed to index the movi list. Seeking is disabled.");
+      _freeIndex();
+    }
+  }
+  _seekToChunk(mMoviListPosition);
+
+  // read audio and video separately if they're too far apart for the read-ahead to cover
+  if (mVideoIndexLength && mAudioIndexLength && _isPoorlyInterleaved())
+  {
+    mAudioReader = new BlockReader();
+    if (mAudioReader->isValid())
+    {
+      Serial.println("Audio and video are poorly interleaved. Reading them with separate cursors.");
+      mAudioReader->setSource(mSource);
+      mIndependentCursors = true;
+      mVideoCursor = 0;
+      mAudioCursor = 0;
+    }
+    else
+    {
+      Serial.println("Not enough memory for a second reader. Reading the file in order.");
+      delete mAudioReader;
+      mAudioReader = NULL;
+    }
+  }
+  Serial.printf("Opened %s in %lums\n", mFileName.empty() ? "stream" : mFileName.c_str(), millis() - openStartTime);
+
   // attempt to resume playback if we have reopened the previous file
-  if (isFilePlaying && currentFileNameHash && currentFilePosition && fnvHash(mFileName.c_str()) == currentFileNameHash){
-    long previousPosition = ftell(mFile);
-    Serial.printf("Resuming playback from position %ld\n", currentFilePosition);
-    fseek(mFile, currentFilePosition, SEEK_SET);
-    if (ftell(mFile) != currentFilePosition){
+  if (resume && isFilePlaying && mSource->isSeekable() && !mFileName.empty() && currentFileNameHash && currentFilePosition && fnvHash(mFileName.c_str()) == currentFileNameHash){
+    Serial.printf("Resuming playback from position %lld\n", (long long)currentFilePosition);
+    if (!_seekToNearestChunk(currentFilePosition)){
       Serial.println("Failed to seek to previous position.");
-      fseek(mFile, previousPosition, SEEK_SET);
+      _seekToChunk(mMoviListPosition);
     }
   }
-  isFilePlaying = true;
-  currentFileNameHash = 0;
-  currentFilePosition = 0;
+  if (resume) {
+    markPlaying();
+  }
 
   // keep the file open for reading the frames
   return true;
 }
 
 
+void AVIParser::markPlaying(){
+  mPlaying = true;
+  isFilePlaying = true;
+  currentFileNameHash = 0;
+  currentFilePosition = 0;
+}
+
+
 void AVIParser::storePosition(){
-  if (mMoviListLength && mFile)
+  bool hasMoreData = mIndependentCursors ? mAudioCursor < mAudioIndexLength : (mMoviListLength || mGroupData);
+  if (hasMoreData && mSource && mSource->isSeekable() && !mFileName.empty())
   {
     currentFileNameHash = fnvHash(mFileName.c_str());
-    currentFilePosition = ftell(mFile);
+    currentFilePosition = _tell();
     currentMoviListLength = mMoviListLength;
-    Serial.printf("Storing file position %ld for file hash %u\n", currentFilePosition, currentFileNameHash);
+    Serial.printf("Storing file position %lld for file hash %u\n", (long long)currentFilePosition, currentFileNameHash);
+    // (OpenDML files need their super index, so they're always scanned)
+    struct stat fileStat;
+    resumeState.fileNameHash = 0;
+    if (mSegments.size() == 1 && !isOpenDML() && stat(mFileName.c_str(), &fileStat) == 0)
+    {
+      resumeState = {currentFileNameHash, (uint32_t)fileStat.st_size, (uint32_t)fileStat.st_mtime,
+                     mSegments[0].moviListPosition, mSegments[0].moviListEnd, mNextRiffPosition,
+                     mHeaderInfo, mVideoStream, mAudioStream};
+    }
   }
   else {
     isFilePlaying = false;
@@ -208,7 +679,7 @@ void AVIParser::storePosition(){
 
 ChunkHeader AVIParser::getNextHeader(){
   // check if the file is open
-  if (!mFile)
+  if (!mSource)
   {
     Serial.println("No file open.");
     return EMPTY_HEADER;
@@ -219,58 +690,909 @@ ChunkHeader AVIParser::getNextHeader(){
     return EMPTY_HEADER;
   }
 
-  if (mMoviListLength > 0){
+  if (mIndependentCursors) {
+    return _getNextIndexedHeader();
+  }
+  mChunkReader = &mReader;
+
+  while (true)
+  {
+    // hand out the chunks from the current 'rec ' group first
+    if (mGroupData)
+    {
+      ChunkHeader header;
+      if (_nextGroupHeader(&header)) {
+        mNextFrame += header.chunkType == VIDEO_CHUNK;
+        return header;
+      }
+      continue;
+    }
+    // carry on into the next RIFF segment (if there is one)
+    if (mMoviListLength <= 0 && !_nextSegment()) {
+      return _endOfData();
+    }
     // get the next chunk of data from the list
     ChunkHeader header;
-    readChunk(mFile, &header);
+    uint32_t chunkId;
+    int64_t chunkPosition = mReader.tell();
+    bool validChunk = readChunk(mReader, &header, &chunkId);
     mMoviListLength -= 8;
-    currentFilePosition = ftell(mFile);
-    return header;
-  }
-  else {
-    // no more chunks
-    Serial.println("No more data");
-    isFilePlaying = false;
-    return EMPTY_HEADER;
+    // a chunk can't run past the end of the movi list, and must be one we'd expect to find there
+    if (validChunk && header.chunkSize <= mMoviListLength && isPlausibleChunkId(chunkId)) {
+      // interleaved audio and video for one interval can be grouped in a 'rec ' list
+      if (header.chunkType == LIST_CHUNK && _readGroup(header.chunkSize)) {
+        continue;
+      }
+      _notePosition(mReader.tell());
+      mNextFrame += header.chunkType == VIDEO_CHUNK;
+      return header;
+    }
+    if (!validChunk) {
+      // end of the file (it's been truncated)
+      mMoviListLength = 0;
+      continue;
+    }
+    Serial.printf("Damaged chunk header at %lld.\n", (long long)chunkPosition);
+    if (!_resync(chunkPosition))
+    {
+      Serial.println("No more good chunks. Skipping the rest of the movi list.");
+      mMoviListLength = 0;
+    }
   }
-
 }
 
 
-size_t AVIParser::getNextChunk(ChunkHeader header, uint8_t **buffer, size_t &bufferLength, bool skipChunk)
+bool AVIParser::_resync(int64_t position)
 {
-  if (skipChunk)
+  mResyncCount++;
+  if (mVideoIndexLength || mAudioIndexLength)
   {
-    // the data is not what was required - skip over the chunk
-    fseek(mFile, header.chunkSize, SEEK_CUR);
-    mMoviListLength -= header.chunkSize;
-    // handle any padding bytes
-    if (header.chunkSize % 2 != 0){
-      fseek(mFile, 1, SEEK_CUR);
-      mMoviListLength--;
+    // jump to the first indexed chunk after the damage
+    int64_t nextPosition = INT64_MAX;
+    uint32_t low = 0, high = mVideoIndexLength;
+    while (low < high)
+    {
+      uint32_t mid = (low + high) / 2;
+      if (mVideoIndex[mid].offset <= position) {low = mid + 1;}
+      else {high = mid;}
+    }
+    if (low < mVideoIndexLength) {
+      nextPosition = mVideoIndex[low].offset;
+    }
+    low = 0, high = mAudioIndexLength;
+    while (low < high)
+    {
+      uint32_t mid = (low + high) / 2;
+      if (mAudioIndex[mid].offset <= position) {low = mid + 1;}
+      else {high = mid;}
+    }
+    if (low < mAudioIndexLength) {
+      nextPosition = min(nextPosition, (int64_t)mAudioIndex[low].offset);
+    }
+    if (nextPosition != INT64_MAX && _seekToChunk(nextPosition))
+    {
+      Serial.printf("Resynced to indexed chunk at %lld.\n", (long long)nextPosition);
+      return true;
     }
   }
-  else
+  return _scanForChunk(position + 2);
+}
+
+
+bool AVIParser::_scanForChunk(int64_t position)
+{
+  // chunks start on word boundaries (relative to the movi list, which is word aligned)
+  position += (position - mMoviListPosition) % 2;
+  while (position + 8 <= mMoviListEnd)
   {
-    // we've got the required chunk - copy it into the provided buffer
-    if (header.chunkSize > bufferLength)
-    {
-      Serial.printf("Buffer size %d is too small to read next chunk. Reallocating %d bytes.\n", bufferLength, header.chunkSize);
-      *buffer = (uint8_t *)realloc(*buffer, header.chunkSize);
-      bufferLength = header.chunkSize;
-      Serial.println("Reallocated!");
+    // look through a block at a time, straight out of the read buffer
+    size_t length = min((int64_t)AVI_READ_BLOCK_SIZE, mMoviListEnd - position);
+    const uint8_t *data = mReader.seek(position) ? mReader.view(length) : NULL;
+    if (!data) {
+      return false;
     }
-    // copy the chunk data
-    fread(*buffer, header.chunkSize, 1, mFile);
-    
-    mMoviListLength -= header.chunkSize;
-    // handle any padding bytes
-    if (header.chunkSize % 2 != 0)
+    for (size_t i = 0; i + 8 <= length; i += 2)
     {
-      fseek(mFile, 1, SEEK_CUR);
-      mMoviListLength--;
+      uint32_t chunkSize;
+      memcpy(&chunkSize, data + i + 4, 4);
+      if (isStreamChunk(data + i) && chunkSize <= mMoviListEnd - (position + i + 8))
+      {
+        Serial.printf("Resynced to chunk at %lld.\n", (long long)(position + i));
+        return _seekToChunk(position + i);
+      }
     }
-    return header.chunkSize;
+    // (overlap the blocks, so we don't miss a header that crosses the boundary)
+    position += max((int64_t)2, (int64_t)((length - 6) & ~1));
   }
-  return 0;
-}
\ No newline at end of file
+  return false;
+}
+
+
+bool AVIParser::_readGroup(unsigned int chunkSize)
+{
+  if (chunkSize < 4 || readFourCC(mReader) != FOURCC('r', 'e', 'c', ' '))
+  {
+    // not a group - leave it to the caller
+    mReader.seek(mReader.tell() - (chunkSize < 4 ? 0 : 4));
+    return false;
+  }
+  // read the whole group at once, and hand out its chunks from memory
+  uint32_t groupLength = chunkSize - 4;
+  int64_t groupPosition = mReader.tell();
+  const uint8_t *groupData = mReader.view(groupLength);
+  mMoviListLength -= chunkSize + (chunkSize % 2);
+  if (chunkSize % 2) {
+    mReader.skip(1);
+  }
+  if (!groupData) {
+    Serial.printf("Failed to read 'rec ' group of %u bytes.\n", groupLength);
+    return true;
+  }
+  mGroupData = groupData;
+  mGroupLength = groupLength;
+  mGroupOffset = 0;
+  mGroupPosition = groupPosition;
+  return true;
+}
+
+
+bool AVIParser::_nextGroupHeader(ChunkHeader *header)
+{
+  if (mGroupOffset + 8 <= mGroupLength)
+  {
+    uint32_t chunkId;
+    memcpy(&chunkId, mGroupData + mGroupOffset, 4);
+    memcpy(&header->chunkSize, mGroupData + mGroupOffset + 4, 4);
+    header->chunkType = chunkTypeFromId(chunkId);
+    mGroupOffset += 8;
+    if (header->chunkSize <= mGroupLength - mGroupOffset)
+    {
+      _notePosition(_tell());
+      return true;
+    }
+    Serial.printf("Invalid chunk at %lld. Skipping the rest of the 'rec ' group.\n", (long long)_tell() - 8);
+  }
+  mGroupData = NULL;
+  return false;
+}
+
+
+const uint8_t *AVIParser::_takeGroupData(unsigned int chunkSize)
+{
+  const uint8_t *data = mGroupData + mGroupOffset;
+  mGroupOffset = min(mGroupLength, mGroupOffset + chunkSize + (chunkSize % 2));
+  return data;
+}
+
+
+size_t AVIParser::getNextChunk(ChunkHeader header, uint8_t **buffer, size_t &bufferLength, bool skipChunk)
+{
+  if (mGroupData)
+  {
+    // the chunk is already in memory (getNextHeader checked that it fits in the group)
+    const uint8_t *data = _takeGroupData(header.chunkSize);
+    if (skipChunk || header.chunkSize == 0) {
+      return 0;
+    }
+    if (header.chunkSize > bufferLength)
+    {
+      uint8_t *newBuffer = (uint8_t *)realloc(*buffer, header.chunkSize);
+      if (!newBuffer) {
+        Serial.println("Failed to reallocate. Skipping the chunk.");
+        return 0;
+      }
+      *buffer = newBuffer;
+      bufferLength = header.chunkSize;
+    }
+    memcpy(*buffer, data, header.chunkSize);
+    return header.chunkSize;
+  }
+  BlockReader &reader = *mChunkReader;
+  if (skipChunk)
+  {
+    // the data is not what was required - skip over the chunk (and any padding byte)
+    reader.skip(header.chunkSize + (header.chunkSize % 2));
+    mMoviListLength -= header.chunkSize + (header.chunkSize % 2);
+  }
+  else
+  {
+    // we've got the required chunk - copy it into the provided buffer
+    if (header.chunkSize > bufferLength)
+    {
+      Serial.printf("Buffer size %d is too small to read next chunk. Reallocating %d bytes.\n", bufferLength, header.chunkSize);
+      uint8_t *newBuffer = (uint8_t *)realloc(*buffer, header.chunkSize);
+      if (!newBuffer)
+      {
+        Serial.println("Failed to reallocate. Skipping the chunk.");
+        return getNextChunk(header, buffer, bufferLength, true);
+      }
+      *buffer = newBuffer;
+      bufferLength = header.chunkSize;
+      Serial.println("Reallocated!");
+    }
+    // copy the chunk data
+    reader.read(*buffer, header.chunkSize);
+    
+    mMoviListLength -= header.chunkSize;
+    // handle any padding bytes
+    if (header.chunkSize % 2 != 0)
+    {
+      reader.skip(1);
+      mMoviListLength--;
+    }
+    return header.chunkSize;
+  }
+  return 0;
+}
+
+
+ChunkView AVIParser::getNextChunkView(ChunkHeader header)
+{
+  if (mGroupData) {
+    return {_takeGroupData(header.chunkSize), header.chunkSize};
+  }
+  // hand out the chunk data straight from the read ring
+  BlockReader &reader = *mChunkReader;
+  ChunkView view = {reader.view(header.chunkSize), header.chunkSize};
+  if (!view.data) {
+    Serial.printf("Failed to read chunk of %d bytes.\n", header.chunkSize);
+    view.length = 0;
+  }
+  mMoviListLength -= header.chunkSize;
+  // handle any padding bytes
+  if (header.chunkSize % 2 != 0)
+  {
+    reader.skip(1);
+    mMoviListLength--;
+  }
+  return view;
+}
+
+bool AVIParser::_addIndexEntry(chunk_type chunkType, uint32_t offset, uint32_t size)
+{
+  if (chunkType == VIDEO_CHUNK)
+  {
+    if (!growIndex(&mVideoIndex, mVideoIndexLength, mVideoIndexCapacity)) {
+      return false;
+    }
+    mVideoIndex[mVideoIndexLength++] = {offset, size};
+  }
+  else if (chunkType == AUDIO_CHUNK)
+  {
+    if (!growIndex(&mAudioIndex, mAudioIndexLength, mAudioIndexCapacity)) {
+      return false;
+    }
+    mAudioIndex[mAudioIndexLength++] = {offset, mAudioByteCount};
+    mAudioByteCount += size;
+  }
+  return true;
+}
+
+
+void AVIParser::_freeIndex()
+{
+  free(mVideoIndex);
+  mVideoIndex = NULL;
+  mVideoIndexLength = 0;
+  mVideoIndexCapacity = 0;
+  free(mAudioIndex);
+  mAudioIndex = NULL;
+  mAudioIndexLength = 0;
+  mAudioIndexCapacity = 0;
+  mAudioByteCount = 0;
+}
+
+
+bool AVIParser::_loadIndex()
+{
+  // the idx1 chunk (if there is one) comes after the movi list
+  mReader.seek(mMoviListEnd + (mMoviListEnd % 2));
+  ChunkHeader header;
+  uint32_t chunkId;
+  bool foundIndex = false;
+  while (readChunk(mReader, &header, &chunkId))
+  {
+    if (chunkId == FOURCC('i', 'd', 'x', '1'))
+    {
+      foundIndex = true;
+      break;
+    }
+    mReader.skip(header.chunkSize + (header.chunkSize % 2));
+  }
+  if (!foundIndex)
+  {
+    Serial.println("No idx1 chunk found.");
+    return false;
+  }
+
+  // idx1 entries (AVIOLDINDEX)
+  typedef struct
+  {
+    uint32_t chunkId;
+    uint32_t flags;
+    uint32_t offset;
+    uint32_t size;
+  } OldIndexEntry;
+  OldIndexEntry entries[64];
+  uint32_t entriesRemaining = header.chunkSize / sizeof(OldIndexEntry);
+  // offsets are normally relative to the 'movi' list type, but some muxers write absolute file positions
+  int64_t offsetBase = -1;
+
+  Serial.printf("Loading %u idx1 entries.\n", entriesRemaining);
+  while (entriesRemaining > 0)
+  {
+    size_t entriesToRead = min(entriesRemaining, (uint32_t)64);
+    size_t entriesRead = mReader.read(entries, entriesToRead * sizeof(OldIndexEntry)) / sizeof(OldIndexEntry);
+    if (entriesRead == 0) {
+      break;
+    }
+    entriesRemaining -= entriesRead;
+    if (offsetBase < 0) {
+      offsetBase = entries[0].offset >= mMoviListPosition ? 0 : mMoviListPosition - 4;
+    }
+
+    for (size_t i = 0; i < entriesRead; i++)
+    {
+      if (!_addIndexEntry(chunkTypeFromId(entries[i].chunkId), offsetBase + entries[i].offset, entries[i].size))
+      {
+        _freeIndex();
+        return false;
+      }
+    }
+  }
+  Serial.printf("Loaded index: %u video frames, %u audio chunks.\n", mVideoIndexLength, mAudioIndexLength);
+  return hasIndex();
+}
+
+
+bool AVIParser::_buildIndex()
+{
+  Serial.println("Building index from movi list.");
+  _freeIndex();
+  int64_t position = mMoviListPosition;
+  ChunkHeader header;
+  while (position + 8 <= mMoviListEnd)
+  {
+    // seeks that land inside the read ring don't cost any I/O
+    mReader.seek(position);
+    if (!readChunk(mReader, &header)) {
+      break;
+    }
+    // index the chunks inside 'rec ' groups
+    if (header.chunkType == LIST_CHUNK && readFourCC(mReader) == FOURCC('r', 'e', 'c', ' ')) {
+      position += 12;
+      continue;
+    }
+    if (!_addIndexEntry(header.chunkType, position, header.chunkSize)) {
+      _freeIndex();
+      return false;
+    }
+    position += 8 + header.chunkSize + (header.chunkSize % 2);
+  }
+  Serial.printf("Built index: %u video frames, %u audio chunks.\n", mVideoIndexLength, mAudioIndexLength);
+  return hasIndex();
+}
+
+
+bool AVIParser::_seekToChunk(int64_t position)
+{
+  if (!mSource) {
+    return false;
+  }
+  mReachedEnd = false;
+  // find the segment holding the position
+  for (size_t i = 0; i < mSegments.size(); i++)
+  {
+    if (position >= mSegments[i].moviListPosition && position < mSegments[i].moviListEnd)
+    {
+      if (!mReader.seek(position)) {
+        return false;
+      }
+      mCurrentSegment = i;
+      mGroupData = NULL;
+      mMoviListPosition = mSegments[i].moviListPosition;
+      mMoviListEnd = mSegments[i].moviListEnd;
+      mMoviListLength = mMoviListEnd - position;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+bool AVIParser::_seekToNearestChunk(int64_t position)
+{
+  if (!hasIndex()) {
+    // without an index, we just have to trust that this is the start of a chunk
+    return _seekToChunk(position);
+  }
+  if (mIndependentCursors)
+  {
+    // go to the time of the last audio chunk at or before the position
+    uint32_t low = 0, high = mAudioIndexLength;
+    while (low < high)
+    {
+      uint32_t mid = (low + high) / 2;
+      if (mAudioIndex[mid].offset <= position) {low = mid + 1;}
+      else {high = mid;}
+    }
+    return seekToAudioByte(low > 0 ? mAudioIndex[low - 1].firstByte : 0);
+  }
+  // find the last video and audio chunks at or before the position
+  int64_t nearestPosition = mSegments[0].moviListPosition;
+  uint32_t low = 0, high = mVideoIndexLength;
+  while (low < high)
+  {
+    uint32_t mid = (low + high) / 2;
+    if (mVideoIndex[mid].offset <= position) {low = mid + 1;}
+    else {high = mid;}
+  }
+  if (low > 0) {
+    nearestPosition = max(nearestPosition, (int64_t)mVideoIndex[low - 1].offset);
+  }
+  low = 0, high = mAudioIndexLength;
+  while (low < high)
+  {
+    uint32_t mid = (low + high) / 2;
+    if (mAudioIndex[mid].offset <= position) {low = mid + 1;}
+    else {high = mid;}
+  }
+  if (low > 0) {
+    nearestPosition = max(nearestPosition, (int64_t)mAudioIndex[low - 1].offset);
+  }
+  mNextFrame = _countFramesBefore(nearestPosition);
+  return _seekToChunk(nearestPosition);
+}
+
+
+bool AVIParser::seekToFrame(uint32_t frame)
+{
+  if (isOpenDML()) {
+    return _seekToFrameOpenDML(frame);
+  }
+  if (frame >= mVideoIndexLength) {
+    return false;
+  }
+  // empty chunks just repeat the previous frame, so start from the last one with image data
+  while (frame > 0 && mVideoIndex[frame].size == 0) {
+    frame--;
+  }
+  mNextFrame = frame;
+  if (mIndependentCursors)
+  {
+    mVideoCursor = frame;
+    mAudioCursor = _findAudioChunk(_frameToAudioByte(frame));
+    mReachedEnd = false;
+    return true;
+  }
+  return _seekToChunk(mVideoIndex[frame].offset);
+}
+
+
+bool AVIParser::seekToAudioByte(uint32_t audioByte, uint32_t *chunkStartByte)
+{
+  if (isOpenDML())
+  {
+    // we only keep the video super index, so go to the video frame showing at that point in the audio
+    if (_getAudioBytesPerSecond() == 0 || mVideoStream.scale == 0 || mVideoStream.rate == 0) {
+      return false;
+    }
+    uint32_t frame = _audioByteToFrame(audioByte);
+    if (chunkStartByte) {
+      *chunkStartByte = _frameToAudioByte(frame);
+    }
+    return seekToFrame(frame);
+  }
+  if (mAudioIndexLength == 0 || audioByte >= mAudioByteCount) {
+    return false;
+  }
+  uint32_t audioChunk = _findAudioChunk(audioByte);
+  AVIAudioIndexEntry &entry = mAudioIndex[audioChunk];
+  if (chunkStartByte) {
+    *chunkStartByte = entry.firstByte;
+  }
+  if (mIndependentCursors)
+  {
+    mAudioCursor = audioChunk;
+    mVideoCursor = min(_audioByteToFrame(entry.firstByte), mVideoIndexLength - 1);
+    // start from the last frame with image data
+    while (mVideoCursor > 0 && mVideoIndex[mVideoCursor].size == 0) {
+      mVideoCursor--;
+    }
+    mNextFrame = mVideoCursor;
+    mReachedEnd = false;
+    return true;
+  }
+  mNextFrame = _countFramesBefore(entry.offset);
+  return _seekToChunk(entry.offset);
+}
+
+
+bool AVIParser::seekToTimeMs(uint32_t ms)
+{
+  uint64_t bytesPerSecond = _getAudioBytesPerSecond();
+  if (bytesPerSecond && (mAudioIndexLength || isOpenDML())) {
+    return seekToAudioByte((uint64_t)ms * bytesPerSecond / 1000);
+  }
+  float frameRate = getFrameRate();
+  return frameRate > 0 && seekToFrame((uint32_t)(ms * frameRate / 1000));
+}
+
+
+ChunkHeader AVIParser::seekToFrameChunk(uint32_t frame)
+{
+  if (!seekToFrame(frame)) {
+    return EMPTY_HEADER;
+  }
+  // step over any audio that comes first (only with independent cursors or 'rec ' groups)
+  for (int i = 0; i < 16; i++)
+  {
+    ChunkHeader header = getNextHeader();
+    if (header.chunkType == VIDEO_CHUNK || header.chunkType == EMPTY_CHUNK) {
+      return header;
+    }
+    size_t unusedLength = 0;
+    getNextChunk(header, NULL, unusedLength, true);
+  }
+  return EMPTY_HEADER;
+}
+
+
+uint32_t AVIParser::_countFramesBefore(int64_t position)
+{
+  uint32_t low = 0, high = mVideoIndexLength;
+  while (low < high)
+  {
+    uint32_t mid = (low + high) / 2;
+    if (mVideoIndex[mid].offset < position) {low = mid + 1;}
+    else {high = mid;}
+  }
+  return low;
+}
+
+
+uint32_t AVIParser::_findAudioChunk(uint32_t audioByte)
+{
+  // find the last chunk starting at or before the byte
+  uint32_t low = 0, high = mAudioIndexLength;
+  while (low < high)
+  {
+    uint32_t mid = (low + high) / 2;
+    if (mAudioIndex[mid].firstByte <= audioByte) {low = mid + 1;}
+    else {high = mid;}
+  }
+  return low > 0 ? low - 1 : 0;
+}
+
+
+uint64_t AVIParser::_getAudioBytesPerSecond()
+{
+  return mAudioStream.scale ? (uint64_t)mAudioStream.rate * max(mAudioStream.sampleSize, (uint32_t)1) / mAudioStream.scale : 0;
+}
+
+
+uint32_t AVIParser::_frameToAudioByte(uint32_t frame)
+{
+  if (mVideoStream.rate == 0) {
+    return 0;
+  }
+  return (uint64_t)frame * mVideoStream.scale * _getAudioBytesPerSecond() / mVideoStream.rate;
+}
+
+
+uint32_t AVIParser::_audioByteToFrame(uint32_t audioByte)
+{
+  uint64_t bytesPerVideoSecond = _getAudioBytesPerSecond() * mVideoStream.scale;
+  if (bytesPerVideoSecond == 0) {
+    return 0;
+  }
+  return (uint64_t)audioByte * mVideoStream.rate / bytesPerVideoSecond;
+}
+
+
+bool AVIParser::_isPoorlyInterleaved()
+{
+  if (_getAudioBytesPerSecond() == 0 || mVideoStream.rate == 0 || mVideoStream.scale == 0) {
+    return false;
+  }
+  // walk the video frames, comparing each one's position to the audio chunk playing when it's shown
+  int64_t maxDistance = 0;
+  uint32_t maxFrameSize = 0;
+  uint32_t audioChunk = 0;
+  for (uint32_t frame = 0; frame < mVideoIndexLength; frame++)
+  {
+    uint32_t audioByte = _frameToAudioByte(frame);
+    while (audioChunk + 1 < mAudioIndexLength && mAudioIndex[audioChunk + 1].firstByte <= audioByte) {
+      audioChunk++;
+    }
+    int64_t distance = (int64_t)mVideoIndex[frame].offset - (int64_t)mAudioIndex[audioChunk].offset;
+    maxDistance = max(maxDistance, distance < 0 ? -distance : distance);
+    maxFrameSize = max(maxFrameSize, mVideoIndex[frame].size);
+  }
+  Serial.printf("Audio and video are up to %lld bytes apart.\n", (long long)maxDistance);
+  return maxDistance > AVI_INTERLEAVE_LIMIT + maxFrameSize;
+}
+
+
+void AVIParser::_notePosition(int64_t position)
+{
+  // (a file opened ahead of time mustn't overwrite the position of the one that's playing)
+  if (mPlaying) {
+    currentFilePosition = position;
+  }
+}
+
+
+ChunkHeader AVIParser::_endOfData()
+{
+  // (only the first time - the read-ahead keeps asking while the next channel opens)
+  if (!mReachedEnd)
+  {
+    Serial.println("No more data");
+    if (mPlaying) {
+      isFilePlaying = false;
+    }
+    mReachedEnd = true;
+  }
+  return EMPTY_HEADER;
+}
+
+
+ChunkHeader AVIParser::_getNextIndexedHeader()
+{
+  bool hasVideo = mVideoCursor < mVideoIndexLength;
+  bool hasAudio = mAudioCursor < mAudioIndexLength;
+  if (!hasVideo && !hasAudio) {
+    return _endOfData();
+  }
+  // send each frame once the audio before it has been sent
+  bool useAudio = hasAudio && (!hasVideo || mAudioIndex[mAudioCursor].firstByte < _frameToAudioByte(mVideoCursor));
+  int64_t position;
+  if (useAudio)
+  {
+    position = mAudioIndex[mAudioCursor++].offset;
+    // share the video reader's data when the cursors are close together
+    mChunkReader = mReader.contains(position, 8) ? &mReader : mAudioReader;
+  }
+  else
+  {
+    position = mVideoIndex[mVideoCursor++].offset;
+    mNextFrame = mVideoCursor;
+    mChunkReader = mAudioReader->contains(position, 8) ? mAudioReader : &mReader;
+  }
+  ChunkHeader header;
+  if (!mChunkReader->seek(position) || !readChunk(*mChunkReader, &header) || header.chunkType != (useAudio ? AUDIO_CHUNK : VIDEO_CHUNK))
+  {
+    Serial.printf("Index entry doesn't match the chunk at %lld. Skipping it.\n", (long long)position);
+    // an empty chunk is skipped by the caller
+    mChunkReader = &mReader;
+    return {OTHER_CHUNK, 0};
+  }
+  _notePosition(_tell());
+  return header;
+}
+
+
+int64_t AVIParser::_tell()
+{
+  if (mIndependentCursors) {
+    // resume from the audio, which is the playback clock
+    return mAudioCursor < mAudioIndexLength ? mAudioIndex[mAudioCursor].offset : mMoviListEnd;
+  }
+  return mGroupData ? mGroupPosition + mGroupOffset : mReader.tell();
+}
+
+
+// Header of the sidecar index cache file.
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  // Size and modification time of the AVI file when the cache was written.
+  uint32_t fileSize;
+  uint32_t fileModified;
+  uint32_t moviListPosition;
+  uint32_t moviListEnd;
+  uint32_t videoIndexLength;
+  uint32_t audioIndexLength;
+  uint32_t audioByteCount;
+} IndexCacheHeader;
+
+#define INDEX_CACHE_MAGIC FOURCC('T', 'V', 'I', 'X')
+#define INDEX_CACHE_VERSION 1
+
+
+std::string AVIParser::_getIndexCachePath()
+{
+  // "movie.avi" -> "movie.idx"
+  size_t extensionStart = mFileName.find_last_of('.');
+  size_t nameStart = mFileName.find_last_of('/');
+  if (extensionStart == std::string::npos || (nameStart != std::string::npos && extensionStart < nameStart)) {
+    return mFileName + ".idx";
+  }
+  return mFileName.substr(0, extensionStart) + ".idx";
+}
+
+
+bool AVIParser::_loadIndexCache()
+{
+  #ifdef DISABLE_AVI_INDEX_CACHE
+  return false;
+  #else
+  struct stat fileStat;
+  if (stat(mFileName.c_str(), &fileStat) != 0) {
+    return false;
+  }
+  std::string cachePath = _getIndexCachePath();
+  FILE *cacheFile = fopen(cachePath.c_str(), "rb");
+  if (!cacheFile) {
+    return false;
+  }
+
+  // check that the cache was written for this version of the file
+  IndexCacheHeader header;
+  if (fread(&header, sizeof(header), 1, cacheFile) != 1
+  || header.magic != INDEX_CACHE_MAGIC
+  || header.version != INDEX_CACHE_VERSION
+  || header.fileSize != (uint32_t)fileStat.st_size
+  || header.fileModified != (uint32_t)fileStat.st_mtime
+  || header.moviListPosition != mMoviListPosition
+  || header.moviListEnd != mMoviListEnd)
+  {
+    Serial.printf("Index cache %s is stale.\n", cachePath.c_str());
+    fclose(cacheFile);
+    return false;
+  }
+
+  _freeIndex();
+  bool loaded = true;
+  if (header.videoIndexLength > 0)
+  {
+    mVideoIndex = (AVIVideoIndexEntry *)heap_caps_malloc_prefer(header.videoIndexLength * sizeof(AVIVideoIndexEntry), 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+    loaded = mVideoIndex && fread(mVideoIndex, sizeof(AVIVideoIndexEntry), header.videoIndexLength, cacheFile) == header.videoIndexLength;
+    mVideoIndexLength = mVideoIndexCapacity = header.videoIndexLength;
+  }
+  if (loaded && header.audioIndexLength > 0)
+  {
+    mAudioIndex = (AVIAudioIndexEntry *)heap_caps_malloc_prefer(header.audioIndexLength * sizeof(AVIAudioIndexEntry), 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+    loaded = mAudioIndex && fread(mAudioIndex, sizeof(AVIAudioIndexEntry), header.audioIndexLength, cacheFile) == header.audioIndexLength;
+    mAudioIndexLength = mAudioIndexCapacity = header.audioIndexLength;
+    mAudioByteCount = header.audioByteCount;
+  }
+  fclose(cacheFile);
+
+  if (!loaded || !hasIndex())
+  {
+    Serial.printf("Failed to load index cache %s\n", cachePath.c_str());
+    _freeIndex();
+    return false;
+  }
+  Serial.printf("Loaded index cache: %u video frames, %u audio chunks.\n", mVideoIndexLength, mAudioIndexLength);
+  return true;
+  #endif
+}
+
+
+void AVIParser::_saveIndexCache()
+{
+  #ifndef DISABLE_AVI_INDEX_CACHE
+  struct stat fileStat;
+  if (stat(mFileName.c_str(), &fileStat) != 0) {
+    return;
+  }
+  std::string cachePath = _getIndexCachePath();
+  FILE *cacheFile = fopen(cachePath.c_str(), "wb");
+  if (!cacheFile) {
+    Serial.printf("Failed to create index cache %s\n", cachePath.c_str());
+    return;
+  }
+
+  IndexCacheHeader header = {
+    INDEX_CACHE_MAGIC,
+    INDEX_CACHE_VERSION,
+    (uint32_t)fileStat.st_size,
+    (uint32_t)fileStat.st_mtime,
+    (uint32_t)mMoviListPosition,
+    (uint32_t)mMoviListEnd,
+    mVideoIndexLength,
+    mAudioIndexLength,
+    mAudioByteCount
+  };
+  bool written = fwrite(&header, sizeof(header), 1, cacheFile) == 1
+    && fwrite(mVideoIndex, sizeof(AVIVideoIndexEntry), mVideoIndexLength, cacheFile) == mVideoIndexLength
+    && fwrite(mAudioIndex, sizeof(AVIAudioIndexEntry), mAudioIndexLength, cacheFile) == mAudioIndexLength;
+  fclose(cacheFile);
+
+  if (!written) {
+    // don't leave a truncated cache behind
+    Serial.printf("Failed to write index cache %s\n", cachePath.c_str());
+    remove(cachePath.c_str());
+    return;
+  }
+  Serial.printf("Saved index cache %s\n", cachePath.c_str());
+  #endif
+}
+
+
+bool AVIParser::_seekToFrameOpenDML(uint32_t frame)
+{
+  if (frame >= mSuperIndexFrameCount) {
+    return false;
+  }
+  // find the standard index holding the frame
+  size_t low = 0, high = mVideoSuperIndex.size();
+  while (low < high)
+  {
+    size_t mid = (low + high) / 2;
+    if (mVideoSuperIndex[mid].firstFrame <= frame) {low = mid + 1;}
+    else {high = mid;}
+  }
+  AVISuperIndexEntry &superEntry = mVideoSuperIndex[low - 1];
+
+  // AVISTDINDEX header (after the ix## chunk header)
+  typedef struct
+  {
+    uint16_t longsPerEntry;
+    uint8_t indexSubType;
+    uint8_t indexType;
+    uint32_t entriesInUse;
+    uint32_t chunkId;
+    uint64_t baseOffset;
+    uint32_t reserved;
+  } __attribute__((packed)) StandardIndexHeader;
+  // one AVISTDINDEX entry
+  typedef struct
+  {
+    uint32_t offset;
+    uint32_t size;
+  } StandardIndexEntry;
+
+  StandardIndexHeader header;
+  mReader.seek(superEntry.offset + 8);
+  if (mReader.read(&header, sizeof(header)) < sizeof(header) || header.longsPerEntry != 2) {
+    Serial.println("Invalid OpenDML standard index.");
+    return false;
+  }
+  uint32_t entryIndex = frame - superEntry.firstFrame;
+  if (entryIndex >= header.entriesInUse) {
+    return false;
+  }
+  // read just the entry we need (stepping back over empty frames, which just repeat the previous one)
+  int64_t entriesPosition = superEntry.offset + 8 + sizeof(header);
+  StandardIndexEntry entry;
+  while (true)
+  {
+    mReader.seek(entriesPosition + entryIndex * sizeof(entry));
+    if (mReader.read(&entry, sizeof(entry)) < sizeof(entry)) {
+      return false;
+    }
+    // the top bit is the (inverted) keyframe flag
+    if ((entry.size & 0x7FFFFFFF) != 0 || entryIndex == 0) {
+      break;
+    }
+    entryIndex--;
+  }
+  mNextFrame = superEntry.firstFrame + entryIndex;
+  // index offsets point at the chunk data, not the header
+  return _seekToChunk(header.baseOffset + entry.offset - 8);
+}
+
+
+uint32_t AVIParser::getMaxVideoChunkSize()
+{
+  uint32_t maxSize = 0;
+  for (uint32_t i = 0; i < mVideoIndexLength; i++) {
+    maxSize = max(maxSize, mVideoIndex[i].size);
+  }
+  return maxSize ? maxSize : mHeaderInfo.videoBufferSize;
+}
+
+
+uint32_t AVIParser::getDurationMs()
+{
+  // prefer the video stream's own timing
+  if (mVideoStream.rate && mVideoStream.length) {
+    return (uint64_t)mVideoStream.length * mVideoStream.scale * 1000 / mVideoStream.rate;
+  }
+  return (uint64_t)mHeaderInfo.totalFrames * mHeaderInfo.microSecondsPerFrame / 1000;
+}
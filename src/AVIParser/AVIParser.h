@@ -1,6 +1,19 @@
 #pragma once
 
-enum chunk_type {OTHER_CHUNK, AUDIO_CHUNK, VIDEO_CHUNK, RIFF_CHUNK, LIST_CHUNK, EMPTY_CHUNK};
+#include <vector>
+#include "BlockReader.h"
+
+// Files where the audio and video for the same moment are further apart than this (plus the largest frame)
+// are read with separate audio and video cursors.
+#ifndef AVI_INTERLEAVE_LIMIT
+#define AVI_INTERLEAVE_LIMIT (32 * 1024)
+#endif
+
+// Build a four character code as a little endian uint32, for comparing chunk ids without strncmp.
+#define FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+// (CHANNEL_CHUNK isn't in files - the player uses it to mark where the read-ahead moved on to the next channel)
+enum chunk_type {OTHER_CHUNK, AUDIO_CHUNK, VIDEO_CHUNK, RIFF_CHUNK, LIST_CHUNK, EMPTY_CHUNK, CHANNEL_CHUNK};
 
 enum class AVIChunkType
 {
@@ -16,24 +29,255 @@ typedef struct
 #define EMPTY_HEADER (ChunkHeader){EMPTY_CHUNK, 0}
 // ChunkHeader EMPTY_HEADER = {EMPTY_CHUNK, 0};
 
+// A pointer to chunk data inside the parser's read buffer.
+// Only valid until the next call into the parser.
+typedef struct
+{
+  const uint8_t *data;
+  size_t length;
+} ChunkView;
+
+// One video frame in the index.
+typedef struct
+{
+  // Absolute file position of the chunk header.
+  uint32_t offset;
+  // Size of the chunk data (0 for dropped/duplicate frames).
+  uint32_t size;
+} AVIVideoIndexEntry;
+
+// One audio chunk in the index.
+typedef struct
+{
+  // Absolute file position of the chunk header.
+  uint32_t offset;
+  // Position of this chunk's first byte in the audio stream (bytes, not samples - divide by the
+  // stream's block alignment for samples). The chunk size is the difference to the next entry's.
+  uint32_t firstByte;
+} AVIAudioIndexEntry;
+
+// One entry of an OpenDML super index (indx), pointing at a standard index (ix##) chunk.
+typedef struct
+{
+  // Absolute file position of the ix## chunk.
+  uint64_t offset;
+  // Number of frames in the standard index.
+  uint32_t duration;
+  // The first frame covered by the standard index.
+  uint32_t firstFrame;
+} AVISuperIndexEntry;
+
+// The movi list of one RIFF segment ('AVI ' or an OpenDML 'AVIX' extension).
+typedef struct
+{
+  int64_t moviListPosition;
+  int64_t moviListEnd;
+} AVISegment;
+
+// Timing info from a stream header (strh).
+typedef struct
+{
+  uint32_t scale;
+  uint32_t rate;
+  uint32_t sampleSize;
+  // Length of the stream (in units of scale/rate).
+  uint32_t length;
+  // Size of the largest chunk in the stream.
+  uint32_t suggestedBufferSize;
+} AVIStreamInfo;
+
+// Playback settings from the AVI headers (avih/strh/strf).
+typedef struct
+{
+  uint32_t microSecondsPerFrame;
+  uint32_t totalFrames;
+  uint32_t width;
+  uint32_t height;
+  // Size of the largest video chunk (0 if the file doesn't say).
+  uint32_t videoBufferSize;
+  uint32_t audioSampleRate;
+  uint16_t audioChannels;
+  uint16_t audioBitsPerSample;
+  // Bytes per audio sample (all channels), which the audio index positions are divided by to count samples.
+  uint16_t audioBlockAlign;
+} AVIHeaderInfo;
+
 
 class AVIParser
 {
 private:
   std::string mFileName;
   AVIChunkType mRequiredChunkType;
-  FILE *mFile = NULL;
-  long mMoviListPosition = 0;
-  long mMoviListLength = 0;
+  ByteSource *mSource = NULL;
+  BlockReader mReader;
+  // The reader holding the chunk returned by the last getNextHeader.
+  BlockReader *mChunkReader = &mReader;
+  // Bounds of the movi list currently being read.
+  int64_t mMoviListPosition = 0;
+  int64_t mMoviListLength = 0;
+  // The file position just past the end of the movi list.
+  int64_t mMoviListEnd = 0;
+  // Every RIFF segment in the file, and the one currently being read.
+  std::vector<AVISegment> mSegments;
+  size_t mCurrentSegment = 0;
+  // Where to look for the next 'RIFF AVIX' extension.
+  int64_t mNextRiffPosition = 0;
+  // The 'rec ' group being handed out, which was read in one piece.
+  // (A view into the read buffer, so nothing else may read while it's in use)
+  const uint8_t *mGroupData = NULL;
+  uint32_t mGroupLength = 0;
+  uint32_t mGroupOffset = 0;
+  // File position of the group data.
+  int64_t mGroupPosition = 0;
+
+  AVIStreamInfo mVideoStream = {};
+  AVIStreamInfo mAudioStream = {};
+  AVIHeaderInfo mHeaderInfo = {};
+  // OpenDML super index for the video stream. The standard indexes it points to are read on demand.
+  std::vector<AVISuperIndexEntry> mVideoSuperIndex;
+  uint32_t mSuperIndexFrameCount = 0;
+
+  // Frame index, loaded from idx1 (or built by scanning the movi list)
+  AVIVideoIndexEntry *mVideoIndex = NULL;
+  uint32_t mVideoIndexLength = 0;
+  uint32_t mVideoIndexCapacity = 0;
+  AVIAudioIndexEntry *mAudioIndex = NULL;
+  uint32_t mAudioIndexLength = 0;
+  uint32_t mAudioIndexCapacity = 0;
+  // Total number of audio bytes in the index.
+  uint32_t mAudioByteCount = 0;
+
+  // Poorly interleaved files are read with a cursor per stream, merged in time order.
+  // The audio cursor has its own reader, so each stream's reads stay sequential.
+  bool mIndependentCursors = false;
+  uint32_t mResyncCount = 0;
+  // The number of the next video frame to be read.
+  uint32_t mNextFrame = 0;
+  uint32_t mVideoCursor = 0;
+  uint32_t mAudioCursor = 0;
+  BlockReader *mAudioReader = NULL;
+  // Set once the end of the data has been reached (until the next seek).
+  bool mReachedEnd = false;
+  // Whether this is the file that's playing, which keeps the resume state up to date.
+  bool mPlaying = false;
 
-  bool isMoviListChunk(unsigned int chunkSize);
+  // For probe(): reads through a read ring of `readRingSize` bytes.
+  AVIParser(std::string fname, size_t readRingSize);
+  // Check the RIFF header and scan the top level chunks for the headers and movi list.
+  bool _readHeaders();
+  // Restore what _readHeaders found from before deep sleep, if this is the same file.
+  bool _restoreHeaders();
+  // Read a LIST chunk from the top level of a RIFF segment. Returns true if it's the movi list.
+  bool _readList(unsigned int chunkSize);
+  void _parseHeaderList(int64_t listEnd);
+  void _parseStreamList(int64_t listEnd);
+  void _loadSuperIndex(unsigned int chunkSize);
+  // Find the movi lists of any OpenDML 'RIFF AVIX' extensions, starting at `position`.
+  // (A forward-only source only finds the next one, as playback reaches it)
+  void _findSegments(int64_t position);
+  // Move on to the movi list of the next RIFF segment.
+  bool _nextSegment();
+  // Read a whole 'rec ' list from the movi list. Returns false for any other type of list.
+  bool _readGroup(unsigned int chunkSize);
+  // Get the next chunk header from the current group.
+  bool _nextGroupHeader(ChunkHeader *header);
+  // Move past `chunkSize` bytes of the current group, returning a pointer to them.
+  const uint8_t *_takeGroupData(unsigned int chunkSize);
+  // The read position, including inside a group (or the next audio chunk, with independent cursors).
+  int64_t _tell();
+  bool _seekToFrameOpenDML(uint32_t frame);
+  // Load the idx1 chunk that follows the movi list.
+  bool _loadIndex();
+  // Build the index by walking every chunk header in the movi list.
+  bool _buildIndex();
+  // Append an entry to the index for the chunk at `offset`.
+  bool _addIndexEntry(chunk_type chunkType, uint32_t offset, uint32_t size);
+  void _freeIndex();
+  // The sidecar index cache stored next to the AVI file.
+  std::string _getIndexCachePath();
+  bool _loadIndexCache();
+  void _saveIndexCache();
+  // Move the file to the chunk header at `position` inside the movi list.
+  bool _seekToChunk(int64_t position);
+  // Move the file to the last indexed chunk at or before `position`.
+  bool _seekToNearestChunk(int64_t position);
+  // Convert between video frames and audio stream bytes using the stream headers (0 if they're missing).
+  uint64_t _getAudioBytesPerSecond();
+  uint32_t _frameToAudioByte(uint32_t frame);
+  uint32_t _audioByteToFrame(uint32_t audioByte);
+  // Check how far apart the audio and video for the same moment are in the file.
+  bool _isPoorlyInterleaved();
+  // getNextHeader for independent cursors.
+  ChunkHeader _getNextIndexedHeader();
+  // What getNextHeader returns once there are no more chunks.
+  ChunkHeader _endOfData();
+  // Keep the position of the chunk just read, for resuming (if this is the file playing).
+  void _notePosition(int64_t position);
+  // Index of the last audio chunk starting at or before `audioByte`.
+  uint32_t _findAudioChunk(uint32_t audioByte);
+  // Number of indexed video frames before a file position.
+  uint32_t _countFramesBefore(int64_t position);
+  // Find the next good chunk after a damaged header at `position`, using the index if we have one.
+  bool _resync(int64_t position);
+  // Scan forward from `position` for the next stream chunk header.
+  bool _scanForChunk(int64_t position);
 
 public:
   AVIParser(std::string fname, AVIChunkType requiredChunkType);
+  // Read from `source` instead of a file (the parser deletes the source).
+  // A forward-only source can be played, but not seeked or resumed.
+  AVIParser(ByteSource *source, AVIChunkType requiredChunkType);
   ~AVIParser();
-  bool open();
+  // With `resume` false (a channel opened ahead of time, while another plays), the state kept for resuming
+  // playback is left alone - the file doesn't pick up a stored position, and isn't the one playing until markPlaying().
+  bool open(bool resume = true);
+  // Make this the file that's playing (the one storePosition would resume), using up any stored position.
+  void markPlaying();
+  // Read just the headers (avih/strh/strf) of a file, for cataloguing it while something else plays.
+  // Unlike open(), no index is loaded, built or saved, and the state kept for resuming playback isn't touched.
+  static bool probe(std::string fileName, AVIHeaderInfo *headerInfo, uint32_t *durationMs);
   // Store attributes needed to resume playback from current position.
   void storePosition();
   ChunkHeader getNextHeader();
   size_t getNextChunk(ChunkHeader header, uint8_t **buffer, size_t &bufferLength, bool skipChunk=false);
-};
\ No newline at end of file
+  // Get the next chunk without copying it. The view is valid until the next call into the parser.
+  ChunkView getNextChunkView(ChunkHeader header);
+
+  // Random access (requires the index)
+  bool hasIndex() { return mVideoIndex != NULL || mAudioIndex != NULL || !mVideoSuperIndex.empty(); }
+  bool isOpenDML() { return !mVideoSuperIndex.empty(); }
+  // True if audio and video are read with separate cursors (the file is poorly interleaved).
+  bool hasIndependentCursors() { return mIndependentCursors; }
+
+  // Playback settings from the file's headers. Fields are 0 if the file didn't set them.
+  const AVIHeaderInfo &getHeaderInfo() { return mHeaderInfo; }
+  // The biggest video chunk in the file (from the index, or the headers' suggested buffer size).
+  uint32_t getMaxVideoChunkSize();
+  // Length of the video in milliseconds (0 if unknown).
+  uint32_t getDurationMs();
+  // Number of times playback has skipped over damaged data.
+  uint32_t getResyncCount() { return mResyncCount; }
+  uint32_t getVideoFrameCount() { return isOpenDML() ? mSuperIndexFrameCount : mVideoIndexLength; }
+  // Length of the audio stream in bytes (as indexed).
+  uint32_t getAudioByteCount() { return mAudioByteCount; }
+  // Seek so that the next chunk read is video frame `frame`.
+  // Empty (duplicate) frames are skipped back to the last frame with image data.
+  bool seekToFrame(uint32_t frame);
+  // Go to a frame and return the header of its video chunk, skipping the audio (for fast forward and rewind).
+  // Read the chunk with getNextChunk/getNextChunkView as usual.
+  ChunkHeader seekToFrameChunk(uint32_t frame);
+  // The number of the next video frame to be read.
+  uint32_t getNextFrame() { return mNextFrame; }
+  // Video frames per second (0 if unknown).
+  float getFrameRate() {
+    if (mVideoStream.scale && mVideoStream.rate) {
+      return (float)mVideoStream.rate / mVideoStream.scale;
+    }
+    return mHeaderInfo.microSecondsPerFrame ? 1000000.0f / mHeaderInfo.microSecondsPerFrame : 0;
+  }
+  // Seek to the audio chunk containing byte `audioByte` of the audio stream (not a sample number -
+  // one sample is the strf's block alignment in bytes). `chunkStartByte` is set to that chunk's first byte.
+  bool seekToAudioByte(uint32_t audioByte, uint32_t *chunkStartByte = NULL);
+  // Seek to `ms` milliseconds into the video (through the audio if there is any, so it plays from there).
+  bool seekToTimeMs(uint32_t ms);
+};
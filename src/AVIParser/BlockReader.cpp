@@ -0,0 +1,173 @@
+#include <Arduino.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_heap_caps.h>
+#include "BlockReader.h"
+
+
+static_assert(AVI_READ_RING_SIZE % AVI_READ_BLOCK_SIZE == 0, "AVI_READ_RING_SIZE must be a multiple of AVI_READ_BLOCK_SIZE");
+
+
+BlockReader::BlockReader(size_t ringSize) : mRingSize(ringSize)
+{
+  mRing = (uint8_t *)heap_caps_malloc(mRingSize, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+  if (!mRing) {
+    Serial.println("Failed to allocate DMA capable read ring. Using normal memory.");
+    mRing = (uint8_t *)malloc(mRingSize);
+  }
+}
+
+BlockReader::~BlockReader()
+{
+  free(mRing);
+  free(mScratch);
+}
+
+void BlockReader::setSource(ByteSource *source)
+{
+  mSource = source;
+  mStart = mEnd = mPosition = mFilePosition = mSource->tell();
+  mEndOfFile = false;
+}
+
+
+size_t BlockReader::_readFile(int64_t position, uint8_t *buffer, size_t length)
+{
+  if (position != mSource->tell())
+  {
+    if (!mSource->seek(position)) {
+      mEndOfFile = true;
+      return 0;
+    }
+    mFilePosition = position;
+  }
+  size_t bytesRead = mSource->read(buffer, length);
+  mFilePosition = position + bytesRead;
+  if (bytesRead < length) {
+    mEndOfFile = true;
+  }
+  return bytesRead;
+}
+
+
+size_t BlockReader::_fill(size_t length)
+{
+  while (mEnd - mPosition < (int64_t)length && !mEndOfFile)
+  {
+    // drop everything before the block holding the read position
+    int64_t keepFrom = mPosition - (mPosition % AVI_READ_BLOCK_SIZE);
+    if (keepFrom > mStart) {
+      mStart = keepFrom;
+    }
+    // read whole blocks up to the end of the ring (or the start of the data we're keeping)
+    size_t ringIndex = mEnd % mRingSize;
+    size_t space = mRingSize - (mEnd - mStart);
+    size_t readLength = min(space, mRingSize - ringIndex);
+    // keep the file reads block aligned
+    readLength -= (mEnd + readLength) % AVI_READ_BLOCK_SIZE;
+    if (readLength == 0) {
+      break;
+    }
+    mEnd += _readFile(mEnd, mRing + ringIndex, readLength);
+  }
+  return mEnd > mPosition ? mEnd - mPosition : 0;
+}
+
+
+bool BlockReader::_ensureScratch(size_t length)
+{
+  if (length <= mScratchLength) {
+    return true;
+  }
+  uint8_t *scratch = (uint8_t *)realloc(mScratch, length);
+  if (!scratch) {
+    Serial.printf("Failed to allocate %d bytes for BlockReader scratch buffer.\n", length);
+    return false;
+  }
+  mScratch = scratch;
+  mScratchLength = length;
+  return true;
+}
+
+
+size_t BlockReader::read(void *buffer, size_t length)
+{
+  uint8_t *output = (uint8_t *)buffer;
+  size_t totalRead = 0;
+  while (totalRead < length)
+  {
+    size_t remaining = length - totalRead;
+    // (after a seek, the read position can be past the buffered data)
+    size_t available = mEnd > mPosition ? mEnd - mPosition : 0;
+    if (available == 0)
+    {
+      // big reads skip the ring - read straight into the output up to a block boundary
+      int64_t directEnd = mPosition + remaining;
+      directEnd -= directEnd % AVI_READ_BLOCK_SIZE;
+      if (directEnd - mPosition >= AVI_READ_BLOCK_SIZE)
+      {
+        size_t bytesRead = _readFile(mPosition, output + totalRead, directEnd - mPosition);
+        totalRead += bytesRead;
+        mStart = mEnd = mPosition = mPosition + bytesRead;
+        if (mEndOfFile) {break;}
+        continue;
+      }
+      available = _fill(remaining);
+      if (available == 0) {break;}
+    }
+    // copy out of the ring (at most up to the end of the ring)
+    size_t ringIndex = mPosition % mRingSize;
+    size_t copyLength = min(min(remaining, available), mRingSize - ringIndex);
+    memcpy(output + totalRead, mRing + ringIndex, copyLength);
+    mPosition += copyLength;
+    totalRead += copyLength;
+  }
+  return totalRead;
+}
+
+
+const uint8_t *BlockReader::view(size_t length)
+{
+  size_t ringIndex = mPosition % mRingSize;
+  // the view fits in the ring without wrapping - hand out a pointer to the ring
+  if (ringIndex + length <= mRingSize && length <= mRingSize - AVI_READ_BLOCK_SIZE)
+  {
+    if (_fill(length) < length) {
+      return NULL;
+    }
+    const uint8_t *data = mRing + ringIndex;
+    mPosition += length;
+    return data;
+  }
+  // otherwise it has to be copied into one piece
+  if (!_ensureScratch(length) || read(mScratch, length) < length) {
+    return NULL;
+  }
+  return mScratch;
+}
+
+
+bool BlockReader::seek(int64_t position)
+{
+  if (position < 0) {
+    return false;
+  }
+  if (position >= mStart && position <= mEnd) {
+    mPosition = position;
+    return true;
+  }
+  // outside of the buffered data - start again from the block containing the position
+  int64_t blockStart = position - (position % AVI_READ_BLOCK_SIZE);
+  if (!mSource->isSeekable())
+  {
+    // a forward-only source can't go back before what it has already read
+    if (position < mFilePosition) {
+      return false;
+    }
+    blockStart = max(blockStart, mFilePosition);
+  }
+  mStart = mEnd = blockStart;
+  mPosition = position;
+  mEndOfFile = false;
+  return true;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "ByteSource.h"
+
+// Size of each read from the file. Should be a multiple of the SD card sector size.
+#ifndef AVI_READ_BLOCK_SIZE
+#define AVI_READ_BLOCK_SIZE 4096
+#endif
+
+// Size of the read ring. Must be a multiple of AVI_READ_BLOCK_SIZE.
+#ifndef AVI_READ_RING_SIZE
+  #ifdef FILE_BUFFER_SIZE
+  #define AVI_READ_RING_SIZE (FILE_BUFFER_SIZE * 2)
+  #else
+  #define AVI_READ_RING_SIZE (AVI_READ_BLOCK_SIZE * 8)
+  #endif
+#endif
+
+/**
+ * Reads a file in large, block aligned reads into a ring buffer.
+ *
+ * The ring slot for a file position is always `position % ring size`, so aligned
+ * file reads land on aligned ring slots. Data can be handed out as views into
+ * the ring; it's only copied when a view would wrap around the end of the ring.
+ *
+ * With a forward-only source the ring is also the limit of how far back we can seek.
+ **/
+class BlockReader
+{
+private:
+  ByteSource *mSource = NULL;
+  uint8_t *mRing = NULL;
+  size_t mRingSize;
+  // Linear buffer for views that wrap around the end of the ring.
+  uint8_t *mScratch = NULL;
+  size_t mScratchLength = 0;
+
+  // File positions of the data currently held in the ring: [mStart, mEnd)
+  int64_t mStart = 0;
+  int64_t mEnd = 0;
+  // The current read position (mStart <= mPosition)
+  int64_t mPosition = 0;
+  // The position of the underlying source.
+  int64_t mFilePosition = 0;
+  bool mEndOfFile = false;
+
+  // Read more blocks into the ring until `length` bytes past the read position are buffered (or the ring is full).
+  size_t _fill(size_t length);
+  // Read directly from the source, bypassing the ring.
+  size_t _readFile(int64_t position, uint8_t *buffer, size_t length);
+  bool _ensureScratch(size_t length);
+
+public:
+  // `ringSize` must be a multiple of AVI_READ_BLOCK_SIZE (and views are limited to a block less than it).
+  BlockReader(size_t ringSize = AVI_READ_RING_SIZE);
+  ~BlockReader();
+  // False if the read ring couldn't be allocated.
+  bool isValid() { return mRing != NULL; }
+  // Several readers can share a source - each one seeks it to where it needs.
+  void setSource(ByteSource *source);
+  // Read `length` bytes into `buffer`. Large reads go straight to the buffer.
+  size_t read(void *buffer, size_t length);
+  // Get a pointer to the next `length` bytes, and move past them.
+  // The view is valid until the next call into the reader.
+  const uint8_t *view(size_t length);
+  // Move the read position. Seeking inside the buffered data doesn't touch the file.
+  // Returns false for positions a forward-only source has already passed.
+  bool seek(int64_t position);
+  bool skip(int64_t length) { return seek(mPosition + length); }
+  int64_t tell() { return mPosition; }
+  // True once a read has hit the end of the file.
+  bool eof() { return mEndOfFile && mPosition >= mEnd; }
+  // True if [position, position + length) is already in the ring.
+  bool contains(int64_t position, size_t length) { return position >= mStart && position + (int64_t)length <= mEnd; }
+};
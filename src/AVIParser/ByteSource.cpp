@@ -0,0 +1,272 @@
+#include <Arduino.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "ByteSource.h"
+#include "BlockReader.h"
+#include "../BlockDevice/FatVolume.h"
+#if defined(ESP_PLATFORM) && !defined(DISABLE_FATFS_READS)
+#include <esp_heap_caps.h>
+#if __has_include(<esp_memory_utils.h>)
+#include <esp_memory_utils.h>
+#else
+#include <soc/soc_memory_layout.h>
+#endif
+#endif
+
+
+ByteSource *ByteSource::openFile(const std::string &fileName)
+{
+  ByteSource *source = NULL;
+  #ifndef DISABLE_RAW_SECTOR_READS
+  source = FatVolume::openContiguousFile(fileName);
+  #endif
+  #if defined(ESP_PLATFORM) && !defined(DISABLE_FATFS_READS)
+  if (!source) {
+    source = FatFsByteSource::open(fileName);
+  }
+  #endif
+  if (!source)
+  {
+    FILE *file = fopen(fileName.c_str(), "rb");
+    source = file ? new FileByteSource(file) : NULL;
+  }
+  return source;
+}
+
+
+FileByteSource::FileByteSource(FILE *file) : mFile(file)
+{
+  // the block reader does its own buffering, so skip the extra copy through the stdio buffer
+  setvbuf(mFile, NULL, _IONBF, 0);
+  mPosition = ftello(mFile);
+}
+
+FileByteSource::~FileByteSource()
+{
+  fclose(mFile);
+}
+
+size_t FileByteSource::read(uint8_t *buffer, size_t length)
+{
+  size_t bytesRead = fread(buffer, 1, length, mFile);
+  mPosition += bytesRead;
+  if (bytesRead < length) {
+    clearerr(mFile);
+  }
+  return bytesRead;
+}
+
+bool FileByteSource::seek(int64_t position)
+{
+  if (position == mPosition) {
+    return true;
+  }
+  if (fseeko(mFile, (off_t)position, SEEK_SET) != 0) {
+    return false;
+  }
+  mPosition = position;
+  return true;
+}
+
+
+#if defined(ESP_PLATFORM) && !defined(DISABLE_FATFS_READS)
+// Where the FATFS volume is mounted in the VFS, and its drive number.
+static std::string fatFsMountPoint;
+static int fatFsDrive = -1;
+
+void FatFsByteSource::setVolume(const char *mountPoint, int drive)
+{
+  fatFsMountPoint = mountPoint;
+  // (drive numbers past FF_VOLUMES mean the card wasn't found)
+  fatFsDrive = drive >= 0 && drive < FF_VOLUMES ? drive : -1;
+}
+
+FatFsByteSource *FatFsByteSource::open(const std::string &fileName)
+{
+  if (fatFsDrive < 0 || fileName.compare(0, fatFsMountPoint.length(), fatFsMountPoint) != 0) {
+    return NULL;
+  }
+  // "/sdcard/movie.avi" -> "0:/movie.avi"
+  std::string path = std::to_string(fatFsDrive) + ":" + fileName.substr(fatFsMountPoint.length());
+  FatFsByteSource *source = new FatFsByteSource();
+  if (f_open(&source->mFile, path.c_str(), FA_READ) != FR_OK)
+  {
+    delete source;
+    return NULL;
+  }
+  #if FF_USE_FASTSEEK
+  // the map needs two entries per fragment of the file (plus one), and FATFS tells us how many if it's too small
+  DWORD mapLength = 32;
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    free(source->mLinkMap);
+    source->mLinkMap = (DWORD *)malloc(mapLength * sizeof(DWORD));
+    if (!source->mLinkMap) {
+      break;
+    }
+    source->mLinkMap[0] = mapLength;
+    source->mFile.cltbl = source->mLinkMap;
+    FRESULT result = f_lseek(&source->mFile, CREATE_LINKMAP);
+    if (result == FR_OK) {
+      break;
+    }
+    source->mFile.cltbl = NULL;
+    if (result != FR_NOT_ENOUGH_CORE) {
+      break;
+    }
+    mapLength = source->mLinkMap[0];
+  }
+  if (!source->mFile.cltbl)
+  {
+    free(source->mLinkMap);
+    source->mLinkMap = NULL;
+  }
+  #endif
+  return source;
+}
+
+FatFsByteSource::~FatFsByteSource()
+{
+  f_close(&mFile);
+  free(mBounceBuffer);
+  #if FF_USE_FASTSEEK
+  free(mLinkMap);
+  #endif
+}
+
+size_t FatFsByteSource::_read(uint8_t *buffer, size_t length)
+{
+  UINT bytesRead = 0;
+  if (f_read(&mFile, buffer, length, &bytesRead) != FR_OK) {
+    return 0;
+  }
+  mPosition += bytesRead;
+  return bytesRead;
+}
+
+size_t FatFsByteSource::read(uint8_t *buffer, size_t length)
+{
+  if (esp_ptr_dma_capable(buffer) && ((uintptr_t)buffer & 3) == 0) {
+    return _read(buffer, length);
+  }
+  if (!mBounceBuffer)
+  {
+    mBounceBuffer = (uint8_t *)heap_caps_malloc(AVI_READ_BLOCK_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+    if (!mBounceBuffer) {
+      return _read(buffer, length);
+    }
+  }
+  size_t totalRead = 0;
+  while (totalRead < length)
+  {
+    size_t blockLength = min(length - totalRead, (size_t)AVI_READ_BLOCK_SIZE);
+    size_t bytesRead = _read(mBounceBuffer, blockLength);
+    memcpy(buffer + totalRead, mBounceBuffer, bytesRead);
+    totalRead += bytesRead;
+    if (bytesRead < blockLength) {
+      break;
+    }
+  }
+  return totalRead;
+}
+
+bool FatFsByteSource::seek(int64_t position)
+{
+  if (position == mPosition) {
+    return true;
+  }
+  if (position < 0 || f_lseek(&mFile, (FSIZE_t)position) != FR_OK) {
+    return false;
+  }
+  mPosition = position;
+  return true;
+}
+#endif
+
+
+size_t MemoryByteSource::read(uint8_t *buffer, size_t length)
+{
+  size_t bytesRead = min(length, mLength - mPosition);
+  memcpy(buffer, mData + mPosition, bytesRead);
+  mPosition += bytesRead;
+  return bytesRead;
+}
+
+bool MemoryByteSource::seek(int64_t position)
+{
+  if (position < 0) {
+    return false;
+  }
+  mPosition = min((size_t)position, mLength);
+  return true;
+}
+
+
+size_t ForwardByteSource::read(uint8_t *buffer, size_t length)
+{
+  size_t totalRead = 0;
+  while (totalRead < length && !mEndOfData)
+  {
+    size_t bytesRead = _readSome(buffer + totalRead, length - totalRead);
+    if (bytesRead == 0) {
+      mEndOfData = true;
+    }
+    totalRead += bytesRead;
+  }
+  mPosition += totalRead;
+  return totalRead;
+}
+
+bool ForwardByteSource::seek(int64_t position)
+{
+  if (position < mPosition) {
+    Serial.printf("Can't seek back to %lld in a forward-only source.\n", (long long)position);
+    return false;
+  }
+  uint8_t discard[256];
+  while (mPosition < position)
+  {
+    size_t length = min((int64_t)sizeof(discard), position - mPosition);
+    if (read(discard, length) < length) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+size_t FdByteSource::_readSome(uint8_t *buffer, size_t length)
+{
+  while (true)
+  {
+    ssize_t bytesRead = ::read(mFd, buffer, length);
+    if (bytesRead >= 0) {
+      return bytesRead;
+    }
+    if (errno != EINTR && errno != EAGAIN) {
+      return 0;
+    }
+    // (non-blocking descriptors)
+    if (errno == EAGAIN) {
+      usleep(1000);
+    }
+  }
+}
+
+
+#ifdef ARDUINO
+size_t StreamByteSource::_readSome(uint8_t *buffer, size_t length)
+{
+  unsigned long startTime = millis();
+  int available;
+  while ((available = mStream.available()) <= 0)
+  {
+    if (millis() - startTime > mTimeoutMs) {
+      return 0;
+    }
+    vTaskDelay(1);
+  }
+  return mStream.readBytes(buffer, min(length, (size_t)available));
+}
+#endif
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#if defined(ESP_PLATFORM) && !defined(DISABLE_FATFS_READS)
+#include <ff.h>
+#endif
+
+/**
+ * Where the AVI parser reads its bytes from.
+ *
+ * Seekable sources (files, memory) support random access. Forward-only sources
+ * (pipes, serial links) can only skip ahead, by reading and discarding data.
+ **/
+class ByteSource
+{
+public:
+  virtual ~ByteSource() {}
+  // Read up to `length` bytes from the current position.
+  // Fewer bytes are only returned at the end of the data.
+  virtual size_t read(uint8_t *buffer, size_t length) = 0;
+  // Move to `position`. Returns false if the source can't get there.
+  virtual bool seek(int64_t position) = 0;
+  virtual int64_t tell() = 0;
+  virtual bool isSeekable() { return true; }
+
+  // Open a file by its path the quickest way we can: as raw sectors if it's stored in one piece,
+  // straight through FATFS if it's on the SD card, or through stdio. Returns NULL if it can't be opened.
+  static ByteSource *openFile(const std::string &fileName);
+};
+
+
+// A stdio file (the file is closed with the source).
+class FileByteSource : public ByteSource
+{
+private:
+  FILE *mFile;
+  int64_t mPosition;
+
+public:
+  FileByteSource(FILE *file);
+  ~FileByteSource();
+  size_t read(uint8_t *buffer, size_t length);
+  bool seek(int64_t position);
+  int64_t tell() { return mPosition; }
+};
+
+
+#if defined(ESP_PLATFORM) && !defined(DISABLE_FATFS_READS)
+// A file on the SD card, read with FATFS f_read directly instead of through the VFS and newlib stdio.
+// Reads into DMA-capable memory go straight from the card, as many sectors at a time as FATFS can manage.
+class FatFsByteSource : public ByteSource
+{
+private:
+  FIL mFile;
+  int64_t mPosition = 0;
+  // Reads into memory the SD card's DMA can't reach are bounced through this, a block at a time.
+  // (otherwise the SD driver bounces them itself, one sector at a time)
+  uint8_t *mBounceBuffer = NULL;
+  #if FF_USE_FASTSEEK
+  // The file's cluster map, so seeks don't have to follow the FAT chain.
+  DWORD *mLinkMap = NULL;
+  #endif
+
+  FatFsByteSource() {}
+  size_t _read(uint8_t *buffer, size_t length);
+
+public:
+  // Tell us where FATFS drive `drive` is mounted, so VFS paths can be mapped to FATFS paths.
+  static void setVolume(const char *mountPoint, int drive);
+  // Open a file by its VFS path. Returns NULL if it isn't on the volume (or can't be opened).
+  static FatFsByteSource *open(const std::string &fileName);
+  ~FatFsByteSource();
+  size_t read(uint8_t *buffer, size_t length);
+  bool seek(int64_t position);
+  int64_t tell() { return mPosition; }
+};
+#endif
+
+
+// A buffer in memory (the buffer isn't copied, and must outlive the source).
+class MemoryByteSource : public ByteSource
+{
+private:
+  const uint8_t *mData;
+  size_t mLength;
+  size_t mPosition = 0;
+
+public:
+  MemoryByteSource(const uint8_t *data, size_t length) : mData(data), mLength(length) {}
+  size_t read(uint8_t *buffer, size_t length);
+  bool seek(int64_t position);
+  int64_t tell() { return mPosition; }
+};
+
+
+// Base class for sources that can only be read once, from start to end.
+class ForwardByteSource : public ByteSource
+{
+private:
+  int64_t mPosition = 0;
+  bool mEndOfData = false;
+
+protected:
+  // Read whatever is available (up to `length` bytes), waiting for at least one byte.
+  // Returns 0 at the end of the data.
+  virtual size_t _readSome(uint8_t *buffer, size_t length) = 0;
+
+public:
+  size_t read(uint8_t *buffer, size_t length);
+  // Only forwards. The skipped data is read and thrown away.
+  bool seek(int64_t position);
+  int64_t tell() { return mPosition; }
+  bool isSeekable() { return false; }
+};
+
+
+// A POSIX file descriptor: a pipe or pty on Linux, or a UART through the ESP-IDF VFS (/dev/uart/N).
+class FdByteSource : public ForwardByteSource
+{
+private:
+  int mFd;
+
+protected:
+  size_t _readSome(uint8_t *buffer, size_t length);
+
+public:
+  FdByteSource(int fd) : mFd(fd) {}
+};
+
+
+#ifdef ARDUINO
+class Stream;
+
+// An Arduino Stream, like Serial or the USB CDC port.
+class StreamByteSource : public ForwardByteSource
+{
+private:
+  Stream &mStream;
+  // How long the sender can be quiet before we treat it as the end of the data.
+  unsigned long mTimeoutMs;
+
+protected:
+  size_t _readSome(uint8_t *buffer, size_t length);
+
+public:
+  StreamByteSource(Stream &stream, unsigned long timeoutMs = 5000) : mStream(stream), mTimeoutMs(timeoutMs) {}
+};
+#endif
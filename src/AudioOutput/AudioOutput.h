@@ -10,10 +10,14 @@ class AudioOutput
 {
 protected:
   int mVolume = 255;
+  uint32_t mSampleRate = 0;
 public:
   AudioOutput();
   virtual void start(uint32_t sample_rate) = 0;
   virtual void stop() = 0;
+  // change the sample rate of a running output
+  virtual void setSampleRate(uint32_t sample_rate) = 0;
+  uint32_t getSampleRate() { return mSampleRate; }
   // override this in derived classes to turn the sample into
   // something the output device expects - for the default case
   // this is simply a pass through
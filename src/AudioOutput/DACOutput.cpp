@@ -4,6 +4,7 @@
 
 void DACOutput::start(uint32_t sample_rate)
 {
+    mSampleRate = sample_rate;
     // only include this if we're using DAC - the ESP32-S3 will fail compilation if we include this
     #ifdef USE_DAC_AUDIO
     // i2s config for writing both channels of I2S
@@ -21,6 +21,17 @@ void I2SBase::stop()
   i2s_driver_uninstall(m_i2s_port);
 }
 
+void I2SBase::setSampleRate(uint32_t sample_rate)
+{
+  esp_err_t res = i2s_set_sample_rates(m_i2s_port, sample_rate);
+  if (res != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Error setting sample rate: %d", res);
+    return;
+  }
+  mSampleRate = sample_rate;
+}
+
 void I2SBase::write(uint8_t *samples, int count)
 {
   int sample_index = 0;
@@ -8,6 +8,7 @@ PDMOutput::PDMOutput(i2s_port_t i2s_port, i2s_pin_config_t &i2s_pins) : I2SBase(
 
 void PDMOutput::start(uint32_t sample_rate)
 {
+    mSampleRate = sample_rate;
     // i2s config for writing both channels of I2S
     i2s_config_t i2s_config = {
         .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_TX | I2S_MODE_PDM),
@@ -83,6 +83,17 @@ void PDMTimerOutput::start(uint32_t sample_rate)
   Serial.println("PDM Started");
 }
 
+void PDMTimerOutput::setSampleRate(uint32_t sample_rate)
+{
+  esp_err_t result = timer_set_alarm_value(TIMER_GROUP_0, TIMER_0, 1000000 / sample_rate);
+  if (result != ESP_OK)
+  {
+    Serial.printf("Error setting timer alarm value: %d\n", result);
+    return;
+  }
+  mSampleRate = sample_rate;
+}
+
 void PDMTimerOutput::write(uint8_t *samples, int count)
 {
   // Serial.printf("Count %d\n", mCount);
@@ -15,7 +15,6 @@ class PDMTimerOutput : public AudioOutput
 {
 private:
   gpio_num_t mPDMPin;
-  uint32_t mSampleRate;
   SemaphoreHandle_t mBufferSemaphore;
   int8_t *mBuffer=NULL;;
   int mCurrentIndex=0;
@@ -33,6 +32,7 @@ public:
   }
   void write(uint8_t *samples, int count);
   void start(uint32_t sample_rate);
+  void setSampleRate(uint32_t sample_rate);
   void stop() {}
 
   friend void onTimerCallback(void *arg);
@@ -67,6 +67,17 @@ void PWMTimerOutput::start(uint32_t sample_rate)
   Serial.println("PDM Started");
 }
 
+void PWMTimerOutput::setSampleRate(uint32_t sample_rate)
+{
+  esp_err_t result = timer_set_alarm_value(TIMER_GROUP_0, TIMER_0, 1000000 / sample_rate);
+  if (result != ESP_OK)
+  {
+    Serial.printf("Error setting timer alarm value: %d\n", result);
+    return;
+  }
+  mSampleRate = sample_rate;
+}
+
 void PWMTimerOutput::write(uint8_t *samples, int count)
 {
   // Serial.printf("Count %d\n", mCount);
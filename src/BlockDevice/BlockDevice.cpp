@@ -0,0 +1,124 @@
+#include <Arduino.h>
+#include <string.h>
+#include <esp_heap_caps.h>
+#include "BlockDevice.h"
+#include "../AVIParser/BlockReader.h"
+#ifdef ESP_PLATFORM
+#include <sdmmc_cmd.h>
+#if __has_include(<esp_memory_utils.h>)
+#include <esp_memory_utils.h>
+#else
+#include <soc/soc_memory_layout.h>
+#endif
+#endif
+
+
+FileBlockDevice::~FileBlockDevice()
+{
+  fclose(mFile);
+}
+
+bool FileBlockDevice::readSectors(uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+  size_t sectorSize = getSectorSize();
+  return fseeko(mFile, (off_t)sector * sectorSize, SEEK_SET) == 0
+    && fread(buffer, sectorSize, count, mFile) == count;
+}
+
+
+#ifdef ESP_PLATFORM
+SdmmcBlockDevice::SdmmcBlockDevice(sdmmc_card_t *card, int drive) : mCard(card)
+{
+  // find the volume FATFS mounted, for its lock
+  std::string path = std::to_string(drive) + ":/";
+  FF_DIR dir;
+  if (f_opendir(&dir, path.c_str()) == FR_OK)
+  {
+    mFileSystem = dir.obj.fs;
+    f_closedir(&dir);
+  }
+}
+
+bool SdmmcBlockDevice::readSectors(uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+  #if FF_FS_REENTRANT
+  if (!mFileSystem || !ff_req_grant(mFileSystem->sobj)) {
+    return false;
+  }
+  #endif
+  bool read = sdmmc_read_sectors(mCard, buffer, sector, count) == ESP_OK;
+  #if FF_FS_REENTRANT
+  ff_rel_grant(mFileSystem->sobj);
+  #endif
+  return read;
+}
+
+bool SdmmcBlockDevice::canReadInto(const uint8_t *buffer)
+{
+  return esp_ptr_dma_capable(buffer) && ((uintptr_t)buffer & 3) == 0;
+}
+#endif
+
+
+SectorByteSource::SectorByteSource(BlockDevice *device, uint32_t startSector, int64_t length)
+: mDevice(device), mStartSector(startSector), mLength(length)
+{
+}
+
+SectorByteSource::~SectorByteSource()
+{
+  free(mBounceBuffer);
+}
+
+size_t SectorByteSource::read(uint8_t *buffer, size_t length)
+{
+  size_t sectorSize = mDevice->getSectorSize();
+  length = min((int64_t)length, mLength - mPosition);
+  size_t totalRead = 0;
+  while (totalRead < length)
+  {
+    uint32_t sector = mStartSector + mPosition / sectorSize;
+    size_t offset = mPosition % sectorSize;
+    size_t remaining = length - totalRead;
+    // whole sectors go straight into the buffer
+    if (offset == 0 && remaining >= sectorSize && mDevice->canReadInto(buffer + totalRead))
+    {
+      uint32_t count = remaining / sectorSize;
+      if (!mDevice->readSectors(sector, count, buffer + totalRead)) {
+        break;
+      }
+      totalRead += count * sectorSize;
+      mPosition += count * sectorSize;
+      continue;
+    }
+    // partial sectors (and memory the device can't read into) go through the bounce buffer
+    if (!mBounceBuffer)
+    {
+      mBounceBuffer = (uint8_t *)heap_caps_malloc(AVI_READ_BLOCK_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+      if (!mBounceBuffer) {
+        break;
+      }
+    }
+    uint32_t count = min((offset + remaining + sectorSize - 1) / sectorSize, (size_t)AVI_READ_BLOCK_SIZE / sectorSize);
+    // (the sectors past the end of the file aren't ours)
+    uint32_t endSector = mStartSector + (mLength + sectorSize - 1) / sectorSize;
+    count = min(count, endSector - sector);
+    if (!mDevice->readSectors(sector, count, mBounceBuffer)) {
+      break;
+    }
+    size_t copyLength = min(remaining, count * sectorSize - offset);
+    memcpy(buffer + totalRead, mBounceBuffer + offset, copyLength);
+    totalRead += copyLength;
+    mPosition += copyLength;
+  }
+  return totalRead;
+}
+
+bool SectorByteSource::seek(int64_t position)
+{
+  if (position < 0) {
+    return false;
+  }
+  mPosition = min(position, mLength);
+  return true;
+}
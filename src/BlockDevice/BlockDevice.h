@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "../AVIParser/ByteSource.h"
+#ifdef ESP_PLATFORM
+#include <driver/sdmmc_types.h>
+#include <ff.h>
+#endif
+
+/**
+ * Somewhere sectors can be read from: the SD card driver, or an image file (to test on Linux).
+ **/
+class BlockDevice
+{
+public:
+  virtual ~BlockDevice() {}
+  // Read `count` sectors, starting at `sector`, into `buffer`.
+  virtual bool readSectors(uint32_t sector, uint32_t count, uint8_t *buffer) = 0;
+  virtual size_t getSectorSize() { return 512; }
+  // Whether sectors can be read straight into `buffer` (the SD card can only DMA into some memory).
+  virtual bool canReadInto(const uint8_t * /*buffer*/) { return true; }
+};
+
+
+// A disk image file (the file is closed with the device).
+class FileBlockDevice : public BlockDevice
+{
+private:
+  FILE *mFile;
+
+public:
+  FileBlockDevice(FILE *file) : mFile(file) {}
+  ~FileBlockDevice();
+  bool readSectors(uint32_t sector, uint32_t count, uint8_t *buffer);
+};
+
+
+#ifdef ESP_PLATFORM
+// The SD card, read through the card driver.
+// (reads take the FATFS volume's lock, as the driver can't be used by two tasks at once)
+class SdmmcBlockDevice : public BlockDevice
+{
+private:
+  sdmmc_card_t *mCard;
+  FATFS *mFileSystem = NULL;
+
+public:
+  // `drive` is the FATFS drive the card is mounted as.
+  SdmmcBlockDevice(sdmmc_card_t *card, int drive);
+  bool readSectors(uint32_t sector, uint32_t count, uint8_t *buffer);
+  size_t getSectorSize() { return mCard->csd.sector_size; }
+  bool canReadInto(const uint8_t *buffer);
+};
+#endif
+
+
+// A file laid out in consecutive sectors, read straight from the block device.
+class SectorByteSource : public ByteSource
+{
+private:
+  BlockDevice *mDevice;
+  uint32_t mStartSector;
+  int64_t mLength;
+  int64_t mPosition = 0;
+  // For partial sectors, and memory the device can't read into.
+  uint8_t *mBounceBuffer = NULL;
+
+public:
+  SectorByteSource(BlockDevice *device, uint32_t startSector, int64_t length);
+  ~SectorByteSource();
+  size_t read(uint8_t *buffer, size_t length);
+  bool seek(int64_t position);
+  int64_t tell() { return mPosition; }
+};
@@ -0,0 +1,323 @@
+#include <Arduino.h>
+#include <string.h>
+#include <strings.h>
+#include "FatVolume.h"
+
+
+#define FAT_END_OF_CHAIN 0x0FFFFFF8
+#define FAT_ENTRY_SIZE 32
+#define FAT_ATTR_LONG_NAME 0x0F
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+// The most long name entries a name can have (255 characters, 13 to an entry).
+#define FAT_MAX_LONG_NAME_ENTRIES 20
+
+
+static uint16_t readUint16(const uint8_t *data) { return data[0] | (data[1] << 8); }
+static uint32_t readUint32(const uint8_t *data) { return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24); }
+
+static bool isPowerOfTwo(uint32_t value) { return value && (value & (value - 1)) == 0; }
+
+// Does this look like a FAT boot sector (rather than a partition table)?
+static bool isBootSector(const uint8_t *sector)
+{
+  return (sector[0] == 0xEB || sector[0] == 0xE9) && isPowerOfTwo(readUint16(sector + 11)) && readUint16(sector + 11) >= 512
+    && isPowerOfTwo(sector[13]) && readUint16(sector + 14) > 0 && sector[16] > 0;
+}
+
+// Append a UCS-2 character as UTF-8.
+static void appendUtf8(std::string &text, uint16_t character)
+{
+  if (character < 0x80) {
+    text += (char)character;
+  }
+  else if (character < 0x800) {
+    text += (char)(0xC0 | (character >> 6));
+    text += (char)(0x80 | (character & 0x3F));
+  }
+  else {
+    text += (char)(0xE0 | (character >> 12));
+    text += (char)(0x80 | ((character >> 6) & 0x3F));
+    text += (char)(0x80 | (character & 0x3F));
+  }
+}
+
+// The 8.3 name of a directory entry ("MOVIE   AVI" -> "MOVIE.AVI").
+static std::string shortName(const uint8_t *entry)
+{
+  std::string name((const char *)entry, 8);
+  name.erase(name.find_last_not_of(' ') + 1);
+  std::string extension((const char *)entry + 8, 3);
+  extension.erase(extension.find_last_not_of(' ') + 1);
+  if (name[0] == 0x05) {
+    name[0] = (char)0xE5;
+  }
+  return extension.empty() ? name : name + "." + extension;
+}
+
+// The checksum of a short name, which its long name entries carry.
+static uint8_t shortNameChecksum(const uint8_t *entry)
+{
+  uint8_t sum = 0;
+  for (int i = 0; i < 11; i++) {
+    sum = ((sum & 1) << 7) + (sum >> 1) + entry[i];
+  }
+  return sum;
+}
+
+
+bool FatVolume::mount()
+{
+  mMounted = false;
+  mSectorSize = mDevice->getSectorSize();
+  mSector.resize(mSectorSize);
+  mCachedSector = UINT32_MAX;
+  const uint8_t *sector = _readSector(0);
+  if (!sector || sector[510] != 0x55 || sector[511] != 0xAA) {
+    return false;
+  }
+  // a partitioned card - use the first FAT partition
+  uint32_t volumeStart = 0;
+  if (!isBootSector(sector))
+  {
+    for (int i = 0; i < 4 && volumeStart == 0; i++)
+    {
+      const uint8_t *partition = sector + 446 + i * 16;
+      uint8_t type = partition[4];
+      if (type == 0x04 || type == 0x06 || type == 0x0B || type == 0x0C || type == 0x0E) {
+        volumeStart = readUint32(partition + 8);
+      }
+    }
+    sector = volumeStart ? _readSector(volumeStart) : NULL;
+    if (!sector || !isBootSector(sector))
+    {
+      Serial.println("No FAT16 or FAT32 volume found for raw reads.");
+      return false;
+    }
+  }
+  if (readUint16(sector + 11) != mSectorSize)
+  {
+    Serial.printf("The volume's %u byte sectors don't match the card's.\n", readUint16(sector + 11));
+    return false;
+  }
+
+  mSectorsPerCluster = sector[13];
+  uint32_t reservedSectors = readUint16(sector + 14);
+  uint32_t fatCount = sector[16];
+  uint32_t rootEntries = readUint16(sector + 17);
+  uint32_t totalSectors = readUint16(sector + 19) ? readUint16(sector + 19) : readUint32(sector + 32);
+  uint32_t fatSectors = readUint16(sector + 22) ? readUint16(sector + 22) : readUint32(sector + 36);
+  mRootDirSectors = (rootEntries * FAT_ENTRY_SIZE + mSectorSize - 1) / mSectorSize;
+  mFatStart = volumeStart + reservedSectors;
+  mRootDirStart = mFatStart + fatCount * fatSectors;
+  mDataStart = mRootDirStart + mRootDirSectors;
+  uint32_t systemSectors = reservedSectors + fatCount * fatSectors + mRootDirSectors;
+  if (totalSectors <= systemSectors) {
+    return false;
+  }
+  mClusterCount = (totalSectors - systemSectors) / mSectorsPerCluster;
+  // (the FAT type is decided by the number of clusters, nothing else)
+  if (mClusterCount < 4085)
+  {
+    Serial.println("FAT12 volumes can't be read as raw sectors.");
+    return false;
+  }
+  mFat32 = mClusterCount >= 65525;
+  mRootCluster = mFat32 ? readUint32(sector + 44) : 0;
+  mMounted = true;
+  Serial.printf("FAT%d volume: %u clusters of %u bytes\n", mFat32 ? 32 : 16, mClusterCount, mSectorsPerCluster * mSectorSize);
+  return true;
+}
+
+
+const uint8_t *FatVolume::_readSector(uint32_t sector)
+{
+  if (sector != mCachedSector)
+  {
+    if (!mDevice->readSectors(sector, 1, mSector.data()))
+    {
+      mCachedSector = UINT32_MAX;
+      return NULL;
+    }
+    mCachedSector = sector;
+  }
+  return mSector.data();
+}
+
+
+uint32_t FatVolume::_nextCluster(uint32_t cluster)
+{
+  uint32_t offset = cluster * (mFat32 ? 4 : 2);
+  const uint8_t *sector = _readSector(mFatStart + offset / mSectorSize);
+  if (!sector) {
+    return 0;
+  }
+  if (mFat32) {
+    return readUint32(sector + offset % mSectorSize) & 0x0FFFFFFF;
+  }
+  uint32_t next = readUint16(sector + offset % mSectorSize);
+  return next >= 0xFFF8 ? FAT_END_OF_CHAIN : next;
+}
+
+
+bool FatVolume::_findEntry(uint32_t cluster, const std::string &name, uint32_t *firstCluster, uint32_t *size, bool *isDirectory)
+{
+  uint16_t longName[FAT_MAX_LONG_NAME_ENTRIES * 13];
+  int longNameEntries = 0;
+  uint8_t longNameChecksum = 0;
+  uint32_t entriesPerSector = mSectorSize / FAT_ENTRY_SIZE;
+  // the FAT16 root directory is a run of sectors, everything else is a cluster chain
+  uint32_t sectorCount = cluster ? mSectorsPerCluster : mRootDirSectors;
+  uint32_t firstSector = cluster ? _clusterSector(cluster) : mRootDirStart;
+  while (true)
+  {
+    for (uint32_t sectorIndex = 0; sectorIndex < sectorCount; sectorIndex++)
+    {
+      for (uint32_t entryIndex = 0; entryIndex < entriesPerSector; entryIndex++)
+      {
+        // (re-read each time, as the sector buffer is shared)
+        const uint8_t *sector = _readSector(firstSector + sectorIndex);
+        if (!sector) {
+          return false;
+        }
+        const uint8_t *entry = sector + entryIndex * FAT_ENTRY_SIZE;
+        // the end of the directory
+        if (entry[0] == 0x00) {
+          return false;
+        }
+        uint8_t attributes = entry[11];
+        if (entry[0] == 0xE5)
+        {
+          longNameEntries = 0;
+          continue;
+        }
+        if (attributes == FAT_ATTR_LONG_NAME)
+        {
+          // long names are stored backwards, the last part first
+          int order = entry[0] & 0x3F;
+          if (entry[0] & 0x40)
+          {
+            longNameEntries = order;
+            longNameChecksum = entry[13];
+            memset(longName, 0, sizeof(longName));
+          }
+          if (order < 1 || order > FAT_MAX_LONG_NAME_ENTRIES || order > longNameEntries || entry[13] != longNameChecksum)
+          {
+            longNameEntries = 0;
+            continue;
+          }
+          static const int characterOffsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+          for (int i = 0; i < 13; i++) {
+            longName[(order - 1) * 13 + i] = readUint16(entry + characterOffsets[i]);
+          }
+          continue;
+        }
+        if (attributes & FAT_ATTR_VOLUME_ID)
+        {
+          longNameEntries = 0;
+          continue;
+        }
+
+        std::string entryName;
+        if (longNameEntries > 0 && shortNameChecksum(entry) == longNameChecksum)
+        {
+          for (int i = 0; i < longNameEntries * 13 && longName[i] != 0 && longName[i] != 0xFFFF; i++) {
+            appendUtf8(entryName, longName[i]);
+          }
+        }
+        else {
+          entryName = shortName(entry);
+        }
+        longNameEntries = 0;
+        if (strcasecmp(entryName.c_str(), name.c_str()) == 0)
+        {
+          *firstCluster = ((uint32_t)readUint16(entry + 20) << 16) | readUint16(entry + 26);
+          *size = readUint32(entry + 28);
+          *isDirectory = (attributes & FAT_ATTR_DIRECTORY) != 0;
+          return true;
+        }
+      }
+    }
+    if (!cluster) {
+      return false;
+    }
+    cluster = _nextCluster(cluster);
+    if (cluster < 2 || cluster >= mClusterCount + 2) {
+      return false;
+    }
+    firstSector = _clusterSector(cluster);
+  }
+}
+
+
+bool FatVolume::findContiguousFile(const std::string &path, FatExtent *extent)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (!mMounted) {
+    return false;
+  }
+  // FATFS may have written to the card since we last looked
+  mCachedSector = UINT32_MAX;
+
+  uint32_t cluster = mRootCluster;
+  uint32_t size = 0;
+  bool isDirectory = true;
+  size_t start = 0;
+  while (start < path.length())
+  {
+    size_t end = path.find('/', start);
+    if (end == std::string::npos) {
+      end = path.length();
+    }
+    if (end > start)
+    {
+      if (!isDirectory || !_findEntry(cluster, path.substr(start, end - start), &cluster, &size, &isDirectory)) {
+        return false;
+      }
+    }
+    start = end + 1;
+  }
+  if (isDirectory || size == 0 || cluster < 2) {
+    return false;
+  }
+
+  // follow the chain once - every cluster has to be the one after the last
+  uint32_t clusterBytes = mSectorsPerCluster * mSectorSize;
+  uint32_t clusterCount = (size + clusterBytes - 1) / clusterBytes;
+  if (cluster + clusterCount > mClusterCount + 2) {
+    return false;
+  }
+  for (uint32_t i = 1; i < clusterCount; i++)
+  {
+    if (_nextCluster(cluster + i - 1) != cluster + i) {
+      return false;
+    }
+  }
+  extent->startSector = _clusterSector(cluster);
+  extent->length = size;
+  return true;
+}
+
+
+// The volume mounted in the VFS (if raw reads are enabled).
+static std::string mountedPath;
+static FatVolume *mountedVolume = NULL;
+
+void FatVolume::setMounted(const char *mountPoint, FatVolume *volume)
+{
+  mountedPath = mountPoint ? mountPoint : "";
+  mountedVolume = volume;
+}
+
+ByteSource *FatVolume::openContiguousFile(const std::string &fileName)
+{
+  if (!mountedVolume || fileName.compare(0, mountedPath.length(), mountedPath) != 0 || fileName[mountedPath.length()] != '/') {
+    return NULL;
+  }
+  FatExtent extent;
+  if (!mountedVolume->findContiguousFile(fileName.substr(mountedPath.length()), &extent)) {
+    return NULL;
+  }
+  Serial.println("File is in one piece. Reading it as raw sectors.");
+  return new SectorByteSource(mountedVolume->getDevice(), extent.startSector, extent.length);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include "BlockDevice.h"
+
+// Where a file stored in one piece is on the block device.
+typedef struct
+{
+  uint32_t startSector;
+  int64_t length;
+} FatExtent;
+
+/**
+ * Just enough of a FAT16/FAT32 reader to find a file and check that it's stored in one piece,
+ * so it can be read as raw sectors with no file system in the way. Everything else goes through FATFS.
+ **/
+class FatVolume
+{
+private:
+  BlockDevice *mDevice;
+  uint32_t mSectorSize = 512;
+  uint32_t mSectorsPerCluster = 0;
+  // First sector of the (first) FAT, and of cluster 2.
+  uint32_t mFatStart = 0;
+  uint32_t mDataStart = 0;
+  uint32_t mClusterCount = 0;
+  bool mFat32 = false;
+  // FAT16 keeps the root directory before the data, FAT32 in a cluster chain.
+  uint32_t mRootDirStart = 0;
+  uint32_t mRootDirSectors = 0;
+  uint32_t mRootCluster = 0;
+  bool mMounted = false;
+  // The last FAT or directory sector read.
+  std::vector<uint8_t> mSector;
+  uint32_t mCachedSector = UINT32_MAX;
+  // Files can be opened from several tasks.
+  std::mutex mMutex;
+
+  const uint8_t *_readSector(uint32_t sector);
+  // The cluster after `cluster` in its chain (0 if it can't be read, and >= FAT_END_OF_CHAIN at the end).
+  uint32_t _nextCluster(uint32_t cluster);
+  uint32_t _clusterSector(uint32_t cluster) { return mDataStart + (cluster - 2) * mSectorsPerCluster; }
+  // Look for `name` (ignoring case) in the directory starting at `cluster` (0 for the FAT16 root directory).
+  bool _findEntry(uint32_t cluster, const std::string &name, uint32_t *firstCluster, uint32_t *size, bool *isDirectory);
+
+public:
+  FatVolume(BlockDevice *device) : mDevice(device) {}
+  BlockDevice *getDevice() { return mDevice; }
+  // Read the boot sector (of the first FAT partition, if the device is partitioned).
+  bool mount();
+  // Find a file (by its path from the root of the volume) and check it's stored in one piece.
+  // Returns false if it isn't (or isn't there).
+  bool findContiguousFile(const std::string &path, FatExtent *extent);
+
+  // Where the volume is mounted in the VFS, so files opened by path can be read as raw sectors (NULL to stop).
+  static void setMounted(const char *mountPoint, FatVolume *volume);
+  // Open a file by its VFS path, as raw sectors. Returns NULL if it isn't on the volume or isn't in one piece.
+  static ByteSource *openContiguousFile(const std::string &fileName);
+};
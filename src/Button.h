@@ -10,6 +10,24 @@
   #endif
 #endif
 
+// setup fast forward and rewind pins
+#ifdef FAST_FORWARD_PIN
+  #ifndef FAST_FORWARD_PIN_MODE
+  #define FAST_FORWARD_PIN_MODE INPUT
+  #endif
+  #ifndef FAST_FORWARD_TRIGGER_VAL
+  #define FAST_FORWARD_TRIGGER_VAL LOW
+  #endif
+#endif
+#ifdef REWIND_PIN
+  #ifndef REWIND_PIN_MODE
+  #define REWIND_PIN_MODE INPUT
+  #endif
+  #ifndef REWIND_TRIGGER_VAL
+  #define REWIND_TRIGGER_VAL LOW
+  #endif
+#endif
+
 // setup audio potentiometer pin
 #ifdef VOLUME_POT_PIN
   #ifndef VOLUME_POT_MAX
@@ -29,6 +47,8 @@
 
 
 bool changeChannelPressed = false;
+bool fastForwardPressed = false;
+bool rewindPressed = false;
 int currentVolume = 255;
 bool softPowerEnabled = true;
 
@@ -70,6 +90,12 @@ void buttonInit(){
   #ifdef CHANGE_CHANNEL_PIN
   pinMode(CHANGE_CHANNEL_PIN, CHANGE_CHANNEL_PIN_MODE);
   #endif
+  #ifdef FAST_FORWARD_PIN
+  pinMode(FAST_FORWARD_PIN, FAST_FORWARD_PIN_MODE);
+  #endif
+  #ifdef REWIND_PIN
+  pinMode(REWIND_PIN, REWIND_PIN_MODE);
+  #endif
   #ifdef VOLUME_POT_PIN
   pinMode(VOLUME_POT_PIN, INPUT);
   #endif
@@ -89,6 +115,12 @@ void buttonLoop(){
   #ifdef CHANGE_CHANNEL_PIN
   changeChannelPressed = (digitalRead(CHANGE_CHANNEL_PIN) == CHANGE_CHANNEL_TRIGGER_VAL);
   #endif
+  #ifdef FAST_FORWARD_PIN
+  fastForwardPressed = (digitalRead(FAST_FORWARD_PIN) == FAST_FORWARD_TRIGGER_VAL);
+  #endif
+  #ifdef REWIND_PIN
+  rewindPressed = (digitalRead(REWIND_PIN) == REWIND_TRIGGER_VAL);
+  #endif
   #ifdef VOLUME_POT_PIN
   currentVolume = analogRead(VOLUME_POT_PIN) / (VOLUME_POT_MAX/255);
   #endif
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+// Mix a value with a key (the finaliser from MurmurHash3).
+static inline uint32_t shuffleMix(uint32_t value, uint32_t key)
+{
+  value ^= key;
+  value ^= value >> 16;
+  value *= 0x85EBCA6B;
+  value ^= value >> 13;
+  value *= 0xC2B2AE35;
+  value ^= value >> 16;
+  return value;
+}
+
+/**
+ * The `index`th entry of a shuffle of 0..count-1, without having to store the shuffle.
+ * A Feistel network shuffles every number with an even number of bits, so indexes that land past `count`
+ * are shuffled again until they land inside it (it takes fewer than four goes on average).
+ **/
+static inline uint32_t shuffledIndex(uint32_t index, uint32_t count, uint32_t seed)
+{
+  if (count <= 1 || index >= count) {
+    return 0;
+  }
+  int halfBits = 1;
+  while (halfBits < 16 && (1ull << (halfBits * 2)) < count) {
+    halfBits++;
+  }
+  uint32_t halfMask = (1u << halfBits) - 1;
+  do {
+    uint32_t left = index >> halfBits;
+    uint32_t right = index & halfMask;
+    for (uint32_t round = 0; round < 4; round++) {
+      uint32_t next = left ^ (shuffleMix(right, seed + round * 0x9E3779B9) & halfMask);
+      left = right;
+      right = next;
+    }
+    index = (left << halfBits) | right;
+  } while (index >= count);
+  return index;
+}
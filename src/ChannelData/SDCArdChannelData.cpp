@@ -1,6 +1,8 @@
 #include <Arduino.h>
+#include <sys/time.h>
 #include "../SDCard.h"
 #include "SDCardChannelData.h"
+#include "ChannelShuffle.h"
 #include "../AVIParser/AVIParser.h"
 
 
@@ -9,10 +11,20 @@
 RTC_DATA_ATTR uint32_t shuffleSeed = 0;
 // The index of the current channel in the shuffle
 RTC_DATA_ATTR uint32_t shuffledChannelIndex = 0;
+// The file and number of the channel that was playing, so it can be reopened without listing the files.
+RTC_DATA_ATTR char currentChannelPath[256] = "";
+RTC_DATA_ATTR int currentChannelNumber = 0;
 
+// Live TV mode: every channel plays as if it has been broadcasting on a loop since LIVE_TV_EPOCH
+// (in seconds of system time, which keeps counting through deep sleep).
+#ifndef LIVE_TV_EPOCH
+#define LIVE_TV_EPOCH 0
+#endif
 
-ChannelData::ChannelData(SDCard *sdCard, const char *aviPath, const char *bumperPath): mSDCard(sdCard), mAviPath(aviPath), mBumperPath(bumperPath) {
 
+ChannelData::ChannelData(SDCard *sdCard, const char *aviPath, const char *bumperPath): mSDCard(sdCard), mAviPath(aviPath), mBumperPath(bumperPath), mCatalog(sdCard, ".avi"), mFileCache(psramFound() ? FILE_CACHE_BYTES : 0) {
+  // let the AVI parser play files from the cache
+  FileCache::setShared(&mFileCache);
 }
 
 bool ChannelData::fetchChannelData() {
@@ -22,9 +34,10 @@ bool ChannelData::fetchChannelData() {
     return false;
   }
 
-  // get the list of AVI files
-  mAviFiles = mSDCard->listFiles(mAviPath, ".avi");
-  mBumperFiles = mSDCard->listFiles(mBumperPath, ".avi");
+  // get the list of AVI files (from the catalog, which is checked against the card in the background)
+  mCatalog.load({mAviPath, mBumperPath});
+  _loadFileCounts();
+  mCatalog.startUpdate();
 
   
 
@@ -42,7 +55,7 @@ bool ChannelData::fetchChannelData() {
   }
   reshuffleChannels();
 
-  if (mAviFiles.size() == 0) {
+  if (mChannelCount == 0) {
     Serial.println("No AVI files found");
     return false;
   }
@@ -50,55 +63,231 @@ bool ChannelData::fetchChannelData() {
 }
 
 
+void ChannelData::_loadFileCounts() {
+  mCatalogGeneration = mCatalog.getGeneration();
+  mChannelCount = mCatalog.getFileCount(mAviPath);
+  mBumperCount = mCatalog.getFileCount(mBumperPath);
+}
+
+
+int ChannelData::getChannelLength(int channelIndex) {
+  MediaInfo info;
+  return getChannelInfo(channelIndex, &info) ? info.durationMs : -1;
+}
+
+
+bool ChannelData::getChannelInfo(int channelIndex, MediaInfo *info) {
+  if (channelIndex < 0) {
+    return mCatalog.getInfo(mBumperPath, abs(channelIndex) - 1, info);
+  }
+  return mCatalog.getInfo(mAviPath, channelIndex, info);
+}
+
+
 void ChannelData::setChannel(int channel) {
   if (!mSDCard->isMounted()) {
     Serial.println("SD card is not mounted");
     return;
   }
   // check that the channel is valid
-  if (channel < 0 && abs(channel) > mBumperFiles.size()){
+  if (channel < 0 && abs(channel) > mBumperCount){
     Serial.printf("Invalid bumper channel %d (%d)\n", channel, abs(channel) - 1);
     return;
   }
-  if (channel >= 0 && channel >= mAviFiles.size()) {
+  if (channel >= 0 && (uint32_t)channel >= mChannelCount) {
     Serial.printf("Invalid channel %d\n", channel);
     return;
   }
+  // the channel may already be open
+  if (mNextChannelVideoParser && channel == mNextChannelNumber) {
+    switchToNextChannel();
+    return;
+  }
+  _discardNextChannel();
   // close any open AVI files
   if (mCurrentChannelVideoParser) {
     delete mCurrentChannelVideoParser;
     mCurrentChannelVideoParser = NULL;
   }
   // open the AVI file
-  std::string aviFilename;
+  std::string aviFilename = _getChannelPath(channel);
+  if (aviFilename.empty()) {
+    Serial.printf("Channel %d is not in the catalog\n", channel);
+    return;
+  }
+  _setCurrentChannel(openParser(aviFilename, channel, 0), aviFilename, channel);
+}
+
+
+std::string ChannelData::_getChannelPath(int channel) {
   // Channels from -1 and below are bumpers
-  if (channel < 0 && mBumperFiles.size() > 0){
-    aviFilename = mBumperFiles[abs(channel) - 1];
+  if (channel < 0){
+    return mCatalog.getFilePath(mBumperPath, abs(channel) - 1);
   }
   // Otherwise, it's a normal channel
-  else {
-    aviFilename = mAviFiles[channel];
+  return mCatalog.getFilePath(mAviPath, channel);
+}
+
+
+bool ChannelData::pickNextChannel(int *channel, std::string *aviFilename) {
+  if (!mSDCard->isMounted()) {
+    return false;
+  }
+  if (!mHasNextChannel) {
+    mNextChannelNumber = _pickNextChannel();
+    mHasNextChannel = true;
+  }
+  mNextChannelPath = _getChannelPath(mNextChannelNumber);
+  if (mNextChannelPath.empty()) {
+    // pick another one next time
+    mHasNextChannel = false;
+    return false;
+  }
+  Serial.printf("Preparing channel %d\n", mNextChannelNumber);
+  _requestCaching(mNextChannelNumber, mNextChannelPath);
+  *channel = mNextChannelNumber;
+  *aviFilename = mNextChannelPath;
+  return true;
+}
+
+
+void ChannelData::setNextVideoParser(AVIParser *parser) {
+  if (mNextChannelVideoParser) {
+    delete mNextChannelVideoParser;
+  }
+  mNextChannelVideoParser = parser;
+  if (!parser) {
+    // pick another one next time
+    mHasNextChannel = false;
+  }
+}
+
+
+bool ChannelData::switchToNextChannel() {
+  if (!mNextChannelVideoParser) {
+    return false;
+  }
+  Serial.printf("Switching to prepared channel %d\n", mNextChannelNumber);
+  _setCurrentChannel(mNextChannelVideoParser, mNextChannelPath, mNextChannelNumber);
+  mNextChannelVideoParser = NULL;
+  mHasNextChannel = false;
+  return true;
+}
+
+
+bool ChannelData::fillCache() {
+  #ifndef DISABLE_FILE_CACHE
+  // bumpers are picked at random, so the one after this channel can be picked (and read into memory) now
+  if (!mHasNextChannel && mChannelNumber >= 0 && mBumperCount > 0) {
+    mNextChannelNumber = _pickNextChannel();
+    mHasNextChannel = true;
+    _requestCaching(mNextChannelNumber, _getChannelPath(mNextChannelNumber));
+  }
+  return mFileCache.fill();
+  #else
+  return false;
+  #endif
+}
+
+
+void ChannelData::_requestCaching(int channel, const std::string &aviFilename) {
+  #ifndef DISABLE_FILE_CACHE
+  MediaInfo info;
+  if (!aviFilename.empty() && getChannelInfo(channel, &info)) {
+    mFileCache.request(aviFilename, info.size);
+  }
+  #else
+  (void)channel;
+  (void)aviFilename;
+  #endif
+}
+
+
+void ChannelData::_discardNextChannel() {
+  if (mNextChannelVideoParser) {
+    delete mNextChannelVideoParser;
+    mNextChannelVideoParser = NULL;
+  }
+  mHasNextChannel = false;
+}
+
+
+bool ChannelData::resumeChannel() {
+  if (!mSDCard->isMounted() || currentChannelPath[0] == '\0') {
+    return false;
+  }
+  _discardNextChannel();
+  if (mCurrentChannelVideoParser) {
+    delete mCurrentChannelVideoParser;
+    mCurrentChannelVideoParser = NULL;
   }
+  Serial.printf("Resuming channel %d\n", currentChannelNumber);
+  std::string aviFilename = currentChannelPath;
+  _setCurrentChannel(openParser(aviFilename, currentChannelNumber, 0), aviFilename, currentChannelNumber);
+  return mCurrentChannelVideoParser != NULL;
+}
+
+
+AVIParser *ChannelData::openParser(const std::string &aviFilename, int channel, uint32_t startsInMs, bool resume) {
   Serial.printf("Opening AVI file %s\n", aviFilename.c_str());
-  mCurrentChannelVideoParser = new AVIParser(aviFilename, AVIChunkType::VIDEO);
-  if (!mCurrentChannelVideoParser->open()) {
+  AVIParser *parser = new AVIParser(aviFilename, AVIChunkType::VIDEO);
+  if (!parser->open(resume)) {
     Serial.printf("Failed to open AVI file %s\n", aviFilename.c_str());
+    delete parser;
+    return NULL;
+  }
+  #ifdef LIVE_TV
+  // (bumpers always play from the start)
+  if (channel >= 0) {
+    _seekToLivePosition(parser, startsInMs);
+  }
+  #endif
+  return parser;
+}
+
+
+void ChannelData::_setCurrentChannel(AVIParser *parser, const std::string &aviFilename, int channel) {
+  if (mCurrentChannelVideoParser) {
     delete mCurrentChannelVideoParser;
-    mCurrentChannelVideoParser = NULL;
+  }
+  mCurrentChannelVideoParser = parser;
+  // (a channel opened ahead of time only becomes the one to resume once it's playing)
+  if (parser) {
+    parser->markPlaying();
+  }
+  if (parser && aviFilename.length() < sizeof(currentChannelPath)) {
+    strcpy(currentChannelPath, aviFilename.c_str());
+    currentChannelNumber = channel;
+  }
+  else {
+    currentChannelPath[0] = '\0';
   }
   mChannelNumber = channel;
+  // (short files are played again soon enough to be worth keeping in memory)
+  if (parser) {
+    _requestCaching(channel, aviFilename);
+  }
 }
 
 
-void ChannelData::_initShuffledChannels(){
-  if (mShuffledChannels.size() != mAviFiles.size()){
-    mShuffledChannels.resize(mAviFiles.size());
+void ChannelData::_seekToLivePosition(AVIParser *parser, uint32_t startsInMs) {
+  uint32_t durationMs = parser->getDurationMs();
+  if (durationMs == 0) {
+    Serial.println("Unknown channel length. Playing from the start.");
+    return;
   }
-  for (int i = 0; i < mAviFiles.size(); i++){
-    mShuffledChannels[i] = i;
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  int64_t broadcastMs = ((int64_t)now.tv_sec - LIVE_TV_EPOCH) * 1000 + now.tv_usec / 1000 + startsInMs;
+  // (the clock may not have been set, and be before the epoch)
+  uint32_t positionMs = ((broadcastMs % durationMs) + durationMs) % durationMs;
+  Serial.printf("Tuning in %ums into the broadcast.\n", positionMs);
+  if (!parser->seekToTimeMs(positionMs)) {
+    Serial.println("Failed to seek to the broadcast position. Playing from the start.");
   }
 }
 
+
 void ChannelData::_resetShuffleSeed(){
   shuffleSeed = esp_random();
   Serial.printf("New shuffle seed: %u\n", shuffleSeed);
@@ -106,22 +295,12 @@ void ChannelData::_resetShuffleSeed(){
 
 
 void ChannelData::reshuffleChannels(){
-  Serial.println("Reshuffling channels...");
-  _initShuffledChannels();
-  // Seed the pseudo rng with the stored value
-  randomSeed(shuffleSeed);
-
-  for (int idx = 0; idx < mShuffledChannels.size() - 2; idx++){
-    int idx2 = random(idx, mShuffledChannels.size());
-    int tmp = mShuffledChannels[idx];
-    mShuffledChannels[idx] = mShuffledChannels[idx2];
-    mShuffledChannels[idx2] = tmp;
-  }
+  Serial.printf("Shuffling %u channels with seed %u\n", mChannelCount, shuffleSeed);
 
   #if CORE_DEBUG_LEVEL > 2
   Serial.println("Shuffled order:");
-  for (int i = 0; i < mShuffledChannels.size(); i++){
-    Serial.printf("%d ", mShuffledChannels[i]);
+  for (uint32_t i = 0; i < mChannelCount && i < 100; i++){
+    Serial.printf("%u ", shuffledIndex(i, mChannelCount, shuffleSeed));
   }
   Serial.print("\n");
   #endif
@@ -129,20 +308,35 @@ void ChannelData::reshuffleChannels(){
 
 
 int ChannelData::getNextChannel(){
+  // (it may already have been picked, to open it ahead of time)
+  if (mHasNextChannel) {
+    return mNextChannelNumber;
+  }
+  return _pickNextChannel();
+}
+
+
+int ChannelData::_pickNextChannel(){
   // If it's currently a normal channel, return a random bumper next (if we have any)
-  if (mChannelNumber >= 0 && mBumperFiles.size() > 0){
+  if (mChannelNumber >= 0 && mBumperCount > 0){
     randomSeed(esp_random());
-    int bumperIndex = random(0, mBumperFiles.size());
+    int bumperIndex = random(0, mBumperCount);
     return -1 * (bumperIndex + 1);
   }
+  // pick up any files the catalog has found since we last looked
+  if (mCatalogGeneration != mCatalog.getGeneration()) {
+    Serial.println("The list of files has changed.");
+    _loadFileCounts();
+    reshuffleChannels();
+  }
   // If we previously played a bumper, or we have no bumpers, return the next normal channel
   shuffledChannelIndex++;
-  if (shuffledChannelIndex >= mShuffledChannels.size()){
+  if (shuffledChannelIndex >= mChannelCount){
     shuffledChannelIndex = 0;
     _resetShuffleSeed();
     reshuffleChannels();
   }
-  return mShuffledChannels[shuffledChannelIndex];
+  return shuffledIndex(shuffledChannelIndex, mChannelCount, shuffleSeed);
 }
 
 
@@ -150,9 +344,12 @@ int ChannelData::peekNextChannelNum(){
   // Attempt to peek at the next channel, without iterating.
   // This won't work correctly if the channels would need to be reshuffled,
   // but that doesn't matter much, since this is only for displaying the next channel number.
-  if (mShuffledChannels.size() == 0){
+  if (mHasNextChannel && mNextChannelNumber >= 0){
+    return mNextChannelNumber;
+  }
+  if (mChannelCount == 0){
     return 0;
   }
-  uint32_t wrappedIndex = (shuffledChannelIndex + 1) % mShuffledChannels.size();
-  return mShuffledChannels[wrappedIndex];
+  uint32_t wrappedIndex = (shuffledChannelIndex + 1) % mChannelCount;
+  return shuffledIndex(wrappedIndex, mChannelCount, shuffleSeed);
 }
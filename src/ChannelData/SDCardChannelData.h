@@ -2,6 +2,8 @@
 
 #include <vector>
 #include <string>
+#include "../MediaCatalog/MediaCatalog.h"
+#include "../FileCache/FileCache.h"
 
 class SDCard;
 class AVIParser;
@@ -13,33 +15,52 @@ protected:
 private:
   const char *mChannelInfoURL = NULL;
 
-  std::vector<std::string> mAviFiles;
-  std::vector<std::string> mBumperFiles;
-  // Hold a shuffled list of channel indices and the current index in that list.
-  std::vector<int> mShuffledChannels;
-
   AVIParser *mCurrentChannelVideoParser = NULL;
+  // The channel getNextChannel will return, once it has been picked ahead of time.
+  bool mHasNextChannel = false;
+  int mNextChannelNumber = 0;
+  // The next channel's file, opened ahead of time (NULL if it isn't open).
+  AVIParser *mNextChannelVideoParser = NULL;
+  std::string mNextChannelPath;
 
   SDCard *mSDCard;
   const char *mAviPath;
   const char *mBumperPath;
+  // The files (and what's in them) are looked up in the catalog, which keeps itself up to date.
+  MediaCatalog mCatalog;
+  uint32_t mCatalogGeneration = 0;
+  // Cached from the catalog (and updated when its generation changes).
+  uint32_t mChannelCount = 0;
+  uint32_t mBumperCount = 0;
+  // Bumpers and other short files, kept in PSRAM as they're played over and over (if there is any PSRAM).
+  FileCache mFileCache;
 
-  // initialize the shuffled channel list to an ordered list of channel indices
-  void _initShuffledChannels();
   // create and store a new shuffle seed
   void _resetShuffleSeed();
+  // Make an opened file the current channel.
+  void _setCurrentChannel(AVIParser *parser, const std::string &aviFilename, int channel);
+  std::string _getChannelPath(int channel);
+  // Pick the next channel from the shuffle (or a bumper).
+  int _pickNextChannel();
+  void _discardNextChannel();
+  // Ask for a channel's file to be kept in memory (if it's short enough).
+  void _requestCaching(int channel, const std::string &aviFilename);
+  // Take the file counts from the catalog.
+  void _loadFileCounts();
+  // Seek a channel to where its broadcast will be in `startsInMs`.
+  void _seekToLivePosition(AVIParser *parser, uint32_t startsInMs);
 public:
   ChannelData(SDCard *sdCard, const char *aviPath, const char *bumperPath);
   bool fetchChannelData();
   int getChannelCount() {
-    return mAviFiles.size();
-  };
-  int getChannelLength(int channelIndex) {
-    // we don't know the length of the AVI file
-    return -1;
+    return mChannelCount;
   };
+  // Length of the channel in milliseconds, or -1 if we don't know it yet.
+  int getChannelLength(int channelIndex);
+  // What the catalog knows about the channel's file. Returns false if it hasn't been catalogued yet.
+  bool getChannelInfo(int channelIndex, MediaInfo *info);
 
-  // Reshuffle the channel list.
+  // Reshuffle the channel list. (the shuffle is worked out from the seed as it's needed, so this only logs it)
   void reshuffleChannels();
   // Get the next channel index from the shuffle.
   int getNextChannel();
@@ -49,6 +70,27 @@ public:
   AVIParser *getVideoParser() {
     return mCurrentChannelVideoParser;
   };
+  // Pick the next channel ahead of time, so it can be opened (with openParser) and follow on from the current one
+  // without a gap. Returns false if there's no file for it.
+  bool pickNextChannel(int *channel, std::string *aviFilename);
+  // Make the file opened for the picked next channel the prepared one (NULL if it couldn't be opened).
+  void setNextVideoParser(AVIParser *parser);
+  // Open a channel's file, ready to start playing in `startsInMs`. Returns NULL if it can't be opened.
+  // (nothing else in here is touched, so it can be called from any task - with `resume` false when the
+  // channel is opened ahead of time, so the resume state of the one playing is left alone)
+  AVIParser *openParser(const std::string &aviFilename, int channel, uint32_t startsInMs, bool resume = true);
+  // The prepared next channel's file (NULL if there isn't one).
+  AVIParser *getNextVideoParser() {
+    return mNextChannelVideoParser;
+  };
+  int getNextChannelNumber() { return mNextChannelNumber; }
+  // Make the prepared next channel the current one. Returns false if there isn't one.
+  bool switchToNextChannel();
+  // Read the next block of a file into the file cache, while the SD card isn't needed for anything else.
+  // Returns false if there was nothing to read.
+  bool fillCache();
   void setChannel(int channel);
+  // Reopen the channel that was playing before deep sleep (without needing fetchChannelData first).
+  bool resumeChannel();
   int getChannelNumber() { return mChannelNumber; }
 };
\ No newline at end of file
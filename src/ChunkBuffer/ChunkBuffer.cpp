@@ -0,0 +1,146 @@
+#include <Arduino.h>
+#include "ChunkBuffer.h"
+
+
+ChunkBuffer::ChunkBuffer(size_t capacity): mCapacity(capacity)
+{
+  mRingBuffer = xRingbufferCreate(capacity, RINGBUF_TYPE_NOSPLIT);
+  if (!mRingBuffer) {
+    Serial.printf("Failed to allocate %d byte read-ahead buffer.\n", capacity);
+    mCapacity = 0;
+  }
+}
+
+ChunkBuffer::~ChunkBuffer()
+{
+  if (mRingBuffer) {
+    vRingbufferDelete(mRingBuffer);
+  }
+  free(mOversize);
+}
+
+
+bool ChunkBuffer::_growOversize(size_t length)
+{
+  if (length <= mOversizeCapacity) {
+    return true;
+  }
+  uint8_t *oversize = (uint8_t *)realloc(mOversize, length);
+  if (!oversize) {
+    Serial.printf("Failed to allocate %d bytes for an oversize chunk.\n", length);
+    return false;
+  }
+  mOversize = oversize;
+  mOversizeCapacity = length;
+  return true;
+}
+
+
+bool ChunkBuffer::canHold(size_t length)
+{
+  if (!mRingBuffer) {
+    return false;
+  }
+  if (_fitsRing(length) || length <= mOversizeCapacity) {
+    return true;
+  }
+  // (while the consumer still has the block, it can't be grown yet - acquire will have another go)
+  return mOversizeInUse || _growOversize(length);
+}
+
+
+ChunkPacket *ChunkBuffer::acquire(chunk_type chunkType, size_t length, TickType_t wait)
+{
+  if (!mRingBuffer) {
+    return NULL;
+  }
+  ChunkPacket *packet = NULL;
+  bool oversize = !_fitsRing(length);
+  if (oversize)
+  {
+    if (mOversizeInUse)
+    {
+      // the consumer hasn't finished with the last oversize chunk
+      mProducerStalls++;
+      vTaskDelay(wait);
+      if (mOversizeInUse) {
+        return NULL;
+      }
+    }
+    if (!_growOversize(length)) {
+      return NULL;
+    }
+  }
+  size_t packetSize = sizeof(ChunkPacket) + (oversize ? 0 : length);
+  if (xRingbufferSendAcquire(mRingBuffer, (void **)&packet, packetSize, 0) != pdTRUE)
+  {
+    // the buffer is full - we're as far ahead as we can get
+    mProducerStalls++;
+    if (xRingbufferSendAcquire(mRingBuffer, (void **)&packet, packetSize, wait) != pdTRUE) {
+      return NULL;
+    }
+  }
+  packet->chunkType = chunkType;
+  packet->length = length;
+  packet->oversize = NULL;
+  if (oversize)
+  {
+    packet->oversize = mOversize;
+    mOversizeInUse = true;
+  }
+  packet->presentationSample = NO_PRESENTATION_TIME;
+  packet->startsTimeline = false;
+  packet->generation = mGeneration;
+  return packet;
+}
+
+
+void ChunkBuffer::send(ChunkPacket *packet)
+{
+  xRingbufferSendComplete(mRingBuffer, packet);
+}
+
+
+ChunkPacket *ChunkBuffer::receive(TickType_t wait)
+{
+  if (!mRingBuffer) {
+    return NULL;
+  }
+  size_t packetSize;
+  ChunkPacket *packet = (ChunkPacket *)xRingbufferReceive(mRingBuffer, &packetSize, 0);
+  if (!packet)
+  {
+    // the read-ahead task has fallen behind
+    mConsumerStalls++;
+    packet = (ChunkPacket *)xRingbufferReceive(mRingBuffer, &packetSize, wait);
+  }
+  return packet;
+}
+
+
+void ChunkBuffer::release(ChunkPacket *packet)
+{
+  if (packet->oversize) {
+    mOversizeInUse = false;
+  }
+  vRingbufferReturnItem(mRingBuffer, packet);
+}
+
+
+size_t ChunkBuffer::getMaxChunkLength()
+{
+  if (!mRingBuffer) {
+    return 0;
+  }
+  size_t maxItemSize = xRingbufferGetMaxItemSize(mRingBuffer);
+  return maxItemSize > sizeof(ChunkPacket) ? maxItemSize - sizeof(ChunkPacket) : 0;
+}
+
+
+size_t ChunkBuffer::getFillLevel()
+{
+  if (!mRingBuffer) {
+    return 0;
+  }
+  return mCapacity - xRingbufferGetCurFreeSize(mRingBuffer);
+}
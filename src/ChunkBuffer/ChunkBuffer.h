@@ -0,0 +1,80 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/ringbuf.h>
+#include <string>
+#include <atomic>
+#include "../AVIParser/AVIParser.h"
+
+// A chunk with no presentation time (it's played as soon as it's reached).
+#define NO_PRESENTATION_TIME UINT32_MAX
+
+// One chunk of audio or video data, read ahead of playback.
+// The chunk data follows directly after this header (unless it's too big for the ring - see `oversize`).
+typedef struct
+{
+  chunk_type chunkType;
+  uint32_t length;
+  // The chunk's data, when it's held in the buffer's oversize block rather than after the header.
+  uint8_t *oversize;
+  // When the chunk plays, in audio samples along the current timeline (or NO_PRESENTATION_TIME).
+  uint32_t presentationSample;
+  // The first chunk of a new timeline (after a channel change or a seek), which starts from sample 0.
+  bool startsTimeline;
+  // The buffer's generation when the packet was acquired (it's stale once the buffer has been cleared).
+  uint32_t generation;
+} ChunkPacket;
+
+/**
+ * A bounded ring of chunk packets, filled by the read-ahead task and drained by the audio task.
+ * Packets are read straight into the ring, and handed out without copying.
+ **/
+class ChunkBuffer
+{
+private:
+  RingbufHandle_t mRingBuffer = NULL;
+  size_t mCapacity = 0;
+  // Number of times the producer had to wait for free space.
+  uint32_t mProducerStalls = 0;
+  // Number of times the consumer had to wait for a packet.
+  uint32_t mConsumerStalls = 0;
+  // Moved on by each clear, so anything taken from the buffer before then can be told apart.
+  std::atomic<uint32_t> mGeneration{0};
+  // A ring item can be at most about half the ring, so bigger chunks are read into a block of their own
+  // (grown as needed, by the producer), one at a time. Their packet in the ring just points to it.
+  uint8_t *mOversize = NULL;
+  size_t mOversizeCapacity = 0;
+  std::atomic<bool> mOversizeInUse{false};
+
+  bool _fitsRing(size_t length) { return length <= getMaxChunkLength(); }
+  bool _growOversize(size_t length);
+
+public:
+  ChunkBuffer(size_t capacity);
+  ~ChunkBuffer();
+  // Reserve space for a packet with `length` bytes of data.
+  // Returns NULL if there isn't enough room within `wait` ticks.
+  ChunkPacket *acquire(chunk_type chunkType, size_t length, TickType_t wait);
+  // Hand a filled packet (from acquire) to the consumer.
+  void send(ChunkPacket *packet);
+  // Get the next packet. Returns NULL if nothing arrives within `wait` ticks.
+  ChunkPacket *receive(TickType_t wait);
+  // Give a received packet's space back to the producer.
+  void release(ChunkPacket *packet);
+  // Throw away all unread packets. They're marked stale (by starting a new generation), and the consumer
+  // releases them as it gets to them, so the producer never takes packets from under it.
+  void clear() { mGeneration++; }
+  uint32_t getGeneration() { return mGeneration; }
+  bool isStale(ChunkPacket *packet) { return packet->generation != mGeneration; }
+
+  static uint8_t *data(ChunkPacket *packet) { return packet->oversize ? packet->oversize : (uint8_t *)(packet + 1); }
+  // The largest chunk that fits in the ring itself.
+  size_t getMaxChunkLength();
+  // Whether a chunk of `length` bytes can be taken at all (bigger ones than the ring holds need the memory
+  // for the oversize block). Producer only.
+  bool canHold(size_t length);
+  size_t getCapacity() { return mCapacity; }
+  size_t getFillLevel();
+  uint32_t getProducerStalls() { return mProducerStalls; }
+  uint32_t getConsumerStalls() { return mConsumerStalls; }
+};
@@ -0,0 +1,176 @@
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include "FileCache.h"
+
+
+FileCache::Entry::~Entry()
+{
+  free(data);
+}
+
+
+FileCache::~FileCache()
+{
+  _stopFilling();
+}
+
+
+std::shared_ptr<FileCache::Entry> FileCache::_find(const std::string &fileName)
+{
+  for (auto entry = mEntries.begin(); entry != mEntries.end(); entry++)
+  {
+    if ((*entry)->fileName == fileName)
+    {
+      mEntries.splice(mEntries.begin(), mEntries, entry);
+      return mEntries.front();
+    }
+  }
+  return NULL;
+}
+
+
+void FileCache::request(const std::string &fileName, size_t length)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (length == 0 || length > FILE_CACHE_MAX_FILE_BYTES || length > mBudget) {
+    return;
+  }
+  std::shared_ptr<Entry> entry = _find(fileName);
+  if (entry && entry->length == length) {
+    return;
+  }
+  if (entry)
+  {
+    // the file has changed since it was cached
+    mCachedBytes -= entry->length;
+    mEntries.pop_front();
+  }
+  if (mFilling && mFilling->fileName == fileName) {
+    return;
+  }
+  for (auto &request : mRequests)
+  {
+    if (request.fileName == fileName) {
+      return;
+    }
+  }
+  // the latest request is the one that's wanted soonest
+  mRequests.push_front({fileName, length});
+  if (mRequests.size() > 4) {
+    mRequests.pop_back();
+  }
+}
+
+
+bool FileCache::isCached(const std::string &fileName)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  for (auto &entry : mEntries)
+  {
+    if (entry->fileName == fileName) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+bool FileCache::_startFilling()
+{
+  while (!mRequests.empty())
+  {
+    Request request = mRequests.front();
+    mRequests.pop_front();
+    if (_find(request.fileName)) {
+      continue;
+    }
+    mFillSource = ByteSource::openFile(request.fileName);
+    if (!mFillSource) {
+      continue;
+    }
+    // make room, dropping the least recently used files (they stay in memory until they've finished playing)
+    while (!mEntries.empty() && mCachedBytes + request.length > mBudget)
+    {
+      Serial.printf("Dropping %s from the file cache\n", mEntries.back()->fileName.c_str());
+      mCachedBytes -= mEntries.back()->length;
+      mEntries.pop_back();
+    }
+    mFilling = std::make_shared<Entry>();
+    mFilling->fileName = request.fileName;
+    mFilling->length = request.length;
+    mFilling->data = (uint8_t *)heap_caps_malloc(request.length, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!mFilling->data)
+    {
+      Serial.printf("No memory to cache %s\n", request.fileName.c_str());
+      _stopFilling();
+      continue;
+    }
+    mFilled = 0;
+    return true;
+  }
+  return false;
+}
+
+
+void FileCache::_stopFilling()
+{
+  delete mFillSource;
+  mFillSource = NULL;
+  mFilling = NULL;
+}
+
+
+bool FileCache::fill()
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (!mFilling && !_startFilling()) {
+    return false;
+  }
+  size_t length = min((size_t)FILE_CACHE_FILL_BYTES, mFilling->length - mFilled);
+  if (mFillSource->read(mFilling->data + mFilled, length) != length)
+  {
+    // (the file must have changed since it was catalogued)
+    Serial.printf("Failed to read %s into the file cache\n", mFilling->fileName.c_str());
+    _stopFilling();
+    return true;
+  }
+  mFilled += length;
+  if (mFilled == mFilling->length)
+  {
+    mEntries.push_front(mFilling);
+    mCachedBytes += mFilling->length;
+    Serial.printf("Cached %s (%u of %u bytes used)\n", mFilling->fileName.c_str(), mCachedBytes, mBudget);
+    _stopFilling();
+  }
+  return true;
+}
+
+
+ByteSource *FileCache::open(const std::string &fileName)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  std::shared_ptr<Entry> entry = _find(fileName);
+  return entry ? new CachedByteSource(entry) : NULL;
+}
+
+
+// The cache the AVI parser looks in.
+static FileCache *sharedCache = NULL;
+
+void FileCache::setShared(FileCache *cache)
+{
+  sharedCache = cache;
+}
+
+ByteSource *FileCache::openCached(const std::string &fileName)
+{
+  if (!sharedCache) {
+    return NULL;
+  }
+  ByteSource *source = sharedCache->open(fileName);
+  if (source) {
+    Serial.println("Playing from the file cache.");
+  }
+  return source;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include "../AVIParser/ByteSource.h"
+
+// How much PSRAM to keep short files (like bumpers) in.
+#ifndef FILE_CACHE_BYTES
+#define FILE_CACHE_BYTES (2 * 1024 * 1024)
+#endif
+// Files bigger than this are always read from the SD card.
+#ifndef FILE_CACHE_MAX_FILE_BYTES
+#define FILE_CACHE_MAX_FILE_BYTES FILE_CACHE_BYTES
+#endif
+// How much of a file is read into the cache at a time (while the SD card isn't needed for anything else).
+#ifndef FILE_CACHE_FILL_BYTES
+#define FILE_CACHE_FILL_BYTES (16 * 1024)
+#endif
+
+/**
+ * Whole files kept in PSRAM, so short files that are played over and over (like bumpers) don't have to be
+ * read from the SD card each time. The least recently used files make way for new ones.
+ * Files are asked for with `request`, and read a block at a time by `fill`, which the read-ahead task calls
+ * when it isn't reading anything else.
+ **/
+class FileCache
+{
+private:
+  typedef struct Entry
+  {
+    std::string fileName;
+    uint8_t *data = NULL;
+    size_t length = 0;
+    ~Entry();
+  } Entry;
+  // A cached file, which keeps its entry alive (even if it's dropped from the cache) until it's closed.
+  class CachedByteSource : public MemoryByteSource
+  {
+  private:
+    std::shared_ptr<Entry> mEntry;
+
+  public:
+    CachedByteSource(std::shared_ptr<Entry> entry) : MemoryByteSource(entry->data, entry->length), mEntry(entry) {}
+  };
+
+  size_t mBudget;
+  // The files in memory, most recently used first.
+  std::list<std::shared_ptr<Entry>> mEntries;
+  size_t mCachedBytes = 0;
+  typedef struct
+  {
+    std::string fileName;
+    size_t length;
+  } Request;
+  // Files waiting to be read in, and the one being read in now.
+  std::deque<Request> mRequests;
+  std::shared_ptr<Entry> mFilling;
+  ByteSource *mFillSource = NULL;
+  size_t mFilled = 0;
+  std::mutex mMutex;
+
+  // Find a file in the cache (and make it the most recently used). Call with the mutex held.
+  std::shared_ptr<Entry> _find(const std::string &fileName);
+  // Start reading in the next requested file. Returns false if there isn't one.
+  bool _startFilling();
+  void _stopFilling();
+
+public:
+  FileCache(size_t budget = FILE_CACHE_BYTES) : mBudget(budget) {}
+  ~FileCache();
+  // Ask for a file to be read into the cache (if it's small enough, and isn't already there).
+  void request(const std::string &fileName, size_t length);
+  bool isCached(const std::string &fileName);
+  // Read the next block of a requested file. Returns false if there was nothing to do.
+  bool fill();
+  // Open a file from memory. Returns NULL if it isn't in the cache (yet).
+  ByteSource *open(const std::string &fileName);
+  size_t getCachedBytes() { return mCachedBytes; }
+
+  // The cache the AVI parser looks in when it opens a file (NULL for none).
+  static void setShared(FileCache *cache);
+  static ByteSource *openCached(const std::string &fileName);
+};
@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "FrameQueue.h"
+
+
+FrameQueue::FrameQueue(size_t depth)
+{
+  mSlots.resize(depth > 0 ? depth : 1, {NULL, 0, 0, {}});
+}
+
+FrameQueue::~FrameQueue()
+{
+  for (Slot &slot : mSlots) {
+    free(slot.data);
+  }
+}
+
+
+bool FrameQueue::_grow(Slot &slot, size_t length)
+{
+  if (length <= slot.capacity) {
+    return true;
+  }
+  uint8_t *data = (uint8_t *)realloc(slot.data, length);
+  if (!data) {
+    return false;
+  }
+  slot.data = data;
+  slot.capacity = length;
+  return true;
+}
+
+
+bool FrameQueue::push(const uint8_t *data, size_t length, const FrameInfo &info)
+{
+  uint32_t head = mHead.load(std::memory_order_relaxed);
+  uint32_t depth = head - mTail.load(std::memory_order_acquire);
+  if (depth >= mSlots.size())
+  {
+    mDroppedFrames++;
+    return false;
+  }
+  Slot &slot = mSlots[head % mSlots.size()];
+  if (!_grow(slot, std::max(length, mMinCapacity.load())))
+  {
+    mDroppedFrames++;
+    return false;
+  }
+  memcpy(slot.data, data, length);
+  slot.length = length;
+  slot.info = info;
+  // (the release makes the frame visible to the consumer before the new head is)
+  mHead.store(head + 1, std::memory_order_release);
+  if (depth + 1 > mMaxDepth) {
+    mMaxDepth = depth + 1;
+  }
+  return true;
+}
+
+
+void FrameQueue::reserve(size_t length)
+{
+  // (only ever raised, even if two tasks reserve at once)
+  size_t minCapacity = mMinCapacity.load();
+  while (length > minCapacity && !mMinCapacity.compare_exchange_weak(minCapacity, length)) {}
+}
+
+
+bool FrameQueue::peek(const uint8_t **data, size_t *length, FrameInfo *info)
+{
+  uint32_t tail = mTail.load(std::memory_order_relaxed);
+  if (tail == mHead.load(std::memory_order_acquire)) {
+    return false;
+  }
+  Slot &slot = mSlots[tail % mSlots.size()];
+  *data = slot.data;
+  *length = slot.length;
+  *info = slot.info;
+  return true;
+}
+
+
+void FrameQueue::pop()
+{
+  uint32_t tail = mTail.load(std::memory_order_relaxed);
+  if (tail == mHead.load(std::memory_order_acquire)) {
+    return;
+  }
+  // grow the slot while it's still ours, so the producer doesn't have to
+  _grow(mSlots[tail % mSlots.size()], mMinCapacity);
+  mTail.store(tail + 1, std::memory_order_release);
+}
+
+
+uint32_t FrameQueue::getDepth()
+{
+  // (the tail first, so it can't have passed the head we read)
+  uint32_t tail = mTail.load(std::memory_order_acquire);
+  return mHead.load(std::memory_order_acquire) - tail;
+}
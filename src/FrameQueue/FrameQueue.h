@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+// How many encoded frames can wait to be decoded.
+#ifndef FRAME_QUEUE_DEPTH
+#define FRAME_QUEUE_DEPTH 3
+#endif
+
+// What the consumer is told about a frame, along with its data.
+typedef struct
+{
+  // When it should be shown (in whatever units the consumer uses).
+  uint32_t presentationTime;
+  // The generation it was read in (the consumer throws away old ones).
+  uint32_t generation;
+  // Where it's drawn (frames from different channels can be queued together).
+  int16_t x;
+  int16_t y;
+} FrameInfo;
+
+/**
+ * Encoded frames waiting to be decoded, handed from one producer task to one consumer task without a lock.
+ * Each slot's buffer is reused, and frames are copied straight into it.
+ * The producer owns the slots between the head and the tail (wrapping round), the consumer the rest,
+ * so a slot's buffer is only ever grown by whoever owns it: the consumer grows each slot it hands back to the
+ * reserved size, and the producer only grows one for a frame that's bigger still.
+ * There's no clear - each frame carries the generation it was read in, and the consumer throws away old ones.
+ **/
+class FrameQueue
+{
+private:
+  typedef struct
+  {
+    uint8_t *data;
+    size_t capacity;
+    size_t length;
+    FrameInfo info;
+  } Slot;
+
+  std::vector<Slot> mSlots;
+  // Frames are counted from the start, and live in slot (count % depth).
+  // The producer moves the head, the consumer the tail.
+  std::atomic<uint32_t> mHead{0};
+  std::atomic<uint32_t> mTail{0};
+  // The smallest a slot's buffer should be.
+  std::atomic<size_t> mMinCapacity{0};
+  // Statistics.
+  std::atomic<uint32_t> mMaxDepth{0};
+  std::atomic<uint32_t> mDroppedFrames{0};
+
+  bool _grow(Slot &slot, size_t length);
+
+public:
+  FrameQueue(size_t depth = FRAME_QUEUE_DEPTH);
+  ~FrameQueue();
+
+  // Producer: copy a frame into the next free slot, along with what the consumer needs to know about it.
+  // Returns false (and drops the frame) if the queue is full.
+  bool push(const uint8_t *data, size_t length, const FrameInfo &info);
+  // Any task: make the slots big enough for `length` byte frames, so they don't grow during playback.
+  // (each slot is grown by the consumer as it's handed back, or by the producer if a frame arrives first)
+  void reserve(size_t length);
+  // The size reserved so far.
+  size_t getReservedLength() { return mMinCapacity; }
+
+  // Consumer: the oldest frame. Returns false if there isn't one.
+  bool peek(const uint8_t **data, size_t *length, FrameInfo *info);
+  // Consumer: finished with the oldest frame.
+  void pop();
+
+  bool isEmpty() { return getDepth() == 0; }
+  uint32_t getDepth();
+  size_t getCapacity() { return mSlots.size(); }
+  uint32_t getMaxDepth() { return mMaxDepth; }
+  uint32_t getDroppedFrames() { return mDroppedFrames; }
+};
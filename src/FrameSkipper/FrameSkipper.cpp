@@ -0,0 +1,51 @@
+#include "FrameSkipper.h"
+
+void FrameSkipper::setLag(int32_t lagMicros)
+{
+  // (the latest it's been since the read-ahead task last asked, so a moment behind isn't missed)
+  int32_t lag = mLagMicros;
+  while (lagMicros > lag && !mLagMicros.compare_exchange_weak(lag, lagMicros))
+  {
+  }
+}
+
+void FrameSkipper::frameDecoded(uint32_t decodeMicros)
+{
+  // (averaged over the last few frames, so one busy frame doesn't skip the ones after it)
+  mDecodeMicros = (mDecodeMicros * 7 + decodeMicros) / 8;
+}
+
+bool FrameSkipper::skipFrame(uint32_t frameMicros, uint32_t queueDepth)
+{
+  uint32_t decodeMicros = mDecodeMicros;
+  int32_t lagMicros = mLagMicros.exchange(0);
+  // (a decoder that keeps up only falls behind for a moment, and the frame task drops the odd late frame)
+  if (decodeMicros <= frameMicros)
+  {
+    mSkipping = false;
+    return false;
+  }
+  // once the frame task has fallen behind, it keeps skipping for as long as decoding is too slow
+  if (!mSkipping)
+  {
+    if (lagMicros <= FRAME_SKIP_LAG_MS * 1000 && queueDepth <= 1) {
+      return false;
+    }
+    mSkipping = true;
+    mCredit = 0;
+  }
+  mCredit += frameMicros;
+  if (mCredit >= decodeMicros)
+  {
+    mCredit -= decodeMicros;
+    return false;
+  }
+  mSkippedFrames++;
+  return true;
+}
+
+void FrameSkipper::reset()
+{
+  mSkipping = false;
+  mCredit = 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+// Frames are only skipped while the frame task is behind: finding the oldest waiting frame more than this late
+// when it's ready for another, or with more than one frame waiting.
+#ifndef FRAME_SKIP_LAG_MS
+#define FRAME_SKIP_LAG_MS 40
+#endif
+
+/**
+ * Decides which frames the read-ahead task skips over (rather than reading them) when frames take longer to
+ * decode than they're shown for. It only steps in while the frame task is actually falling behind, and then
+ * keeps as many frames as the decoder has time for (a frame interval / decode time share, spread evenly), so
+ * a decoder a little slower than the frame rate loses a few frames rather than every other one.
+ * The frame task reports how it's getting on, and the read-ahead task asks about each frame.
+ **/
+class FrameSkipper
+{
+private:
+  // Frame task: how long a frame takes to decode and draw (a running average), and the latest the oldest waiting
+  // frame has been when it was ready for another, since the read-ahead task last asked (in microseconds).
+  std::atomic<uint32_t> mDecodeMicros{0};
+  std::atomic<int32_t> mLagMicros{0};
+  // Read-ahead task: decoding time earned by the frames so far (a frame is kept when there's a decode's worth).
+  uint32_t mCredit = 0;
+  bool mSkipping = false;
+  std::atomic<uint32_t> mSkippedFrames{0};
+
+public:
+  // Frame task: ready for another frame, with the oldest waiting one `lagMicros` late (before any late ones are dropped).
+  void setLag(int32_t lagMicros);
+  // Frame task: a frame took `decodeMicros` to decode and draw.
+  void frameDecoded(uint32_t decodeMicros);
+  // Read-ahead task: whether to skip the next frame, which follows the last one by `frameMicros`,
+  // with `queueDepth` frames waiting to be decoded.
+  bool skipFrame(uint32_t frameMicros, uint32_t queueDepth);
+  // Read-ahead task: start afresh (on a new timeline).
+  void reset();
+
+  uint32_t getDecodeMicros() { return mDecodeMicros; }
+  uint32_t getSkippedFrames() { return mSkippedFrames; }
+};
@@ -0,0 +1,183 @@
+#include "JpegSlicer.h"
+#include <algorithm>
+
+#define MARKER_SOI 0xD8
+#define MARKER_EOI 0xD9
+#define MARKER_SOF0 0xC0
+#define MARKER_SOF1 0xC1
+#define MARKER_DHT 0xC4
+#define MARKER_JPG 0xC8
+#define MARKER_DAC 0xCC
+#define MARKER_DRI 0xDD
+#define MARKER_SOS 0xDA
+
+static inline bool isRestartMarker(uint8_t marker)
+{
+  return marker >= 0xD0 && marker <= 0xD7;
+}
+
+// Any start of frame marker other than baseline (progressive, lossless or arithmetic coding).
+static inline bool isUnsupportedFrame(uint8_t marker)
+{
+  return marker >= 0xC2 && marker <= 0xCF && marker != MARKER_DHT && marker != MARKER_JPG && marker != MARKER_DAC;
+}
+
+
+void JpegSlicer::reserve(size_t length)
+{
+  // (each half gets its own copy of the headers, which fits in what the other half doesn't use)
+  mTop.reserve(length);
+  mBottom.reserve(length);
+}
+
+
+void JpegSlicer::_copyHeader(std::vector<uint8_t> &slice, const uint8_t *jpeg, size_t headerLength, size_t heightOffset, int height)
+{
+  slice.insert(slice.end(), jpeg, jpeg + headerLength);
+  slice[heightOffset] = height >> 8;
+  slice[heightOffset + 1] = height & 0xFF;
+}
+
+
+bool JpegSlicer::split(const uint8_t *jpeg, size_t length)
+{
+  if (length < 4 || jpeg[0] != 0xFF || jpeg[1] != MARKER_SOI) {
+    return false;
+  }
+  // read the segments up to the start of the scan
+  size_t headerLength = 0;
+  size_t heightOffset = 0;
+  int width = 0, height = 0, components = 0;
+  int mcuWidth = 8, mcuHeight = 8;
+  uint32_t restartInterval = 0;
+  size_t position = 2;
+  while (headerLength == 0)
+  {
+    if (position + 4 > length || jpeg[position] != 0xFF) {
+      return false;
+    }
+    uint8_t marker = jpeg[position + 1];
+    // (markers can be padded with fill bytes)
+    if (marker == 0xFF) {
+      position++;
+      continue;
+    }
+    size_t segmentLength = (jpeg[position + 2] << 8) | jpeg[position + 3];
+    if (segmentLength < 2 || position + 2 + segmentLength > length) {
+      return false;
+    }
+    const uint8_t *segment = jpeg + position + 4;
+    size_t dataLength = segmentLength - 2;
+    if (marker == MARKER_SOF0 || marker == MARKER_SOF1)
+    {
+      if (dataLength < 6) {
+        return false;
+      }
+      height = (segment[1] << 8) | segment[2];
+      width = (segment[3] << 8) | segment[4];
+      components = segment[5];
+      if (dataLength < 6 + (size_t)components * 3) {
+        return false;
+      }
+      heightOffset = position + 5;
+      // an MCU covers the most subsampled component's 8x8 block
+      int maxHorizontal = 1, maxVertical = 1;
+      for (int i = 0; i < components; i++)
+      {
+        uint8_t sampling = segment[6 + i * 3 + 1];
+        maxHorizontal = std::max(maxHorizontal, sampling >> 4);
+        maxVertical = std::max(maxVertical, sampling & 0x0F);
+      }
+      mcuWidth = 8 * maxHorizontal;
+      mcuHeight = 8 * maxVertical;
+    }
+    else if (isUnsupportedFrame(marker)) {
+      return false;
+    }
+    else if (marker == MARKER_DRI && dataLength >= 2) {
+      restartInterval = (segment[0] << 8) | segment[1];
+    }
+    else if (marker == MARKER_SOS)
+    {
+      // (a scan of some of the components would be followed by more scans, which we don't split)
+      if (dataLength < 1 || segment[0] != components) {
+        return false;
+      }
+      headerLength = position + 2 + segmentLength;
+    }
+    position += 2 + segmentLength;
+  }
+  if (heightOffset == 0 || restartInterval == 0 || width == 0 || height == 0) {
+    return false;
+  }
+
+  // the boundary between rows of MCUs nearest the middle that a restart interval ends on
+  uint32_t mcusPerRow = (width + mcuWidth - 1) / mcuWidth;
+  uint32_t mcuRows = (height + mcuHeight - 1) / mcuHeight;
+  uint32_t splitRow = 0;
+  for (uint32_t distance = 0; distance < mcuRows / 2 && splitRow == 0; distance++)
+  {
+    uint32_t below = mcuRows / 2 + distance;
+    uint32_t above = mcuRows / 2 - distance;
+    if (below < mcuRows && below * mcusPerRow % restartInterval == 0) {
+      splitRow = below;
+    }
+    else if (above * mcusPerRow % restartInterval == 0) {
+      splitRow = above;
+    }
+  }
+  if (splitRow == 0) {
+    return false;
+  }
+
+  // find the restart marker there
+  uint32_t restartsBefore = splitRow * mcusPerRow / restartInterval;
+  uint32_t restarts = 0;
+  size_t cut = 0;
+  for (position = headerLength; position + 1 < length && cut == 0; position++)
+  {
+    // (0xFF 0x00 is a 0xFF in the scan data, and 0xFF 0xFF is fill before a marker)
+    if (jpeg[position] != 0xFF || jpeg[position + 1] == 0x00 || jpeg[position + 1] == 0xFF) {
+      continue;
+    }
+    // the scan ended before it got there
+    if (!isRestartMarker(jpeg[position + 1])) {
+      return false;
+    }
+    if (++restarts == restartsBefore) {
+      cut = position;
+    }
+  }
+  if (cut == 0) {
+    return false;
+  }
+
+  // the bottom half carries on from the restart marker, with its markers counting up from RST0 again
+  int splitY = splitRow * mcuHeight;
+  mBottom.clear();
+  _copyHeader(mBottom, jpeg, headerLength, heightOffset, height - splitY);
+  mBottom.insert(mBottom.end(), jpeg + cut + 2, jpeg + length);
+  for (position = headerLength; position + 1 < mBottom.size(); position++)
+  {
+    uint8_t marker = mBottom[position + 1];
+    if (mBottom[position] != 0xFF || marker == 0x00 || marker == 0xFF) {
+      continue;
+    }
+    if (marker == MARKER_EOI) {
+      break;
+    }
+    if (!isRestartMarker(marker)) {
+      return false;
+    }
+    mBottom[position + 1] = 0xD0 + ((marker - 0xD0 - restartsBefore) & 7);
+  }
+
+  // the top half ends at the restart marker
+  mTop.clear();
+  _copyHeader(mTop, jpeg, headerLength, heightOffset, splitY);
+  mTop.insert(mTop.end(), jpeg + headerLength, jpeg + cut);
+  mTop.push_back(0xFF);
+  mTop.push_back(MARKER_EOI);
+  mSplitY = splitY;
+  return true;
+}
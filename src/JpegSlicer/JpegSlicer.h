@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Cuts a baseline JPEG with restart markers (DRI) in two, at the restart marker nearest its middle
+ * that falls between two rows of MCUs. Each half is a JPEG of its own (the headers with the height changed,
+ * and that half's scan data), so the two can be decoded at the same time and drawn one above the other.
+ * Decoding starts afresh at each restart marker, so nothing from the top half is needed for the bottom.
+ **/
+class JpegSlicer
+{
+private:
+  std::vector<uint8_t> mTop;
+  std::vector<uint8_t> mBottom;
+  // Where the bottom half starts (in pixels from the top of the frame).
+  int mSplitY = 0;
+
+  // Copy the headers, with the frame height changed to `height`.
+  static void _copyHeader(std::vector<uint8_t> &slice, const uint8_t *jpeg, size_t headerLength, size_t heightOffset, int height);
+
+public:
+  // Make room for frames up to `length` bytes, so splitting them doesn't allocate.
+  void reserve(size_t length);
+  // Split a frame into halves. Returns false if it can't be split (it has no restart markers between
+  // rows of MCUs, or isn't a baseline JPEG), in which case it has to be decoded in one go.
+  bool split(const uint8_t *jpeg, size_t length);
+
+  const uint8_t *getTop() { return mTop.data(); }
+  size_t getTopLength() { return mTop.size(); }
+  const uint8_t *getBottom() { return mBottom.data(); }
+  size_t getBottomLength() { return mBottom.size(); }
+  int getSplitY() { return mSplitY; }
+};
@@ -0,0 +1,447 @@
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "../SDCard.h"
+#include "../AVIParser/AVIParser.h"
+#include "MediaCatalog.h"
+
+
+// Catalog file layout:
+//   CatalogHeader
+//   CatalogDirectory for each folder
+//   for each folder: CatalogRecord for each file, then the file names (not terminated)
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t directoryCount;
+} CatalogHeader;
+
+#define CATALOG_MAGIC 0x434D5654 // "TVMC"
+#define CATALOG_VERSION 3
+#define CATALOG_TEMP_PATH MEDIA_CATALOG_PATH ".tmp"
+#define CATALOG_NAMES_PATH MEDIA_CATALOG_PATH ".names"
+// How far to look for a file in the old catalog (files are in name order, so it's usually the next one).
+#define CATALOG_MATCH_WINDOW 8
+
+
+static uint32_t folderModified(SDCard *sdCard, const char *folder)
+{
+  std::string path = sdCard->getPath(folder);
+  // (stat doesn't like the trailing slash, and the root folder has no modified time)
+  if (path.length() > 1) {
+    path.pop_back();
+  }
+  struct stat folderStat;
+  return stat(path.c_str(), &folderStat) == 0 ? (uint32_t)folderStat.st_mtime : 0;
+}
+
+
+// Append `length` bytes from `input` (at `position`) to `output`.
+static bool copyBytes(FILE *input, uint32_t position, uint32_t length, FILE *output, SemaphoreHandle_t inputMutex)
+{
+  uint8_t buffer[512];
+  while (length > 0)
+  {
+    size_t blockLength = min(length, (uint32_t)sizeof(buffer));
+    if (inputMutex) {xSemaphoreTake(inputMutex, portMAX_DELAY);}
+    bool read = fseek(input, position, SEEK_SET) == 0 && fread(buffer, 1, blockLength, input) == blockLength;
+    if (inputMutex) {xSemaphoreGive(inputMutex);}
+    if (!read || fwrite(buffer, 1, blockLength, output) != blockLength) {
+      return false;
+    }
+    position += blockLength;
+    length -= blockLength;
+  }
+  return true;
+}
+
+
+MediaCatalog::MediaCatalog(SDCard *sdCard, const char *extension) : mSDCard(sdCard), mExtension(extension)
+{
+}
+
+
+void MediaCatalog::load(const std::vector<const char *> &folders)
+{
+  // (loading again after a failed fetch leaves the catalog to an update that's still checking it)
+  if (mUpdating) {
+    return;
+  }
+  unsigned long loadStartTime = millis();
+  xSemaphoreTake(mMutex, portMAX_DELAY);
+  mFolders.assign(folders.begin(), folders.end());
+  bool buildNeeded = !_open();
+  for (const char *folder : folders)
+  {
+    int directory = _findDirectory(folder);
+    // (folders without a modified time are left for the update task to check)
+    uint32_t modified = folderModified(mSDCard, folder);
+    if (directory < 0 || (modified && modified != mDirectories[directory].modified))
+    {
+      Serial.printf("Folder %s has changed.\n", folder);
+      buildNeeded = true;
+    }
+  }
+  xSemaphoreGive(mMutex);
+  if (buildNeeded) {
+    _build(false);
+  }
+  mGeneration++;
+  Serial.printf("Loaded media catalog in %lums\n", millis() - loadStartTime);
+}
+
+
+void MediaCatalog::startUpdate()
+{
+  if (mUpdating) {
+    return;
+  }
+  mUpdating = true;
+  // low priority - it shouldn't hold up playback
+  xTaskCreatePinnedToCore(_updateTask, "media_catalog", 1024 * 8, this, 0, NULL, 0);
+}
+
+
+uint32_t MediaCatalog::getFileCount(const char *folder)
+{
+  xSemaphoreTake(mMutex, portMAX_DELAY);
+  int directory = _findDirectory(folder);
+  uint32_t fileCount = directory >= 0 ? mDirectories[directory].fileCount : 0;
+  xSemaphoreGive(mMutex);
+  return fileCount;
+}
+
+
+std::string MediaCatalog::getFilePath(const char *folder, uint32_t index)
+{
+  std::string name;
+  CatalogRecord record;
+  xSemaphoreTake(mMutex, portMAX_DELAY);
+  int directory = _findDirectory(folder);
+  bool found = directory >= 0 && _readRecord(mDirectories[directory], index, &record, &name);
+  xSemaphoreGive(mMutex);
+  return found ? mSDCard->getPath(folder) + name : "";
+}
+
+
+bool MediaCatalog::getInfo(const char *folder, uint32_t index, MediaInfo *info)
+{
+  CatalogRecord record;
+  xSemaphoreTake(mMutex, portMAX_DELAY);
+  int directory = _findDirectory(folder);
+  bool found = directory >= 0 && _readRecord(mDirectories[directory], index, &record, NULL);
+  xSemaphoreGive(mMutex);
+  if (!found || !record.parsed || record.info.durationMs == 0) {
+    return false;
+  }
+  *info = record.info;
+  return true;
+}
+
+
+int MediaCatalog::_findDirectory(const char *folder)
+{
+  for (size_t i = 0; i < mDirectories.size(); i++)
+  {
+    if (strcmp(mDirectories[i].folder, folder) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+bool MediaCatalog::_open()
+{
+  if (mFile) {
+    fclose(mFile);
+  }
+  mFile = fopen(MEDIA_CATALOG_PATH, "r+b");
+  if (!mFile) {
+    Serial.println("No media catalog found.");
+    return false;
+  }
+  CatalogHeader header;
+  bool loaded = fread(&header, sizeof(header), 1, mFile) == 1 && header.magic == CATALOG_MAGIC && header.version == CATALOG_VERSION;
+  if (loaded)
+  {
+    mDirectories.resize(header.directoryCount);
+    loaded = fread(mDirectories.data(), sizeof(CatalogDirectory), header.directoryCount, mFile) == header.directoryCount;
+  }
+  if (!loaded)
+  {
+    Serial.println("Media catalog is invalid. Rebuilding it.");
+    mDirectories.clear();
+    fclose(mFile);
+    mFile = NULL;
+  }
+  return loaded;
+}
+
+
+bool MediaCatalog::_readRecord(const CatalogDirectory &directory, uint32_t index, CatalogRecord *record, std::string *name)
+{
+  if (!mFile || index >= directory.fileCount) {
+    return false;
+  }
+  if (fseek(mFile, directory.recordsOffset + index * sizeof(CatalogRecord), SEEK_SET) != 0
+    || fread(record, sizeof(CatalogRecord), 1, mFile) != 1) {
+    return false;
+  }
+  if (!name) {
+    return true;
+  }
+  name->resize(record->nameLength);
+  return record->nameOffset + record->nameLength <= directory.namesLength
+    && fseek(mFile, directory.namesOffset + record->nameOffset, SEEK_SET) == 0
+    && fread(&(*name)[0], 1, record->nameLength, mFile) == record->nameLength;
+}
+
+
+bool MediaCatalog::_build(bool listAll)
+{
+  FILE *output = fopen(CATALOG_TEMP_PATH, "wb");
+  if (!output)
+  {
+    Serial.println("Failed to write the media catalog.");
+    return false;
+  }
+  xSemaphoreTake(mMutex, portMAX_DELAY);
+  std::vector<std::string> folders = mFolders;
+  xSemaphoreGive(mMutex);
+  // the folder table is written again once the offsets are known
+  std::vector<CatalogDirectory> directories(folders.size());
+  memset(directories.data(), 0, directories.size() * sizeof(CatalogDirectory));
+  CatalogHeader header = {CATALOG_MAGIC, CATALOG_VERSION, (uint32_t)directories.size()};
+  bool written = fwrite(&header, sizeof(header), 1, output) == 1
+    && fwrite(directories.data(), sizeof(CatalogDirectory), directories.size(), output) == directories.size();
+  bool changed = mDirectories.size() != directories.size();
+
+  for (size_t i = 0; written && i < folders.size(); i++)
+  {
+    CatalogDirectory &directory = directories[i];
+    strncpy(directory.folder, folders[i].c_str(), sizeof(directory.folder) - 1);
+    directory.modified = folderModified(mSDCard, directory.folder);
+    int oldDirectory = _findDirectory(directory.folder);
+    const CatalogDirectory *old = oldDirectory >= 0 ? &mDirectories[oldDirectory] : NULL;
+    if (old && !listAll && (directory.modified == 0 || directory.modified == old->modified)) {
+      written = _copyDirectory(output, directory, *old);
+    }
+    else {
+      written = _listDirectory(output, directory, old, &changed);
+    }
+    changed = changed || !old || directory.modified != old->modified;
+  }
+  written = written && fseek(output, sizeof(header), SEEK_SET) == 0
+    && fwrite(directories.data(), sizeof(CatalogDirectory), directories.size(), output) == directories.size();
+  written = fclose(output) == 0 && written;
+  if (!written || (!changed && mFile))
+  {
+    if (!written) {Serial.println("Failed to write the media catalog.");}
+    remove(CATALOG_TEMP_PATH);
+    return false;
+  }
+
+  // swap in the new catalog (so a power cut can't leave half a catalog)
+  xSemaphoreTake(mMutex, portMAX_DELAY);
+  if (mFile) {
+    fclose(mFile);
+  }
+  remove(MEDIA_CATALOG_PATH);
+  rename(CATALOG_TEMP_PATH, MEDIA_CATALOG_PATH);
+  mFile = fopen(MEDIA_CATALOG_PATH, "r+b");
+  mDirectories.swap(directories);
+  // (writing the catalog can change the modified time of the folder it's in)
+  for (CatalogDirectory &directory : mDirectories) {
+    directory.modified = folderModified(mSDCard, directory.folder);
+  }
+  if (mFile && fseek(mFile, sizeof(CatalogHeader), SEEK_SET) == 0) {
+    fwrite(mDirectories.data(), sizeof(CatalogDirectory), mDirectories.size(), mFile);
+    fflush(mFile);
+  }
+  mGeneration++;
+  xSemaphoreGive(mMutex);
+  Serial.println("Saved media catalog.");
+  return true;
+}
+
+
+bool MediaCatalog::_copyDirectory(FILE *output, CatalogDirectory &directory, const CatalogDirectory &oldDirectory)
+{
+  directory.fileCount = oldDirectory.fileCount;
+  directory.recordsOffset = ftell(output);
+  directory.namesLength = oldDirectory.namesLength;
+  if (!copyBytes(mFile, oldDirectory.recordsOffset, oldDirectory.fileCount * sizeof(CatalogRecord), output, mMutex)) {
+    return false;
+  }
+  directory.namesOffset = ftell(output);
+  return copyBytes(mFile, oldDirectory.namesOffset, oldDirectory.namesLength, output, mMutex);
+}
+
+
+bool MediaCatalog::_listDirectory(FILE *output, CatalogDirectory &directory, const CatalogDirectory *oldDirectory, bool *changed)
+{
+  std::string folderPath = mSDCard->getPath(directory.folder);
+  Serial.printf("Cataloguing directory: %s\n", folderPath.c_str());
+  directory.recordsOffset = ftell(output);
+  directory.fileCount = 0;
+  directory.namesLength = 0;
+  // (the same files, in the same order, as SDCard::listFiles - so channel numbers don't depend on directory order)
+  std::vector<std::string> fileNames;
+  DIR *dir = opendir(folderPath.c_str());
+  struct dirent *ent;
+  while (dir && (ent = readdir(dir)) != NULL)
+  {
+    const char *name = ent->d_name;
+    size_t nameLength = strlen(name);
+    size_t extensionLength = strlen(mExtension);
+    if (ent->d_type == DT_REG && name[0] != '.' && nameLength >= extensionLength
+      && strcmp(name + nameLength - extensionLength, mExtension) == 0) {
+      fileNames.push_back(name);
+    }
+  }
+  if (dir) {
+    closedir(dir);
+  }
+  else {
+    Serial.println("Failed to open directory");
+  }
+  std::sort(fileNames.begin(), fileNames.end());
+
+  // the names go after all the records, so they're collected in a file of their own
+  FILE *names = fopen(CATALOG_NAMES_PATH, "w+b");
+  bool written = names != NULL;
+  uint32_t oldIndex = 0;
+  for (size_t fileIndex = 0; written && fileIndex < fileNames.size(); fileIndex++)
+  {
+    const char *name = fileNames[fileIndex].c_str();
+    size_t nameLength = fileNames[fileIndex].length();
+    CatalogRecord record = {};
+    record.nameOffset = directory.namesLength;
+    record.nameLength = nameLength;
+    struct stat fileStat;
+    std::string path = folderPath + name;
+    if (stat(path.c_str(), &fileStat) == 0)
+    {
+      record.info.size = fileStat.st_size;
+      record.info.modified = fileStat.st_mtime;
+    }
+
+    // keep what we know if the file hasn't changed
+    bool matched = false;
+    for (uint32_t i = oldIndex; oldDirectory && i < min(oldIndex + CATALOG_MATCH_WINDOW, oldDirectory->fileCount); i++)
+    {
+      CatalogRecord oldRecord;
+      std::string oldName;
+      xSemaphoreTake(mMutex, portMAX_DELAY);
+      bool read = _readRecord(*oldDirectory, i, &oldRecord, &oldName);
+      xSemaphoreGive(mMutex);
+      if (read && oldName == name)
+      {
+        bool unchanged = oldRecord.info.size == record.info.size && oldRecord.info.modified == record.info.modified;
+        if (unchanged)
+        {
+          record.parsed = oldRecord.parsed;
+          record.info = oldRecord.info;
+        }
+        // (a file that has moved changes the channel numbers)
+        matched = unchanged && i == oldIndex;
+        oldIndex = i + 1;
+        break;
+      }
+    }
+    *changed = *changed || !matched;
+
+    written = fwrite(&record, sizeof(record), 1, output) == 1 && fwrite(name, 1, nameLength, names) == nameLength;
+    directory.fileCount++;
+    directory.namesLength += nameLength;
+  }
+  *changed = *changed || !oldDirectory || oldDirectory->fileCount != directory.fileCount;
+  directory.namesOffset = ftell(output);
+  written = written && copyBytes(names, 0, directory.namesLength, output, NULL);
+  if (names)
+  {
+    fclose(names);
+    remove(CATALOG_NAMES_PATH);
+  }
+  return written;
+}
+
+
+void MediaCatalog::_parseFiles()
+{
+  for (size_t directoryIndex = 0; ; directoryIndex++)
+  {
+    xSemaphoreTake(mMutex, portMAX_DELAY);
+    bool hasDirectory = directoryIndex < mDirectories.size();
+    CatalogDirectory directory = hasDirectory ? mDirectories[directoryIndex] : CatalogDirectory{};
+    xSemaphoreGive(mMutex);
+    if (!hasDirectory) {
+      break;
+    }
+    std::string folderPath = mSDCard->getPath(directory.folder);
+    for (uint32_t index = 0; index < directory.fileCount; index++)
+    {
+      // find the next file we haven't parsed
+      CatalogRecord record;
+      std::string name;
+      xSemaphoreTake(mMutex, portMAX_DELAY);
+      bool read = _readRecord(directory, index, &record, &name);
+      xSemaphoreGive(mMutex);
+      if (!read || record.parsed) {
+        continue;
+      }
+
+      // (just the headers - opening the file would load its index and reset the resume state of whatever's playing)
+      AVIHeaderInfo headerInfo;
+      uint32_t durationMs;
+      if (AVIParser::probe(folderPath + name, &headerInfo, &durationMs))
+      {
+        record.info.durationMs = durationMs;
+        record.info.microSecondsPerFrame = headerInfo.microSecondsPerFrame;
+        record.info.width = headerInfo.width;
+        record.info.height = headerInfo.height;
+        record.info.audioSampleRate = headerInfo.audioSampleRate;
+        record.info.maxChunkSize = headerInfo.videoBufferSize;
+      }
+      Serial.printf("Catalogued %s: %ums, %ux%u, %u byte chunks\n", name.c_str(), record.info.durationMs,
+                    record.info.width, record.info.height, record.info.maxChunkSize);
+      // (files that can't be parsed are marked as parsed too, so we don't keep trying)
+      record.parsed = 1;
+      // only this task replaces the catalog, so the record is still where it was
+      xSemaphoreTake(mMutex, portMAX_DELAY);
+      if (mFile && fseek(mFile, directory.recordsOffset + index * sizeof(CatalogRecord), SEEK_SET) == 0) {
+        fwrite(&record, sizeof(record), 1, mFile);
+        fflush(mFile);
+      }
+      xSemaphoreGive(mMutex);
+      // give the SD card back to playback for a while
+      vTaskDelay(50 / portTICK_PERIOD_MS);
+    }
+  }
+}
+
+
+void MediaCatalog::_updateTask(void *param)
+{
+  MediaCatalog *catalog = (MediaCatalog *)param;
+  catalog->updateTask();
+}
+
+
+void MediaCatalog::updateTask()
+{
+  unsigned long updateStartTime = millis();
+  // list every folder again (the root folder has no modified time, and FAT doesn't always update them)
+  if (_build(true)) {
+    Serial.println("The media catalog has changed.");
+  }
+  _parseFiles();
+  Serial.printf("Media catalog update finished in %lums\n", millis() - updateStartTime);
+  mUpdating = false;
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <atomic>
+
+class SDCard;
+
+// Where the catalog is kept on the SD card.
+#ifndef MEDIA_CATALOG_PATH
+#define MEDIA_CATALOG_PATH "/sdcard/.tvcatalog"
+#endif
+
+// What we know about one video file (without opening it).
+typedef struct
+{
+  // Size and modified time of the file when it was parsed.
+  uint32_t size;
+  uint32_t modified;
+  uint32_t durationMs;
+  uint32_t microSecondsPerFrame;
+  uint16_t width;
+  uint16_t height;
+  uint32_t audioSampleRate;
+  // The suggested buffer size from the headers (only the headers are read while cataloguing).
+  uint32_t maxChunkSize;
+} MediaInfo;
+
+/**
+ * A catalog of the video files on the SD card, saved to the card so booting doesn't need a directory walk
+ * or a header parse for every file.
+ * Files are looked up by their index in a folder, straight from the catalog file, so only the folder table
+ * is kept in memory (however many files there are).
+ * Folders whose modified time has changed are listed again when the catalog is loaded, and a background
+ * task checks every file and parses new or changed ones.
+ **/
+class MediaCatalog
+{
+private:
+  // A folder in the catalog file's folder table.
+  typedef struct
+  {
+    // The folder on the SD card (as passed to SDCard::listFiles).
+    char folder[64];
+    uint32_t modified;
+    uint32_t fileCount;
+    // Catalog file positions of the folder's file records and their names.
+    uint32_t recordsOffset;
+    uint32_t namesOffset;
+    uint32_t namesLength;
+  } CatalogDirectory;
+  // One file in the catalog file.
+  typedef struct
+  {
+    // Position of the name in the folder's names.
+    uint32_t nameOffset;
+    uint16_t nameLength;
+    // Whether the file's headers have been read into `info` (even if they turned out to be invalid).
+    uint8_t parsed;
+    uint8_t reserved;
+    MediaInfo info;
+  } CatalogRecord;
+
+  SDCard *mSDCard;
+  const char *mExtension;
+  std::vector<std::string> mFolders;
+  std::vector<CatalogDirectory> mDirectories;
+  // The catalog file, kept open for lookups.
+  FILE *mFile = NULL;
+  // Held while using mFile, mDirectories and mFolders (the update task replaces them).
+  SemaphoreHandle_t mMutex = xSemaphoreCreateMutex();
+  // Incremented each time the list of files changes.
+  std::atomic<uint32_t> mGeneration{0};
+  std::atomic<bool> mUpdating{false};
+
+  int _findDirectory(const char *folder);
+  bool _open();
+  bool _readRecord(const CatalogDirectory &directory, uint32_t index, CatalogRecord *record, std::string *name);
+  // Write a new catalog, listing the folders again (or copying them from the current catalog if they haven't changed).
+  // Returns true if the list of files changed.
+  bool _build(bool listAll);
+  bool _copyDirectory(FILE *output, CatalogDirectory &directory, const CatalogDirectory &oldDirectory);
+  bool _listDirectory(FILE *output, CatalogDirectory &directory, const CatalogDirectory *oldDirectory, bool *changed);
+  // Read the headers of any files we don't know about yet.
+  void _parseFiles();
+
+  static void _updateTask(void *param);
+  void updateTask();
+
+public:
+  MediaCatalog(SDCard *sdCard, const char *extension);
+  // Load the catalog, listing any of the folders that aren't in it (or have changed).
+  void load(const std::vector<const char *> &folders);
+  // Check every file and parse the new ones in a background task.
+  void startUpdate();
+  uint32_t getFileCount(const char *folder);
+  // Full path of a file in a folder (empty if there's no such file).
+  std::string getFilePath(const char *folder, uint32_t index);
+  // Get what we know about a file. Returns false if it hasn't been parsed yet.
+  bool getInfo(const char *folder, uint32_t index, MediaInfo *info);
+  // Changes each time the list of files changes.
+  uint32_t getGeneration() { return mGeneration; }
+};
@@ -12,6 +12,11 @@
 #include "driver/sdspi_host.h"
 #include "sdmmc_cmd.h"
 #include "SDCard.h"
+#ifndef DISABLE_FATFS_READS
+#include "diskio_sdmmc.h"
+#include "AVIParser/ByteSource.h"
+#include "BlockDevice/FatVolume.h"
+#endif
 
 #define SPI_DMA_CHAN SPI_DMA_CH_AUTO
 #define MOUNT_POINT "/sdcard"
@@ -65,6 +70,7 @@ SDCard::SDCard(gpio_num_t clk, gpio_num_t cmd, gpio_num_t d0, gpio_num_t d1, gpi
   // Card has been initialized, print its properties
   sdmmc_card_print_info(stdout, m_card);
   sd_card_init_success = true;
+  setupDirectReads();
   #endif
 }
 
@@ -125,17 +131,43 @@ SDCard::SDCard(gpio_num_t miso, gpio_num_t mosi, gpio_num_t clk, gpio_num_t cs)
   // Card has been initialized, print its properties
   sdmmc_card_print_info(stdout, m_card);
   sd_card_init_success = true;
+  setupDirectReads();
 }
 
 SDCard::~SDCard()
 {
   // All done, unmount partition and disable SDMMC or SPI peripheral
+  #ifndef DISABLE_FATFS_READS
+  FatFsByteSource::setVolume(MOUNT_POINT, -1);
+  #endif
+  #ifndef DISABLE_RAW_SECTOR_READS
+  FatVolume::setMounted(NULL, NULL);
+  delete m_volume;
+  delete m_block_device;
+  #endif
   esp_vfs_fat_sdcard_unmount(MOUNT_POINT, m_card);
   //deinitialize the bus after all devices are removed
   spi_bus_free(spi_host_device_t(m_host.slot));
 }
 
 
+void SDCard::setupDirectReads()
+{
+  #ifndef DISABLE_FATFS_READS
+  // let the AVI parser read straight through FATFS
+  FatFsByteSource::setVolume(MOUNT_POINT, ff_diskio_get_pdrv_card(m_card));
+  #endif
+  #ifndef DISABLE_RAW_SECTOR_READS
+  // and files stored in one piece straight from the card driver
+  m_block_device = new SdmmcBlockDevice(m_card, ff_diskio_get_pdrv_card(m_card));
+  m_volume = new FatVolume(m_block_device);
+  if (m_volume->mount()) {
+    FatVolume::setMounted(MOUNT_POINT, m_volume);
+  }
+  #endif
+}
+
+
 bool SDCard::isMounted() {
   if (sd_card_init_success) {
     return sdmmc_get_status(m_card) == ESP_OK;
@@ -143,25 +175,30 @@ bool SDCard::isMounted() {
   return false;
 }
 
+std::string SDCard::getPath(const char *folder)
+{
+  std::string path = std::string(MOUNT_POINT) + folder;
+  // add a trailing slash if there isn't one (for joining to filename)
+  if (path.back() != '/')
+  {
+    path += "/";
+  }
+  return path;
+}
+
 std::vector<std::string> SDCard::listFiles(const char *folder, const char *extension)
 {
   std::vector<std::string> files;
-  char full_path[100];
-  sprintf(full_path, "/sdcard%s", folder);
-  Serial.printf("Listing directory: %s\n", full_path);
+  std::string full_path = getPath(folder);
+  Serial.printf("Listing directory: %s\n", full_path.c_str());
 
   // open the directory
-  DIR *dir = opendir(full_path);
+  DIR *dir = opendir(full_path.c_str());
   if (!dir)
   {
     Serial.println("Failed to open directory");
     return files;
   }
-  // add a trailing slash if there isn't one (for joining to filename)
-  if (folder[strlen(folder) - 1] != '/')
-  {
-    strcat(full_path, "/");
-  }
   // list all the files in the directory that end with the extension
   struct dirent *ent;
   while ((ent = readdir(dir)) != NULL)
@@ -174,6 +211,7 @@ std::vector<std::string> SDCard::listFiles(const char *folder, const char *exten
       files.push_back(full_path + filename);
     }
   }
+  closedir(dir);
   // sort the files alphabetically
   std::sort(files.begin(), files.end());
   return files;
@@ -7,6 +7,8 @@
 #include <vector>
 #include <string>
 
+class SdmmcBlockDevice;
+class FatVolume;
 
 class SDCard
 {
@@ -18,10 +20,17 @@ private:
     sdmmc_host_t m_host = SDSPI_HOST_DEFAULT();
   #endif
   bool sd_card_init_success = false;
+  // For reading files stored in one piece as raw sectors.
+  SdmmcBlockDevice *m_block_device = NULL;
+  FatVolume *m_volume = NULL;
+  // Let the AVI parser read straight from the card, once it's mounted.
+  void setupDirectReads();
 public:
   SDCard(gpio_num_t miso, gpio_num_t mosi, gpio_num_t clk, gpio_num_t cs);
   SDCard(gpio_num_t clk, gpio_num_t cmd, gpio_num_t d0, gpio_num_t d1, gpio_num_t d2, gpio_num_t d3);
   ~SDCard();
   bool isMounted();
   std::vector<std::string> listFiles(const char *folder, const char *extension=NULL);
+  // The full path of a folder on the card, ending in a slash.
+  std::string getPath(const char *folder);
 };
\ No newline at end of file
@@ -0,0 +1,158 @@
+#include <Arduino.h>
+#include <sys/stat.h>
+#include <esp_heap_caps.h>
+#include "SDCard.h"
+#include "SDCardBenchmark.h"
+#include "AVIParser/AVIParser.h"
+#include "AVIParser/ByteSource.h"
+
+
+#define BENCHMARK_MAX_BLOCK_SIZE (64 * 1024)
+
+// The ways of reading the file we compare.
+enum class BenchmarkSource
+{
+  STDIO,
+  FATFS
+};
+
+static const char *sourceName(BenchmarkSource sourceType)
+{
+  return sourceType == BenchmarkSource::STDIO ? "stdio" : "fatfs";
+}
+
+static ByteSource *openSource(BenchmarkSource sourceType, const std::string &path)
+{
+  #ifndef DISABLE_FATFS_READS
+  if (sourceType == BenchmarkSource::FATFS) {
+    return FatFsByteSource::open(path);
+  }
+  #endif
+  if (sourceType == BenchmarkSource::STDIO)
+  {
+    FILE *file = fopen(path.c_str(), "rb");
+    return file ? new FileByteSource(file) : NULL;
+  }
+  return NULL;
+}
+
+
+// Megabytes per second reading the start of the file in `blockSize` reads.
+static float sequentialMBps(ByteSource *source, uint8_t *buffer, size_t blockSize)
+{
+  size_t totalRead = 0;
+  unsigned long startTime = micros();
+  while (totalRead < SD_CARD_BENCHMARK_BYTES)
+  {
+    size_t bytesRead = source->read(buffer, min(blockSize, (size_t)(SD_CARD_BENCHMARK_BYTES - totalRead)));
+    if (bytesRead == 0) {
+      break;
+    }
+    totalRead += bytesRead;
+  }
+  unsigned long elapsed = micros() - startTime;
+  // (bytes per microsecond is megabytes per second)
+  return elapsed ? (float)totalRead / elapsed : 0;
+}
+
+
+// Megabytes per second reading the video's chunks the way the player does.
+static float chunkedMBps(ByteSource *source, uint8_t *buffer, size_t bufferLength)
+{
+  AVIParser parser(source, AVIChunkType::VIDEO);
+  if (!parser.open()) {
+    return 0;
+  }
+  size_t totalRead = 0;
+  unsigned long startTime = micros();
+  while (totalRead < SD_CARD_BENCHMARK_BYTES)
+  {
+    ChunkHeader header = parser.getNextHeader();
+    if (header.chunkType == EMPTY_CHUNK) {
+      break;
+    }
+    size_t length = bufferLength;
+    bool skip = header.chunkSize > bufferLength;
+    parser.getNextChunk(header, &buffer, length, skip);
+    totalRead += header.chunkSize;
+  }
+  unsigned long elapsed = micros() - startTime;
+  return elapsed ? (float)totalRead / elapsed : 0;
+}
+
+
+void runSDCardBenchmark(SDCard *card, const char *folder)
+{
+  // the biggest file gives the longest run
+  std::string testFile;
+  off_t testFileSize = 0;
+  for (const std::string &file : card->listFiles(folder, ".avi"))
+  {
+    struct stat fileStat;
+    if (stat(file.c_str(), &fileStat) == 0 && fileStat.st_size > testFileSize)
+    {
+      testFile = file;
+      testFileSize = fileStat.st_size;
+    }
+  }
+  if (testFile.empty())
+  {
+    Serial.println("SD card benchmark: no AVI files to read.");
+    return;
+  }
+  // a buffer the SD card can DMA into, and one it can't (in PSRAM, or misaligned if there's no PSRAM)
+  uint8_t *dmaBuffer = (uint8_t *)heap_caps_malloc(BENCHMARK_MAX_BLOCK_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+  uint8_t *otherBuffer = (uint8_t *)heap_caps_malloc(BENCHMARK_MAX_BLOCK_SIZE + 1, MALLOC_CAP_SPIRAM);
+  uint8_t *nonDmaBuffer = otherBuffer;
+  if (!otherBuffer)
+  {
+    otherBuffer = (uint8_t *)malloc(BENCHMARK_MAX_BLOCK_SIZE + 1);
+    nonDmaBuffer = otherBuffer ? otherBuffer + 1 : NULL;
+  }
+  if (!dmaBuffer || !nonDmaBuffer)
+  {
+    Serial.println("SD card benchmark: not enough memory.");
+    free(dmaBuffer);
+    free(otherBuffer);
+    return;
+  }
+
+  Serial.printf("SD card benchmark: reading %u KB of %s (%lld KB)\n", SD_CARD_BENCHMARK_BYTES / 1024, testFile.c_str(), (long long)testFileSize / 1024);
+  Serial.println("block size | source | MB/s (DMA buffer) | MB/s (other buffer)");
+  static const size_t blockSizes[] = {512, 4096, 16384, 32768, BENCHMARK_MAX_BLOCK_SIZE};
+  for (size_t blockSize : blockSizes)
+  {
+    for (BenchmarkSource sourceType : {BenchmarkSource::STDIO, BenchmarkSource::FATFS})
+    {
+      float speeds[2] = {0, 0};
+      uint8_t *buffers[2] = {dmaBuffer, nonDmaBuffer};
+      for (int i = 0; i < 2; i++)
+      {
+        ByteSource *source = openSource(sourceType, testFile);
+        if (source)
+        {
+          speeds[i] = sequentialMBps(source, buffers[i], blockSize);
+          delete source;
+        }
+      }
+      Serial.printf("%10u | %6s | %17.2f | %19.2f\n", blockSize, sourceName(sourceType), speeds[0], speeds[1]);
+    }
+  }
+  // the parser reads whole blocks into its own ring, and big chunks straight into the buffer
+  Serial.println("chunked   | source | MB/s (DMA buffer) | MB/s (other buffer)");
+  for (BenchmarkSource sourceType : {BenchmarkSource::STDIO, BenchmarkSource::FATFS})
+  {
+    float speeds[2] = {0, 0};
+    uint8_t *buffers[2] = {dmaBuffer, nonDmaBuffer};
+    for (int i = 0; i < 2; i++)
+    {
+      ByteSource *source = openSource(sourceType, testFile);
+      if (source) {
+        speeds[i] = chunkedMBps(source, buffers[i], BENCHMARK_MAX_BLOCK_SIZE);
+      }
+    }
+    Serial.printf("%10s | %6s | %17.2f | %19.2f\n", "AVI", sourceName(sourceType), speeds[0], speeds[1]);
+  }
+  free(dmaBuffer);
+  free(otherBuffer);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+class SDCard;
+
+// How much of the test file each benchmark reads.
+#ifndef SD_CARD_BENCHMARK_BYTES
+#define SD_CARD_BENCHMARK_BYTES (4 * 1024 * 1024)
+#endif
+
+// Print the SD card's sequential read speed for several block sizes, and the speed of reading a video
+// chunk by chunk, through stdio and through FATFS. Reads the biggest AVI file in `folder`.
+// (build with -DSD_CARD_BENCHMARK to run it at boot)
+void runSDCardBenchmark(SDCard *card, const char *folder);
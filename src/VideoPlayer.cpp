@@ -8,6 +8,45 @@
 #include "Displays/Display.h"
 
 
+// Sent through the read-ahead buffer (as a CHANNEL_CHUNK) where one channel follows on from the last,
+// so the player switches over when playback gets there rather than when the read-ahead does.
+typedef struct
+{
+  int channel;
+  AVIHeaderInfo headerInfo;
+  size_t maxChunkSize;
+} ChannelChange;
+
+
+// Audio samples in `bytes` of the stream's audio (each sample is every channel's value at one moment).
+static uint32_t audioSamples(const AVIHeaderInfo &info, size_t bytes)
+{
+  return info.audioBlockAlign > 1 ? bytes / info.audioBlockAlign : bytes;
+}
+
+// Convert PCM audio to the 8 bit mono the audio outputs take, in place (it only gets shorter).
+// Returns the number of samples.
+static int toMono8Bit(uint8_t *data, int length, int channels, int bitsPerSample)
+{
+  if (channels <= 1 && bitsPerSample == 8) {
+    return length;
+  }
+  int blockAlign = channels * bitsPerSample / 8;
+  int samples = length / blockAlign;
+  for (int i = 0; i < samples; i++)
+  {
+    const uint8_t *block = data + i * blockAlign;
+    int32_t sum = 0;
+    for (int channel = 0; channel < channels; channel++)
+    {
+      // (16 bit is signed little endian, 8 bit is unsigned)
+      sum += bitsPerSample == 16 ? (int16_t)(block[channel * 2] | block[channel * 2 + 1] << 8) : block[channel] - 128;
+    }
+    int32_t value = sum / channels;
+    data[i] = (bitsPerSample == 16 ? value >> 8 : value) + 128;
+  }
+  return samples;
+}
 
 
 void VideoPlayer::_framePlayerTask(void *param)
@@ -22,6 +61,24 @@ void VideoPlayer::_audioPlayerTask(void *param)
   player->audioPlayerTask();
 }
 
+void VideoPlayer::_readAheadTask(void *param)
+{
+  VideoPlayer *player = (VideoPlayer *)param;
+  player->readAheadTask();
+}
+
+void VideoPlayer::_sliceDecoderTask(void *param)
+{
+  VideoPlayer *player = (VideoPlayer *)param;
+  player->sliceDecoderTask();
+}
+
+void VideoPlayer::_channelOpenerTask(void *param)
+{
+  VideoPlayer *player = (VideoPlayer *)param;
+  player->channelOpenerTask();
+}
+
 VideoPlayer::VideoPlayer(ChannelData *channelData, Display &display, AudioOutput *audioOutput)
 : mChannelData(channelData), mDisplay(display), mState(VideoPlayerState::STOPPED), mAudioOutput(audioOutput)
 {
@@ -29,11 +86,8 @@ VideoPlayer::VideoPlayer(ChannelData *channelData, Display &display, AudioOutput
 
 void VideoPlayer::start()
 {
-  // allocate some small initial buffers for jpeg data
-  jpegDecodeBuffer = (uint8_t *) malloc(1024);
-  jpegDecodeBufferLength = 1024;
-  jpegReadBuffer = (uint8_t *) malloc(1024);
-  jpegReadBufferLength = 1024;
+  // initial size of the buffers for jpeg data (each channel grows them to its biggest frame)
+  mFrameQueue.reserve(VIDEO_WIDTH * VIDEO_HEIGHT / 4);
 
   // launch the frame player task
   xTaskCreatePinnedToCore(
@@ -45,6 +99,15 @@ void VideoPlayer::start()
       NULL,
       0);
   xTaskCreatePinnedToCore(_audioPlayerTask, "audio_loop", 1024 * 16, this, 1, NULL, 1);
+  // all SD card reads happen in the read-ahead task, so a slow read can't starve the audio output
+  xTaskCreatePinnedToCore(_readAheadTask, "read_ahead", 1024 * 8, this, 1, NULL, 1);
+  // the next channel is opened (and maybe indexed) below the read-ahead, which keeps this one's chunks coming
+  xTaskCreatePinnedToCore(_channelOpenerTask, "channel_opener", 1024 * 8, this, 0, NULL, 1);
+  #ifndef DISABLE_SLICED_DECODE
+  // the bottom half of each frame is decoded on core 1, below the audio and read-ahead tasks so it only gets
+  // the time they leave (and can never hold up the audio) - the frame task decodes it itself if it hasn't started
+  xTaskCreatePinnedToCore(_sliceDecoderTask, "slice_decoder", 1024 * 16, this, 0, NULL, 1);
+  #endif
 }
 
 void VideoPlayer::drawChannel(int channel)
@@ -61,7 +124,84 @@ void VideoPlayer::setChannel(int channel)
 {
   
   Serial.println("Setting channel in VideoPlayer::setChannel");
+  // stop the read-ahead task from using the old parser while we replace it
+  xSemaphoreTake(readAheadMutex, portMAX_DELAY);
+  _setChannel(channel);
+  xSemaphoreGive(readAheadMutex);
+}
+
+void VideoPlayer::_setChannel(int channel)
+{
+  // a channel that was opened ahead of time has already read its first header
+  bool prepared = mChannelData->getNextVideoParser() && mChannelData->getNextChannelNumber() == channel;
+  ChunkHeader nextHeader = mNextChannelHeader;
+  // (the audio task lets go of the read-ahead buffer before the old channel is closed)
+  _clearReadAhead();
+  _cancelNextChannel();
   mChannelData->setChannel(channel);
+  _channelChanged();
+  if (prepared) {
+    mPendingHeader = nextHeader;
+  }
+}
+
+void VideoPlayer::tune(int channel)
+{
+  Serial.printf("VideoPlayer::tune(%d)\n", channel);
+  // (a newer request replaces one that hasn't been picked up yet)
+  xSemaphoreTake(tuneMutex, portMAX_DELAY);
+  mTuningChannel = channel;
+  mTunePending = true;
+  mState = VideoPlayerState::TUNING;
+  xSemaphoreGive(tuneMutex);
+}
+
+void VideoPlayer::_tuneChannel()
+{
+  xSemaphoreTake(tuneMutex, portMAX_DELAY);
+  int channel = mTuningChannel;
+  mTunePending = false;
+  xSemaphoreGive(tuneMutex);
+
+  unsigned long tuneStartTime = millis();
+  // (the read-ahead is cleared, so the frame task throws away any frame left over from the last channel)
+  _setChannel(channel);
+  bool opened = mChannelData->getVideoParser() != NULL;
+
+  xSemaphoreTake(tuneMutex, portMAX_DELAY);
+  // stay tuning if another channel was asked for in the meantime (or stop if we were stopped)
+  if (!mTunePending && mState == VideoPlayerState::TUNING)
+  {
+    if (opened) {
+      Serial.printf("Tuned to channel %d in %lums\n", channel, millis() - tuneStartTime);
+    }
+    else {
+      Serial.printf("Failed to tune to channel %d\n", channel);
+    }
+    mCurrentAudioSample = 0;
+    // the static stays on screen until the first frame is drawn over it
+    mState = opened ? VideoPlayerState::PLAYING : VideoPlayerState::PLAYING_FINISHED;
+  }
+  xSemaphoreGive(tuneMutex);
+}
+
+bool VideoPlayer::resumeChannel()
+{
+  xSemaphoreTake(readAheadMutex, portMAX_DELAY);
+  _clearReadAhead();
+  _cancelNextChannel();
+  bool resumed = mChannelData->resumeChannel();
+  _channelChanged();
+  xSemaphoreGive(readAheadMutex);
+  return resumed;
+}
+
+void VideoPlayer::_channelChanged()
+{
+  AVIParser *parser = mChannelData->getVideoParser();
+  if (parser) {
+    _configureForChannel(parser->getHeaderInfo(), _getMaxChunkSize(parser));
+  }
   // set the audio sample to 0 - TODO - move this somewhere else?
   mCurrentAudioSample = 0;
 }
@@ -88,6 +228,20 @@ void VideoPlayer::stop()
   mState = VideoPlayerState::STOPPED;
   // mVideoSource->setState(VideoPlayerState::STOPPED);
   mCurrentAudioSample = 0;
+  // throw away a next channel that's still opening, and wait for the opener to finish with it, so no file is
+  // being opened once we've stopped (the position is stored next, before deep sleep)
+  xSemaphoreTake(readAheadMutex, portMAX_DELAY);
+  _cancelNextChannel();
+  xSemaphoreGive(readAheadMutex);
+  unsigned long waitStart = millis();
+  while (mChannelOpenerBusy)
+  {
+    if (millis() - waitStart > 5000) {
+      Serial.println("Timeout waiting for the channel opener in stop");
+      break;
+    }
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+  }
   if (xSemaphoreTake(displayControlMutex, 100)) {
     mDisplay.fillScreen(DisplayColors::BLACK);
     xSemaphoreGive(displayControlMutex);
@@ -100,21 +254,17 @@ void VideoPlayer::_setPlayingFinished()
   if (mState == VideoPlayerState::PLAYING_FINISHED){
     return;
   }
-  // wait for any current frame to finish drawing
-  bool stillDrawing = true;
-  while (stillDrawing){
-    if (xSemaphoreTake(jpegBufferMutex, 1000)){
-      stillDrawing = frameReady;
-      xSemaphoreGive(jpegBufferMutex);
-    }
-    else {
-      Serial.println("Timeout waiting for jpegBufferMutex in _setPlayingFinished");
-      stillDrawing = false;
+  // wait for the frames still queued to be drawn
+  unsigned long waitStart = millis();
+  while (!mFrameQueue.isEmpty()){
+    if (millis() - waitStart > 1000) {
+      Serial.println("Timeout waiting for the frame queue in _setPlayingFinished");
+      break;
     }
+    vTaskDelay(1);
   }
   Serial.println("Playing finished.");
   mState = VideoPlayerState::PLAYING_FINISHED;
-  frameReady = false;
   mCurrentAudioSample = 0;
   if (xSemaphoreTake(displayControlMutex, 100)) {
     mDisplay.fillScreen(DisplayColors::BLACK);
@@ -145,14 +295,226 @@ void VideoPlayer::playStatic()
 }
 
 
+// The next speed up from `speed` in SCAN_SPEEDS (0 after the fastest).
+static int nextScanSpeed(int speed)
+{
+  static const int speeds[] = {SCAN_SPEEDS};
+  for (int nextSpeed : speeds)
+  {
+    if (nextSpeed > speed) {
+      return nextSpeed;
+    }
+  }
+  return 0;
+}
+
+void VideoPlayer::fastForward()
+{
+  scan(nextScanSpeed(mState == VideoPlayerState::FAST_FORWARD ? mScanSpeed : 0));
+}
+
+void VideoPlayer::rewind()
+{
+  scan(-nextScanSpeed(mState == VideoPlayerState::REWIND ? mScanSpeed : 0));
+}
+
+void VideoPlayer::scan(int speed)
+{
+  Serial.printf("VideoPlayer::scan(%d)\n", speed);
+  // the read-ahead task does the scanning, so keep it out of the parser while we change over
+  xSemaphoreTake(readAheadMutex, portMAX_DELAY);
+  AVIParser *parser = mChannelData->getVideoParser();
+  if (speed == 0)
+  {
+    if (parser && _isScanning()) {
+      _stopScanning(parser);
+    }
+  }
+  else if (!parser || !parser->hasIndex() || parser->getFrameRate() == 0)
+  {
+    Serial.println("Can't fast forward or rewind without an index.");
+  }
+  else if (mState == VideoPlayerState::PLAYING || _isScanning())
+  {
+    if (mState == VideoPlayerState::PLAYING)
+    {
+      // start from the frame on screen, not the one the read-ahead has got to
+      float bufferedFrames = (float)mBufferedAudioSamples * parser->getFrameRate() / mAudioRate;
+      mScanFrame = max(0.0f, parser->getNextFrame() - bufferedFrames);
+      _clearReadAhead();
+      mScanHalfScale = false;
+      mNextScanFrameTime = millis();
+    }
+    mScanSpeed = abs(speed);
+    mState = speed > 0 ? VideoPlayerState::FAST_FORWARD : VideoPlayerState::REWIND;
+  }
+  xSemaphoreGive(readAheadMutex);
+}
+
+void VideoPlayer::_stopScanning(AVIParser *parser)
+{
+  parser->seekToFrame((uint32_t)mScanFrame);
+  _clearReadAhead();
+  if (mScanHalfScale) {
+    mClearBeforeFrame = true;
+  }
+  mState = VideoPlayerState::PLAYING;
+}
+
+void VideoPlayer::_clearReadAhead()
+{
+  mChunkBuffer.clear();
+  // wait for the audio task to finish with the chunk it's playing (it throws away the rest as it gets to them)
+  uint32_t generation = mChunkBuffer.getGeneration();
+  unsigned long waitStart = millis();
+  while (mAudioGeneration != generation)
+  {
+    if (millis() - waitStart > 1000) {
+      Serial.println("Timeout waiting for the audio task in _clearReadAhead");
+      break;
+    }
+    vTaskDelay(1);
+  }
+  mBufferedAudioSamples = 0;
+  mPendingHeader = EMPTY_HEADER;
+  mEndOfChannelQueued = false;
+  // (a next channel that's already open stays open, along with its pre-rolled header)
+  mNextChannelRequested = false;
+  _startTimeline();
+}
+
+
+void VideoPlayer::_cancelNextChannel()
+{
+  mNextChannelRequested = false;
+  mNextChannelOpening = false;
+  mNextChannelHeader = EMPTY_HEADER;
+  mOpenChannelGeneration++;
+}
+
+void VideoPlayer::_startTimeline()
+{
+  mTimelineAudioSamples = 0;
+  mStartTimeline = true;
+  mTimelineAnchored = false;
+  mFrameSkipper.reset();
+}
+
+void VideoPlayer::_setPresentationTime(ChunkPacket *packet, AVIParser *parser)
+{
+  packet->startsTimeline = mStartTimeline;
+  mStartTimeline = false;
+  if (packet->chunkType == AUDIO_CHUNK) {
+    packet->presentationSample = mTimelineAudioSamples;
+    mTimelineAudioSamples += audioSamples(parser->getHeaderInfo(), packet->length);
+    return;
+  }
+  if (packet->chunkType != VIDEO_CHUNK) {
+    return;
+  }
+  packet->presentationSample = _getFramePresentationTime(parser);
+}
+
+uint32_t VideoPlayer::_getFramePresentationTime(AVIParser *parser)
+{
+  // (without audio there's no clock to time frames against, so they're shown as they arrive)
+  const AVIHeaderInfo &info = parser->getHeaderInfo();
+  if (info.audioSampleRate == 0 || info.microSecondsPerFrame == 0) {
+    return NO_PRESENTATION_TIME;
+  }
+  uint32_t frame = parser->getNextFrame() - 1;
+  if (!mTimelineAnchored || frame < mAnchorFrame) {
+    mTimelineAnchored = true;
+    mAnchorFrame = frame;
+    mAnchorSample = mTimelineAudioSamples;
+  }
+  return mAnchorSample + (uint64_t)(frame - mAnchorFrame) * info.microSecondsPerFrame * info.audioSampleRate / 1000000;
+}
+
+uint32_t VideoPlayer::_getAudioClock()
+{
+  // (the clock is read before its time, which the audio task writes first, so it can lag but never jump ahead)
+  uint32_t clock = mAudioClock;
+  unsigned long elapsedMicros = micros() - mAudioClockTime;
+  // (no further than the last write, in case the audio has stalled)
+  return clock + min((uint64_t)elapsedMicros * mAudioRate / 1000000, (uint64_t)AUDIO_BUFFER_SAMPLES);
+}
+
+
 int _doDraw(JPEGDRAW *pDraw)
 {
   VideoPlayer *player = (VideoPlayer *)pDraw->pUser;
+  // (both halves of a sliced frame draw from here, one on each core - the display copies the pixels into one of
+  // its two DMA buffers and waits for the other to finish sending, so only one task can be in there at a time)
+  xSemaphoreTake(player->drawPixelsMutex, portMAX_DELAY);
   player->mDisplay.drawPixels(pDraw->x, pDraw->y, pDraw->iWidth, pDraw->iHeight, pDraw->pPixels);
+  xSemaphoreGive(player->drawPixelsMutex);
   return 1;
 }
 
 
+bool VideoPlayer::_decodeSlices(const uint8_t *frame, size_t frameLength)
+{
+  #ifdef DISABLE_SLICED_DECODE
+  return false;
+  #else
+  // (sized here, between frames, as nothing else touches the halves)
+  mJpegSlicer.reserve(max(frameLength, mFrameQueue.getReservedLength()));
+  if (!mJpegSlicer.split(frame, frameLength)) {
+    return false;
+  }
+  // both halves are opened before either is drawn, so a half that won't open leaves the whole frame to decode in one go
+  if (!mSliceJpeg.openRAM((uint8_t *)mJpegSlicer.getBottom(), mJpegSlicer.getBottomLength(), _doDraw)) {
+    return false;
+  }
+  if (!mJpeg.openRAM((uint8_t *)mJpegSlicer.getTop(), mJpegSlicer.getTopLength(), _doDraw))
+  {
+    // (back to the whole frame, for the caller)
+    mJpeg.openRAM((uint8_t *)frame, frameLength, _doDraw);
+    mJpeg.setUserPointer(this);
+    mJpeg.setPixelType(RGB565_BIG_ENDIAN);
+    return false;
+  }
+  mSliceJpeg.setUserPointer(this);
+  mSliceJpeg.setPixelType(RGB565_BIG_ENDIAN);
+  mJpeg.setUserPointer(this);
+  mJpeg.setPixelType(RGB565_BIG_ENDIAN);
+  // the other core decodes the bottom half while we decode the top
+  mSliceState = SLICE_READY;
+  xSemaphoreGive(sliceStartSemaphore);
+  mJpeg.decode(mDrawX, mDrawY, 0);
+  // if the other core hasn't got to it (it's busy with audio or the SD card), decode the bottom half here
+  int state = SLICE_READY;
+  if (mSliceState.compare_exchange_strong(state, SLICE_IDLE))
+  {
+    mSliceJpeg.decode(mDrawX, mDrawY + mJpegSlicer.getSplitY(), 0);
+    return true;
+  }
+  xSemaphoreTake(sliceDoneSemaphore, portMAX_DELAY);
+  mSliceState = SLICE_IDLE;
+  return true;
+  #endif
+}
+
+
+void VideoPlayer::sliceDecoderTask()
+{
+  #ifndef DISABLE_SLICED_DECODE
+  while (true)
+  {
+    xSemaphoreTake(sliceStartSemaphore, portMAX_DELAY);
+    // (the frame task may have decoded it already)
+    int state = SLICE_READY;
+    if (!mSliceState.compare_exchange_strong(state, SLICE_DECODING)) {
+      continue;
+    }
+    mSliceJpeg.decode(mDrawX, mDrawY + mJpegSlicer.getSplitY(), 0);
+    xSemaphoreGive(sliceDoneSemaphore);
+  }
+  #endif
+}
+
+
 void VideoPlayer::_drawStatic()
 {
   if (xSemaphoreTake(displayControlMutex, 0)) {
@@ -181,26 +543,96 @@ void VideoPlayer::_drawStatic()
 void VideoPlayer::_drawFrame()
 {
   bool frameDrawn = false;
-  // Take the jpeg mutex lock to check if a frame is ready, and draw if it is.
-  if (xSemaphoreTake(jpegBufferMutex, 100)){
-    // If the frame is ready, also take the display control mutex.
-    if (frameReady && xSemaphoreTake(displayControlMutex, 1000)){
-      // Draw the frame!
-      if (mJpeg.openRAM(jpegDecodeBuffer, jpegDecodeLength, _doDraw))
+  // Draw the oldest queued frame once it's due, if there is one (it stays queued until it's drawn).
+  const uint8_t *frame = NULL;
+  size_t frameLength = 0;
+  FrameInfo info = {NO_PRESENTATION_TIME, 0, 0, 0};
+  bool frameDue = false;
+  bool lagReported = false;
+  while (mFrameQueue.peek(&frame, &frameLength, &info))
+  {
+    // throw away frames read before the read-ahead was cleared (by a channel change or a seek)
+    if (info.generation != mChunkBuffer.getGeneration()) {
+      mFrameQueue.pop();
+      continue;
+    }
+    // (frames are shown as soon as they arrive while scanning)
+    if (info.presentationTime == NO_PRESENTATION_TIME || _isScanning()) {
+      frameDue = true;
+      break;
+    }
+    int32_t lateSamples = (int32_t)(_getAudioClock() - info.presentationTime);
+    if (lateSamples < 0) {
+      break;
+    }
+    // (how far behind we are, before any late frames are dropped)
+    if (!lagReported) {
+      mFrameSkipper.setLag((int32_t)((int64_t)lateSamples * 1000000 / mAudioRate));
+      lagReported = true;
+    }
+    // skip decoding frames we're too late for, as long as there's a newer one to show
+    if (lateSamples > (int32_t)(mAudioRate * LATE_FRAME_DROP_MS / 1000) && mFrameQueue.getDepth() > 1) {
+      mFrameQueue.pop();
+      mLateFrames++;
+      continue;
+    }
+    frameDue = true;
+    break;
+  }
+  if (frameDue && xSemaphoreTake(displayControlMutex, 1000)){
+    // Draw the frame!
+    if (mJpeg.openRAM((uint8_t *)frame, frameLength, _doDraw))
+    {
+      // clear whatever was drawn outside a frame in a new position
+      if (info.x != mDrawX || info.y != mDrawY)
+      {
+        mDrawX = info.x;
+        mDrawY = info.y;
+        mClearBeforeFrame = true;
+      }
+      if (mClearBeforeFrame) {
+        mDisplay.fillScreen(DisplayColors::BLACK);
+        mClearBeforeFrame = false;
+      }
+      mDisplay.startWrite();
+      mJpeg.setUserPointer(this);
+      mJpeg.setPixelType(RGB565_BIG_ENDIAN);
+      if (_isScanning() && mScanHalfScale)
+      {
+        // centered where the full size frame would be
+        int width = mJpeg.getWidth() / 2, height = mJpeg.getHeight() / 2;
+        mJpeg.decode(max(0, (mDisplay.width() - width) / 2), max(0, (mDisplay.height() - height) / 2), JPEG_SCALE_HALF);
+      }
+      else
       {
-        mDisplay.startWrite();
-        mJpeg.setUserPointer(this);
-        mJpeg.setPixelType(RGB565_BIG_ENDIAN);
-        mJpeg.decode(0, 0, 0);
+        unsigned long decodeStart = millis();
+        unsigned long decodeStartMicros = micros();
+        // (frames without restart markers are decoded in one go)
+        if (!_decodeSlices(frame, frameLength)) {
+          mJpeg.decode(mDrawX, mDrawY, 0);
+        }
+        if (!_isScanning()) {
+          mFrameSkipper.frameDecoded(micros() - decodeStartMicros);
+        }
+        // keep up the scanning frame rate by decoding smaller frames
+        if (_isScanning() && millis() - decodeStart > 1000 / SCAN_FPS)
+        {
+          Serial.println("Frames are too slow to decode for scanning. Switching to half size.");
+          mScanHalfScale = true;
+          mClearBeforeFrame = true;
+        }
       }
-      frameReady = false;
-      frameDrawn = true;
     }
-    xSemaphoreGive(jpegBufferMutex);
+    mFrameQueue.pop();
+    frameDrawn = true;
   }
 
   // If we drew a new frame above, finish any final tasks that dont require the mutex.
   if (frameDrawn){
+    if (!mDrewFirstFrame) {
+      mDrewFirstFrame = true;
+      Serial.printf("First frame drawn %lums after boot.\n", millis());
+    }
     frameTimes.push_back(millis());
     // keep the frame rate elapsed time to 5 seconds
     while(frameTimes.size() > 0 && frameTimes.back() - frameTimes.front() > 1000) {
@@ -222,7 +654,8 @@ void VideoPlayer::_drawFrame()
     // Adding a task delay is important for allowing the IDLE task to run (and feed the watchdog timer).
     // however, it can also prevent us from reaching a high (>~15) fps.
     // as a compromise, we can just add a task delay a max of once per frame.
-    if (drewFrameLastLoop){
+    // (a frame that isn't due yet will be at least a tick away, so wait for it rather than spinning)
+    if (drewFrameLastLoop || !mFrameQueue.isEmpty()){
       drewFrameLastLoop = false;
       vTaskDelay(1);
     }
@@ -238,14 +671,14 @@ void VideoPlayer::framePlayerTask()
   while (true)
   {
     // Draw random static to the display.
-    if (mState == VideoPlayerState::STATIC){
+    if (mState == VideoPlayerState::STATIC || mState == VideoPlayerState::TUNING){
       _drawStatic();
       vTaskDelay(4 / portTICK_PERIOD_MS);
       continue;
     }
 
     // Draw a video frame if one is available.
-    if (mState == VideoPlayerState::PLAYING){
+    if (mState == VideoPlayerState::PLAYING || _isScanning()){
       _drawFrame();
       continue;
     }
@@ -259,103 +692,425 @@ void VideoPlayer::framePlayerTask()
 
 void VideoPlayer::audioPlayerTask()
 {
-  size_t bufferLength = AUDIO_BUFFER_SAMPLES * BYTES_PER_SAMPLE;
-  uint8_t *audioData = (uint8_t *)malloc(bufferLength);
   while (true)
   {
-    if (mState != VideoPlayerState::PLAYING)
+    // we're between chunks, so let a channel change or seek waiting in _clearReadAhead carry on
+    mAudioGeneration = mChunkBuffer.getGeneration();
+    // (while scanning, the frames to show come through here too, so only this task pushes to the frame queue)
+    if (mState != VideoPlayerState::PLAYING && !_isScanning())
     {
       // nothing to do - just wait
-      vTaskDelay(100 / portTICK_PERIOD_MS);
+      vTaskDelay(10 / portTICK_PERIOD_MS);
       continue;
     }
-    // get audio data to play
-    int audioLength = _getAudioSamples(&audioData, bufferLength, mCurrentAudioSample);
+    // get the next chunk from the read-ahead buffer
+    ChunkPacket *packet = mChunkBuffer.receive(10 / portTICK_PERIOD_MS);
+    if (!packet) {
+      continue;
+    }
+    // throw away what was read before the read-ahead was cleared
+    if (mChunkBuffer.isStale(packet)) {
+      mChunkBuffer.release(packet);
+      continue;
+    }
+    uint8_t *data = ChunkBuffer::data(packet);
+    int length = packet->length;
+
     // have we reached the end of the channel?
-    if (audioLength == 0) {
+    if (packet->chunkType == EMPTY_CHUNK) {
+      mChunkBuffer.release(packet);
       // I don't really understand why, but if we MUST give the frame player task time to finish drawing,
       // otherwise, the program will halt.
       vTaskDelay(100 / portTICK_PERIOD_MS);
       _setPlayingFinished();
       continue;
     }
-    if (audioLength > 0) {
-      // play the audio
-      for(int i=0; i<audioLength; i+=AUDIO_BUFFER_SAMPLES) {
-        mAudioOutput->write(audioData + i, min(AUDIO_BUFFER_SAMPLES, audioLength - i));
-        mCurrentAudioSample += min(AUDIO_BUFFER_SAMPLES, audioLength - i);
-        if (mState != VideoPlayerState::PLAYING)
-        {
-          mCurrentAudioSample = 0;
-          break;
+    // the next channel follows on from here
+    if (packet->chunkType == CHANNEL_CHUNK) {
+      ChannelChange change;
+      memcpy(&change, data, sizeof(change));
+      mChunkBuffer.release(packet);
+      Serial.printf("Now playing channel %d\n", change.channel);
+      _configureForChannel(change.headerInfo, change.maxChunkSize);
+      mCurrentAudioSample = 0;
+      continue;
+    }
+    // line the new timeline up with the audio clock (and keep it lined up with each audio chunk)
+    if (packet->presentationSample != NO_PRESENTATION_TIME && (packet->startsTimeline || packet->chunkType == AUDIO_CHUNK)) {
+      mTimelineOffset = mAudioClock - packet->presentationSample;
+    }
+    // video frames are handed off as soon as the audio before them has played, to be shown at their time
+    if (packet->chunkType == VIDEO_CHUNK) {
+      uint32_t presentationTime = packet->presentationSample;
+      _setFrameReady(data, length, {presentationTime == NO_PRESENTATION_TIME ? NO_PRESENTATION_TIME : presentationTime + mTimelineOffset,
+                                    packet->generation, (int16_t)mFrameX, (int16_t)mFrameY});
+      mChunkBuffer.release(packet);
+      continue;
+    }
+    if (_isScanning()) {
+      mChunkBuffer.release(packet);
+      continue;
+    }
+
+    // play the audio
+    int samples = toMono8Bit(data, length, mAudioChannels, mAudioBitsPerSample);
+    mBufferedAudioSamples -= samples;
+    for(int i=0; i<samples; i+=AUDIO_BUFFER_SAMPLES) {
+      mAudioOutput->write(data + i, min(AUDIO_BUFFER_SAMPLES, samples - i));
+      mCurrentAudioSample += min(AUDIO_BUFFER_SAMPLES, samples - i);
+      mAudioClockTime = micros();
+      mAudioClock += min(AUDIO_BUFFER_SAMPLES, samples - i);
+      if (mState != VideoPlayerState::PLAYING)
+      {
+        mCurrentAudioSample = 0;
+        break;
+      }
+    }
+    mChunkBuffer.release(packet);
+  }
+}
+
+
+void VideoPlayer::readAheadTask()
+{
+  #if CORE_DEBUG_LEVEL > 2
+  unsigned long lastStatsTime = millis();
+  #endif
+  while (true)
+  {
+    // open a newly tuned channel (all SD card reads happen in this task)
+    if (mTunePending && xSemaphoreTake(readAheadMutex, portMAX_DELAY))
+    {
+      _tuneChannel();
+      xSemaphoreGive(readAheadMutex);
+    }
+    bool readChunk = false;
+    if ((mState == VideoPlayerState::PLAYING || _isScanning()) && xSemaphoreTake(readAheadMutex, portMAX_DELAY))
+    {
+      AVIParser *parser = mChannelData->getVideoParser();
+      if (parser && _isScanning()) {
+        readChunk = _readScanFrame(parser);
+      }
+      else if (parser && mState == VideoPlayerState::PLAYING) {
+        readChunk = _readAheadChunk(parser);
+        // use the time we're waiting anyway to get the next channel ready
+        if (!readChunk) {
+          _prepareNextChannel(parser, false);
         }
       }
+      xSemaphoreGive(readAheadMutex);
     }
-    else
+    // any time left over goes on reading short files into memory
+    if (!readChunk && !mTunePending && !_isScanning() && xSemaphoreTake(readAheadMutex, portMAX_DELAY))
     {
-      vTaskDelay(10 / portTICK_PERIOD_MS);
+      readChunk = mChannelData->fillCache();
+      xSemaphoreGive(readAheadMutex);
+    }
+    if (!readChunk) {
+      // we're far enough ahead (or there's nothing to play)
+      vTaskDelay(5 / portTICK_PERIOD_MS);
+    }
+
+    #if CORE_DEBUG_LEVEL > 2
+    if (millis() - lastStatsTime > 5000) {
+      lastStatsTime = millis();
+      ReadAheadStats stats = getReadAheadStats();
+      Serial.printf("Read-ahead: %d/%d bytes, %dms audio, %u producer stalls, %u consumer stalls\n",
+                    stats.fillLevel, stats.capacity, stats.bufferedAudioMs, stats.producerStalls, stats.consumerStalls);
+      Serial.printf("Frame queue: %u/%u frames (at most %u), %u dropped, %u late, %u skipped, %uus to decode\n",
+                    stats.frameQueueDepth, mFrameQueue.getCapacity(), stats.frameQueueMaxDepth, stats.droppedFrames,
+                    stats.lateFrames, stats.skippedFrames, stats.frameDecodeMicros);
     }
+    #endif
   }
 }
 
 
-int VideoPlayer::_getAudioSamples(uint8_t **buffer, size_t &bufferSize, int currentAudioSample)
+bool VideoPlayer::_readAheadChunk(AVIParser *parser)
 {
-  // read the audio data into the buffer
-  AVIParser *parser = mChannelData->getVideoParser();
-  if (parser) {
-    ChunkHeader header = {OTHER_CHUNK, 0};
-    
-    while (header.chunkType != EMPTY_CHUNK)
-    {
-      header = parser->getNextHeader();
+  if (mEndOfChannelQueued || mBufferedAudioSamples > mAudioRate * READ_AHEAD_MS / 1000) {
+    return false;
+  }
+  ChunkHeader header = mPendingHeader;
+  if (header.chunkType == EMPTY_CHUNK) {
+    header = parser->getNextHeader();
+  }
 
-      // skip empty chunks
-      if (header.chunkSize == 0) {continue;}
+  // end of the channel - carry straight on with the next one if we can,
+  // otherwise let the audio task know once it gets here
+  if (header.chunkType == EMPTY_CHUNK)
+  {
+    _prepareNextChannel(parser, true);
+    if (mChannelData->getNextVideoParser()) {
+      return _readAheadNextChannel();
+    }
+    // (the audio already read keeps playing while it's opened)
+    if (mNextChannelOpening) {
+      return false;
+    }
+    ChunkPacket *packet = mChunkBuffer.acquire(EMPTY_CHUNK, 0, 0);
+    if (packet) {
+      mChunkBuffer.send(packet);
+      mEndOfChannelQueued = true;
+    }
+    return false;
+  }
 
-      // read audio data
-      if (header.chunkType == AUDIO_CHUNK){
-        int audioLength = parser->getNextChunk(header, (uint8_t **) buffer, bufferSize);
-        return audioLength;
-      }
+  // skip empty chunks
+  if (header.chunkSize == 0) {return true;}
 
-      // Handle processing video chunks.
-      else if (header.chunkType == VIDEO_CHUNK){
-        // read video data
-        jpegReadLength = parser->getNextChunk(header, (uint8_t **) &jpegReadBuffer, jpegReadBufferLength);
+  if (header.chunkType != AUDIO_CHUNK && header.chunkType != VIDEO_CHUNK)
+  {
+    // this chunk is of no use to us. Skip it!
+    Serial.println("Found useless chunk.");
+    size_t unusedLength = 0;
+    parser->getNextChunk(header, NULL, unusedLength, true);
+    return true;
+  }
+  if (!mChunkBuffer.canHold(header.chunkSize))
+  {
+    Serial.printf("No room for a chunk of %d bytes. Skipping it.\n", header.chunkSize);
+    size_t unusedLength = 0;
+    parser->getNextChunk(header, NULL, unusedLength, true);
+    return true;
+  }
 
-        // Take the mutex lock and swap the read/decode buffers
-        if (xSemaphoreTake(jpegBufferMutex, 1000)){
-          if (frameReady) {Serial.println("Overwriting video chunk!");}
+#ifndef DISABLE_FRAME_SKIPPING
+  // while the decoder is behind, frames it won't have time for are skipped over rather than read
+  // (only timed frames, as untimed ones are shown as they arrive)
+  if (header.chunkType == VIDEO_CHUNK && _getFramePresentationTime(parser) != NO_PRESENTATION_TIME
+      && mFrameSkipper.skipFrame(parser->getHeaderInfo().microSecondsPerFrame, mFrameQueue.getDepth()))
+  {
+    size_t unusedLength = 0;
+    parser->getNextChunk(header, NULL, unusedLength, true);
+    mPendingHeader = EMPTY_HEADER;
+    return true;
+  }
+#endif
 
-          uint8_t *tempBuffer = jpegDecodeBuffer;
-          size_t tempBufferLength = jpegDecodeBufferLength;
-          size_t tempLength = jpegReadLength;
+  // read the chunk straight into the read-ahead buffer
+  ChunkPacket *packet = mChunkBuffer.acquire(header.chunkType, header.chunkSize, 5 / portTICK_PERIOD_MS);
+  if (!packet)
+  {
+    // no room yet - hold on to the header and try again later
+    mPendingHeader = header;
+    return false;
+  }
+  mPendingHeader = EMPTY_HEADER;
+  uint8_t *data = ChunkBuffer::data(packet);
+  size_t dataLength = header.chunkSize;
+  parser->getNextChunk(header, &data, dataLength);
+  if (header.chunkType == AUDIO_CHUNK) {
+    mBufferedAudioSamples += audioSamples(parser->getHeaderInfo(), header.chunkSize);
+  }
+  _setPresentationTime(packet, parser);
+  mChunkBuffer.send(packet);
+  return true;
+}
 
-          jpegDecodeBuffer = jpegReadBuffer;
-          jpegDecodeBufferLength = jpegReadBufferLength;
-          jpegDecodeLength = jpegReadLength;
 
-          jpegReadBuffer = tempBuffer;
-          jpegReadBufferLength = tempBufferLength;
-          jpegReadLength = tempLength;
-          frameReady = true;
+void VideoPlayer::_prepareNextChannel(AVIParser *parser, bool atEnd)
+{
+  if (mNextChannelRequested) {
+    return;
+  }
+  // (without an index we don't know how long is left, so it waits for the end)
+  float frameRate = parser->getFrameRate();
+  uint32_t frameCount = parser->getVideoFrameCount();
+  uint32_t remainingMs = 0;
+  if (frameRate > 0 && frameCount > parser->getNextFrame()) {
+    remainingMs = (frameCount - parser->getNextFrame()) * 1000 / frameRate;
+  }
+  if (!atEnd && (frameRate == 0 || frameCount == 0 || remainingMs > NEXT_CHANNEL_PREPARE_MS)) {
+    return;
+  }
+  mNextChannelRequested = true;
+  // (it may still be open from before a seek)
+  if (mNextChannelOpening || mChannelData->getNextVideoParser()) {
+    return;
+  }
+  if (!mChannelData->pickNextChannel(&mOpenChannel, &mOpenChannelPath)) {
+    Serial.println("Failed to prepare the next channel.");
+    return;
+  }
+  // the channel opener task opens it, while we carry on reading this one
+  mOpenChannelStartsInMs = remainingMs + mBufferedAudioSamples * 1000 / mAudioRate;
+  mOpenChannelRequestTime = millis();
+  mNextChannelOpening = true;
+  xSemaphoreGive(openChannelSemaphore);
+}
 
-          xSemaphoreGive(jpegBufferMutex);
-        }
-        else{
-          Serial.println("_getAudioSamples failed to get semaphore and skipped video chunk.");
-        }
-      }
 
-      else {
-        // this chunk is of no use to us. Skip it!
-        Serial.println("Found useless chunk.");
-        parser->getNextChunk(header, (uint8_t **) buffer, bufferSize, true);
+void VideoPlayer::channelOpenerTask()
+{
+  while (true)
+  {
+    xSemaphoreTake(openChannelSemaphore, portMAX_DELAY);
+    xSemaphoreTake(readAheadMutex, portMAX_DELAY);
+    bool opening = mNextChannelOpening;
+    int channel = mOpenChannel;
+    std::string path = mOpenChannelPath;
+    uint32_t startsInMs = mOpenChannelStartsInMs;
+    unsigned long requestTime = mOpenChannelRequestTime;
+    uint32_t generation = mOpenChannelGeneration;
+    mChannelOpenerBusy = opening;
+    xSemaphoreGive(readAheadMutex);
+    if (!opening) {
+      continue;
+    }
+
+    // (without the mutex, as opening can mean building the index - the read-ahead carries on meanwhile)
+    unsigned long openStartTime = millis();
+    uint32_t waitedMs = openStartTime - requestTime;
+    AVIParser *parser = mChannelData->openParser(path, channel, startsInMs > waitedMs ? startsInMs - waitedMs : 0, false);
+    // pre-roll - reading the first header brings the first frame and its audio in from the SD card
+    ChunkHeader header = parser ? parser->getNextHeader() : EMPTY_HEADER;
+    Serial.printf("Opened channel %d in the background in %lums\n", channel, millis() - openStartTime);
+
+    xSemaphoreTake(readAheadMutex, portMAX_DELAY);
+    if (generation == mOpenChannelGeneration)
+    {
+      if (!parser) {
+        Serial.println("Failed to prepare the next channel.");
       }
+      mChannelData->setNextVideoParser(parser);
+      mNextChannelHeader = header;
+      mNextChannelOpening = false;
+    }
+    else {
+      // the channel changed (or playback stopped) while we were opening it
+      delete parser;
+    }
+    mChannelOpenerBusy = false;
+    xSemaphoreGive(readAheadMutex);
+  }
+}
+
+
+bool VideoPlayer::_readAheadNextChannel()
+{
+  ChunkPacket *packet = mChunkBuffer.acquire(CHANNEL_CHUNK, sizeof(ChannelChange), 5 / portTICK_PERIOD_MS);
+  if (!packet) {
+    return false;
+  }
+  ChunkHeader nextHeader = mNextChannelHeader;
+  mChannelData->switchToNextChannel();
+  AVIParser *parser = mChannelData->getVideoParser();
+  ChannelChange change = {mChannelData->getChannelNumber(), parser->getHeaderInfo(), _getMaxChunkSize(parser)};
+  memcpy(ChunkBuffer::data(packet), &change, sizeof(change));
+  mChunkBuffer.send(packet);
+  // carry on from the pre-rolled header (the buffered audio from the last channel is still playing)
+  mPendingHeader = nextHeader;
+  mNextChannelRequested = false;
+  mNextChannelHeader = EMPTY_HEADER;
+  // (the new channel's times start from its first chunk)
+  _startTimeline();
+  return true;
+}
+
 
+bool VideoPlayer::_readScanFrame(AVIParser *parser)
+{
+  // wait for the frame time (and for the last frame to be drawn)
+  if ((long)(millis() - mNextScanFrameTime) < 0 || mChunkBuffer.getFillLevel() > 0 || !mFrameQueue.isEmpty()) {
+    return false;
+  }
+  mNextScanFrameTime += 1000 / SCAN_FPS;
+  // don't try to catch up on frames we were too slow for
+  if ((long)(millis() - mNextScanFrameTime) > 0) {
+    mNextScanFrameTime = millis();
+  }
+
+  // step `speed` seconds of video for each second of scanning
+  float step = mScanSpeed * parser->getFrameRate() / SCAN_FPS;
+  mScanFrame += mState == VideoPlayerState::FAST_FORWARD ? step : -step;
+  uint32_t frameCount = parser->getVideoFrameCount();
+  bool reachedEnd = mScanFrame <= 0 || mScanFrame >= frameCount;
+  mScanFrame = constrain(mScanFrame, 0.0f, frameCount > 0 ? (float)(frameCount - 1) : 0.0f);
+
+  // read just this frame's chunk, and hand it to the audio task to queue (to be shown straight away)
+  ChunkHeader header = parser->seekToFrameChunk((uint32_t)mScanFrame);
+  if (header.chunkType == VIDEO_CHUNK && header.chunkSize > 0 && mChunkBuffer.canHold(header.chunkSize))
+  {
+    ChunkPacket *packet = mChunkBuffer.acquire(VIDEO_CHUNK, header.chunkSize, 5 / portTICK_PERIOD_MS);
+    if (packet)
+    {
+      uint8_t *data = ChunkBuffer::data(packet);
+      size_t dataLength = header.chunkSize;
+      parser->getNextChunk(header, &data, dataLength);
+      mChunkBuffer.send(packet);
     }
   }
-  Serial.println("No audio or video chunks found!");
-  return 0;
+  if (reachedEnd)
+  {
+    Serial.println("Scanned to the end of the channel.");
+    _stopScanning(parser);
+  }
+  return true;
+}
+
+
+void VideoPlayer::_setFrameReady(const uint8_t *data, size_t length, const FrameInfo &info)
+{
+  // (a short decode spike is absorbed by the queue - only a long one drops frames)
+  if (!mFrameQueue.push(data, length, info)) {
+    Serial.println("Frame queue full. Skipped video chunk!");
+  }
+}
+
+
+size_t VideoPlayer::_getMaxChunkSize(AVIParser *parser)
+{
+  // (the index knows the real biggest frame, which can be more than the suggested buffer size)
+  return max((size_t)parser->getMaxVideoChunkSize(), (size_t)parser->getHeaderInfo().videoBufferSize);
+}
+
+
+void VideoPlayer::_configureForChannel(const AVIHeaderInfo &info, size_t maxChunkSize)
+{
+  // audio rate
+  if (info.audioSampleRate && info.audioSampleRate != mAudioOutput->getSampleRate())
+  {
+    Serial.printf("Changing audio rate from %u to %u\n", mAudioOutput->getSampleRate(), info.audioSampleRate);
+    mAudioOutput->setSampleRate(info.audioSampleRate);
+  }
+  mAudioRate = mAudioOutput->getSampleRate() ? mAudioOutput->getSampleRate() : AUDIO_RATE;
+  // (the parser turns down anything but 8 or 16 bit PCM)
+  mAudioChannels = info.audioBlockAlign ? info.audioChannels : 1;
+  mAudioBitsPerSample = info.audioBlockAlign ? info.audioBitsPerSample : 8;
+  if (mAudioBitsPerSample != 8 || mAudioChannels > 1)
+  {
+    Serial.printf("Converting %u bit %u channel audio to 8 bit mono.\n", mAudioBitsPerSample, mAudioChannels);
+  }
+
+  // center frames that are smaller than the display
+  int frameX = info.width && (int)info.width < mDisplay.width() ? (mDisplay.width() - (int)info.width) / 2 : 0;
+  int frameY = info.height && (int)info.height < mDisplay.height() ? (mDisplay.height() - (int)info.height) / 2 : 0;
+  // (the frame task clears the screen when it gets to the first frame in a new position)
+  mFrameX = frameX;
+  mFrameY = frameY;
+
+  // size the jpeg buffers up front so frames never realloc during playback
+  // (the frame task grows its buffers to this between frames)
+  if (maxChunkSize) {
+    mFrameQueue.reserve(maxChunkSize);
+  }
+}
+
+
+ReadAheadStats VideoPlayer::getReadAheadStats()
+{
+  return {
+    mChunkBuffer.getFillLevel(),
+    mChunkBuffer.getCapacity(),
+    (int)(mBufferedAudioSamples * 1000 / mAudioRate),
+    mChunkBuffer.getProducerStalls(),
+    mChunkBuffer.getConsumerStalls(),
+    mFrameQueue.getDepth(),
+    mFrameQueue.getMaxDepth(),
+    mFrameQueue.getDroppedFrames(),
+    mLateFrames,
+    mFrameSkipper.getSkippedFrames(),
+    mFrameSkipper.getDecodeMicros()
+  };
 }
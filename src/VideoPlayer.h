@@ -6,9 +6,15 @@
 #include "JPEGDEC.h"
 #include "ChannelData/SDCardChannelData.h"
 #include "VideoPlayerState.h"
+#include "ChunkBuffer/ChunkBuffer.h"
+#include "FrameQueue/FrameQueue.h"
+#include "JpegSlicer/JpegSlicer.h"
+#include "FrameSkipper/FrameSkipper.h"
 #include <list>
+#include <atomic>
 
 
+// Default audio rate, used until a video's headers say otherwise.
 #ifndef AUDIO_RATE
 #define AUDIO_RATE 16000
 #endif
@@ -16,7 +22,36 @@
 #ifndef AUDIO_BUFFER_SAMPLES
 #define AUDIO_BUFFER_SAMPLES 1000
 #endif
-#define BYTES_PER_SAMPLE 1
+
+// Size (in bytes) of the buffer of chunks read ahead of playback.
+#ifndef READ_AHEAD_BUFFER_SIZE
+#define READ_AHEAD_BUFFER_SIZE (64 * 1024)
+#endif
+// How far ahead of the audio output the read-ahead task tries to get.
+#ifndef READ_AHEAD_MS
+#define READ_AHEAD_MS 500
+#endif
+
+// How long before the end of a channel to open the next one, so it follows on without a gap.
+#ifndef NEXT_CHANNEL_PREPARE_MS
+#define NEXT_CHANNEL_PREPARE_MS 3000
+#endif
+
+// Frames more than this late (behind the audio) are dropped without being decoded, as long as there's a
+// newer frame to show instead.
+#ifndef LATE_FRAME_DROP_MS
+#define LATE_FRAME_DROP_MS 40
+#endif
+// Define DISABLE_FRAME_SKIPPING to read every frame, even when they're too slow to decode (late ones are still dropped).
+
+// Fast forward and rewind speeds (times normal speed), stepped through with each press.
+#ifndef SCAN_SPEEDS
+#define SCAN_SPEEDS 4, 8, 16
+#endif
+// Frames shown per second while fast forwarding or rewinding.
+#ifndef SCAN_FPS
+#define SCAN_FPS 15
+#endif
 
 #ifndef VIDEO_WIDTH
   #if TFT_ROTATION == 0 | TFT_ROTATION == 2
@@ -37,6 +72,26 @@
 class Display;
 class AudioOutput;
 
+// Read-ahead buffer statistics, for sizing the buffer per board.
+typedef struct
+{
+  size_t fillLevel;
+  size_t capacity;
+  int bufferedAudioMs;
+  uint32_t producerStalls;
+  uint32_t consumerStalls;
+  // Frames waiting to be decoded (now, and at most), and frames dropped because the queue was full.
+  uint32_t frameQueueDepth;
+  uint32_t frameQueueMaxDepth;
+  uint32_t droppedFrames;
+  // Frames dropped (before decoding) because they were already late.
+  uint32_t lateFrames;
+  // Frames skipped over on the SD card because the decoder wouldn't have had time for them.
+  uint32_t skippedFrames;
+  // How long a frame takes to decode and draw (a running average).
+  uint32_t frameDecodeMicros;
+} ReadAheadStats;
+
 // class VideoSource;
 // class AudioSource;
 
@@ -50,6 +105,19 @@ class VideoPlayer {
     // Mutex for ensuring one-at-a-time access to display communication.
     SemaphoreHandle_t displayControlMutex = xSemaphoreCreateMutex();
     JPEGDEC mJpeg = JPEGDEC();
+    #ifndef DISABLE_SLICED_DECODE
+    // Frames with restart markers are cut in two, and the bottom half is decoded on the other core.
+    JpegSlicer mJpegSlicer;
+    JPEGDEC mSliceJpeg = JPEGDEC();
+    SemaphoreHandle_t sliceStartSemaphore = xSemaphoreCreateBinary();
+    SemaphoreHandle_t sliceDoneSemaphore = xSemaphoreCreateBinary();
+    // Who has the bottom half: whichever task takes it from ready decodes it.
+    enum { SLICE_IDLE, SLICE_READY, SLICE_DECODING };
+    std::atomic<int> mSliceState{SLICE_IDLE};
+    #endif
+    // Held while drawing decoded pixels, as both halves of a sliced frame draw at once through the display's
+    // shared DMA buffers (inside the frame task's write, which waits for the slice task before it ends).
+    SemaphoreHandle_t drawPixelsMutex = xSemaphoreCreateMutex();
 
     // channel information
     ChannelData *mChannelData = NULL;
@@ -59,28 +127,98 @@ class VideoPlayer {
     // audio playing
     int mCurrentAudioSample = 0;
     AudioOutput *mAudioOutput = NULL;
+    // The audio rate of the current channel (from its stream format).
+    uint32_t mAudioRate = AUDIO_RATE;
+    // Audio task: the current channel's audio format, which is converted to 8 bit mono as it's played.
+    uint16_t mAudioChannels = 1;
+    uint16_t mAudioBitsPerSample = 8;
+
+    // Position of the current channel's frames on the display (smaller frames are centered), given to each frame
+    // as it's queued, as the frames of the last channel may still be waiting to be drawn.
+    std::atomic<int> mFrameX{0};
+    std::atomic<int> mFrameY{0};
+    // Frame task: where the frame being drawn goes (the slice task draws its bottom half there too).
+    int mDrawX = 0;
+    int mDrawY = 0;
 
     // Buffer used for quickly drawing "static" (random noise) to the display.
     uint32_t *staticBuf = (uint32_t*) malloc(VIDEO_WIDTH * 2);
     size_t staticBufLength = VIDEO_WIDTH / 2;
 
-    // The buffer to use for jpeg frame decoding.
-    uint8_t *jpegDecodeBuffer = NULL;
-    // The total size of the jpeg decode buffer
-    size_t jpegDecodeBufferLength = 0;
-    // The real length of jpeg data stored in the buffer (might be less than buffer length)
-    size_t jpegDecodeLength = 0;
-    // The buffer to read jpeg data into
-    uint8_t *jpegReadBuffer = NULL;
-    // The total size of the jpeg decode buffer
-    size_t jpegReadBufferLength = 0;
-    // The real length of jpeg data stored in the buffer (might be less than buffer length)
-    size_t jpegReadLength = 0;
-    bool frameReady = false;
-    // Mutex used to lock jpeg decoding while the audio task is swapping the buffers (and setting frameReady).
-    // Otherwise the audio task only writes to the "read" buffer, and the frame task only reads from the "decode" buffer.
-    SemaphoreHandle_t jpegBufferMutex = xSemaphoreCreateMutex();
-  
+    // Video frames waiting for the frame player task (pushed by the audio task as their audio plays, and only
+    // emptied or resized by the frame player task).
+    FrameQueue mFrameQueue{FRAME_QUEUE_DEPTH};
+
+    // Chunks read from the SD card ahead of playback by the read-ahead task.
+    ChunkBuffer mChunkBuffer = ChunkBuffer(READ_AHEAD_BUFFER_SIZE);
+    // Held by the read-ahead task while it's using the parser, so the channel can't change under it.
+    SemaphoreHandle_t readAheadMutex = xSemaphoreCreateMutex();
+    // A header that has been read, but whose chunk didn't fit in the buffer yet.
+    ChunkHeader mPendingHeader = EMPTY_HEADER;
+    // Set once the end of the channel has been queued.
+    bool mEndOfChannelQueued = false;
+    // Number of audio samples in the read-ahead buffer (not bytes - a sample is the stream's block alignment).
+    std::atomic<int> mBufferedAudioSamples{0};
+    // Audio task: the read-ahead buffer's generation when it was last between chunks (so a clear can wait for it).
+    std::atomic<uint32_t> mAudioGeneration{0};
+    // Set once the next channel has been asked for (it's opened once per channel).
+    bool mNextChannelRequested = false;
+    // The next channel's first header, read when it was opened (which brings its first chunks into memory).
+    ChunkHeader mNextChannelHeader = EMPTY_HEADER;
+
+    // opening the next channel (in the channel opener task, so the current one keeps reading meanwhile)
+    // These are all guarded by readAheadMutex, which the opener only holds to pick up a request and hand back the result.
+    SemaphoreHandle_t openChannelSemaphore = xSemaphoreCreateBinary();
+    // Set while the next channel is being opened.
+    bool mNextChannelOpening = false;
+    int mOpenChannel = 0;
+    std::string mOpenChannelPath;
+    uint32_t mOpenChannelStartsInMs = 0;
+    unsigned long mOpenChannelRequestTime = 0;
+    // Moved on when the channel changes, so a next channel opened for the old one is thrown away.
+    uint32_t mOpenChannelGeneration = 0;
+    // Set by the opener while it's opening a channel (without the mutex), so stop() can wait for it.
+    std::atomic<bool> mChannelOpenerBusy{false};
+
+    // presentation times (in audio samples)
+    // Read-ahead task: audio samples queued since the timeline started (after a seek or a channel change).
+    uint32_t mTimelineAudioSamples = 0;
+    // Read-ahead task: the next chunk queued starts a new timeline.
+    bool mStartTimeline = true;
+    // Read-ahead task: the first frame on the timeline, and the sample it plays at (the others follow at the frame rate).
+    bool mTimelineAnchored = false;
+    uint32_t mAnchorFrame = 0;
+    uint32_t mAnchorSample = 0;
+    // Which frames the read-ahead task skips over while the frame task can't keep up.
+    FrameSkipper mFrameSkipper;
+    // Audio task: samples written to the audio output (never reset), and when they were last written (in micros).
+    std::atomic<uint32_t> mAudioClock{0};
+    std::atomic<unsigned long> mAudioClockTime{0};
+    // Audio task: the audio clock at the start of the current timeline.
+    uint32_t mTimelineOffset = 0;
+    // Frames dropped by the frame task because they were late.
+    std::atomic<uint32_t> mLateFrames{0};
+
+    // fast forward / rewind
+    // How many times normal speed we're scanning at.
+    int mScanSpeed = 0;
+    // The frame we've scanned to (fractional, so small steps add up).
+    float mScanFrame = 0;
+    unsigned long mNextScanFrameTime = 0;
+    // Frames that take too long to decode at full size are decoded at half size while scanning.
+    bool mScanHalfScale = false;
+    // Clear the display before drawing the next frame (the frame size has changed).
+    bool mClearBeforeFrame = false;
+
+    // channel tuning (the read-ahead task opens the channel while the frame task shows static)
+    // Held while handing a tuning request over.
+    SemaphoreHandle_t tuneMutex = xSemaphoreCreateMutex();
+    int mTuningChannel = 0;
+    std::atomic<bool> mTunePending{false};
+
+    // Set once the first frame since boot has been drawn (to report the wake time).
+    bool mDrewFirstFrame = false;
+
     // Track whether or not the previous _drawFrame loop drew a frame
     // (used for limiting the amount of vTaskDelay calls we make)
     bool drewFrameLastLoop = false;
@@ -90,19 +228,73 @@ class VideoPlayer {
 
     static void _framePlayerTask(void *param);
     static void _audioPlayerTask(void *param);
+    static void _readAheadTask(void *param);
+    static void _sliceDecoderTask(void *param);
+    static void _channelOpenerTask(void *param);
 
     void _drawStatic();
     void _drawFrame();
     void framePlayerTask();
     void audioPlayerTask();
-    int _getAudioSamples(uint8_t **buffer, size_t &bufferSize, int currentAudioSample);
+    void readAheadTask();
+    void sliceDecoderTask();
+    void channelOpenerTask();
+    // Decode the frame in two halves, one on each core.
+    // Returns false (having drawn nothing) if it can't be split.
+    bool _decodeSlices(const uint8_t *frame, size_t frameLength);
+    // Read the next chunk from the parser into the read-ahead buffer.
+    // Returns false if there's nothing to do right now.
+    bool _readAheadChunk(AVIParser *parser);
+    // Ask for the next channel to be opened if the current one is nearly over (or `atEnd`).
+    void _prepareNextChannel(AVIParser *parser, bool atEnd);
+    // Forget the next channel (the channel is changing), throwing it away if it's still being opened.
+    void _cancelNextChannel();
+    // Carry on reading from the prepared next channel, marking the change in the read-ahead buffer.
+    // Returns false if there's no next channel (or no room for the marker yet).
+    bool _readAheadNextChannel();
+    // Show the next frame while fast forwarding or rewinding.
+    // Returns false if there's nothing to do right now.
+    bool _readScanFrame(AVIParser *parser);
+    // Go back to normal playback from the frame we've scanned to.
+    void _stopScanning(AVIParser *parser);
+    // Throw away everything that has been read ahead, once the audio task has finished with the chunk it's on.
+    void _clearReadAhead();
+    // Start a new timeline with the next chunk that's queued.
+    void _startTimeline();
+    // Set when a chunk that's about to be queued should play (called after the parser has read its header).
+    void _setPresentationTime(ChunkPacket *packet, AVIParser *parser);
+    // When the video chunk the parser has just read the header of should play (or NO_PRESENTATION_TIME).
+    uint32_t _getFramePresentationTime(AVIParser *parser);
+    // The audio sample playing now (moved on from the last write by the time since).
+    uint32_t _getAudioClock();
+    // Get ready to play the channel data's newly opened channel (called with readAheadMutex held, after
+    // _clearReadAhead).
+    void _channelChanged();
+    // Change channel (called with readAheadMutex held).
+    void _setChannel(int channel);
+    // Open the channel asked for by tune() (in the read-ahead task).
+    void _tuneChannel();
+    bool _isScanning() {return mState == VideoPlayerState::FAST_FORWARD || mState == VideoPlayerState::REWIND;}
+    // Hand a video chunk to the frame player task, to be shown when the audio clock reaches `presentationTime`
+    // (audio task only - it's the frame queue's one producer).
+    void _setFrameReady(const uint8_t *data, size_t length, const FrameInfo &info);
+    // Configure audio rate, frame position and buffers from the headers of the current channel.
+    void _configureForChannel(const AVIHeaderInfo &info, size_t maxChunkSize);
+    // The biggest video chunk in the current channel (from its index, or its headers if it has none).
+    size_t _getMaxChunkSize(AVIParser *parser);
 
     friend int _doDraw(JPEGDRAW *pDraw);
 
   public:
     VideoPlayer(ChannelData *channelData, Display &display, AudioOutput *audioOutput);
     void drawChannel(int channelIndex);
+    // Change channel right away (on the caller's thread).
     void setChannel(int channelIndex);
+    // Change channel, showing static for as long as opening it takes and then playing it.
+    void tune(int channelIndex);
+    bool isTuning() {return mState == VideoPlayerState::TUNING;}
+    // Carry on with the channel that was playing before deep sleep. Returns false if there isn't one.
+    bool resumeChannel();
     void start();
     void play();
     void _setPlayingFinished();
@@ -110,4 +302,12 @@ class VideoPlayer {
     void stop();
     void pause();
     void playStatic();
+    // Fast forward (speed > 0) or rewind (speed < 0) at `speed` times normal speed, using the index to
+    // read only the frames that get shown. A speed of 0 goes back to normal playback.
+    void scan(int speed);
+    // Step through the fast forward speeds (then back to normal playback).
+    void fastForward();
+    // Step through the rewind speeds (then back to normal playback).
+    void rewind();
+    ReadAheadStats getReadAheadStats();
 };
\ No newline at end of file
@@ -5,5 +5,10 @@ enum class VideoPlayerState {
   PLAYING,
   PLAYING_FINISHED,
   PAUSED,
-  STATIC
+  STATIC,
+  // showing static while the channel opens
+  TUNING,
+  // showing every Nth frame (without audio)
+  FAST_FORWARD,
+  REWIND
 };
\ No newline at end of file
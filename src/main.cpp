@@ -10,6 +10,7 @@
 #include "ChannelData/SDCardChannelData.h"
 #include "AVIParser/AVIParser.h"
 #include "SDCard.h"
+#include "SDCardBenchmark.h"
 #include "Button.h"
 #include <Wire.h>
 
@@ -27,10 +28,16 @@ TFT display;
 void randomChannel(bool drawChannel);
 int channel = 99999;
 
+// The audio rate when we went to sleep, so waking up starts the output at the right rate.
+RTC_DATA_ATTR uint32_t sleepAudioRate = 0;
+
 
 void setupTv()
 {
   Serial.begin(115200);
+  // waking from deep sleep goes straight back to the channel that was playing
+  bool waking = esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED;
+  uint32_t startAudioRate = waking && sleepAudioRate ? sleepAudioRate : AUDIO_RATE;
 
   Serial.printf("CPU freq: %dmhz\n", ESP.getCpuFreqMHz());
   Serial.printf("Total heap: %d\n", ESP.getHeapSize());
@@ -62,6 +69,9 @@ void setupTv()
       delay(1000);
     }
   }
+  #ifdef SD_CARD_BENCHMARK
+  runSDCardBenchmark(card, "/");
+  #endif
   channelData = new ChannelData(card, "/", "/bumpers");
   // audioSource = new SDCardAudioSource((ChannelData *) channelData);
   // videoSource = new SDCardVideoSource((ChannelData *) channelData);
@@ -69,7 +79,7 @@ void setupTv()
 
   #ifdef USE_DAC_AUDIO
   audioOutput = new DACOutput(I2S_NUM_0);
-  audioOutput->start(AUDIO_RATE);
+  audioOutput->start(startAudioRate);
   #endif
   #ifdef PDM_GPIO_NUM
   i2s speaker pins
@@ -79,11 +89,11 @@ void setupTv()
       .data_out_num = PDM_GPIO_NUM,
       .data_in_num = I2S_PIN_NO_CHANGE};
   audioOutput = new PDMOutput(I2S_NUM_0, i2s_speaker_pins);
-  audioOutput->start(AUDIO_RATE);
+  audioOutput->start(startAudioRate);
   #endif
   #ifdef PWM_GPIO_NUM
   audioOutput = new PWMTimerOutput(PWM_GPIO_NUM);
-  audioOutput->start(AUDIO_RATE);
+  audioOutput->start(startAudioRate);
   #endif
   #ifdef I2S_SPEAKER_SERIAL_CLOCK
   #ifdef SPK_MODE
@@ -98,7 +108,7 @@ void setupTv()
       .data_in_num = I2S_PIN_NO_CHANGE};
 
   audioOutput = new I2SOutput(I2S_NUM_1, i2s_speaker_pins);
-  audioOutput->start(AUDIO_RATE);
+  audioOutput->start(startAudioRate);
   #endif
   videoPlayer = new VideoPlayer(
     channelData,
@@ -109,18 +119,31 @@ void setupTv()
   );
   videoPlayer->start();
 
-  // display.drawTuningText();
-  // get the channel info
-  while(!channelData->fetchChannelData()) {
-    Serial.println("Failed to fetch channel data");
-    delay(1000);
+  if (waking && videoPlayer->resumeChannel())
+  {
+    // skip the static, but load the catalog before playing, so the read-ahead has the channel counts
+    // when it picks the next channel (loading a catalog that's up to date doesn't list any folders)
+    channel = channelData->getChannelNumber();
+    while(!channelData->fetchChannelData()) {
+      Serial.println("Failed to fetch channel data");
+      delay(1000);
+    }
+    videoPlayer->play();
+    audioOutput->setVolume(currentVolume);
   }
+  else
+  {
+    // display.drawTuningText();
+    // get the channel info
+    while(!channelData->fetchChannelData()) {
+      Serial.println("Failed to fetch channel data");
+      delay(1000);
+    }
 
-  videoPlayer->playStatic();
-  delay(1000);
-
-  randomChannel(true);
-  audioOutput->setVolume(currentVolume);
+    // (static shows while the channel opens)
+    randomChannel(true);
+    audioOutput->setVolume(currentVolume);
+  }
 
   #ifdef AUDIO_ENABLE_PIN
   // Enable audio (if required)
@@ -178,23 +201,17 @@ void volumeDown() {
 }
 
 void channelDown() {
-  videoPlayer->playStatic();
-  delay(500);
   channel--;
   if (channel < 0) {
     channel = channelData->getChannelCount() - 1;
   }
-  videoPlayer->setChannel(channel);
-  videoPlayer->play();
+  videoPlayer->tune(channel);
   Serial.printf("CHANNEL_DOWN %d\n", channel);
 }
 
 void channelUp() {
-  videoPlayer->playStatic();
-  delay(500);
   channel = (channel + 1) % channelData->getChannelCount();
-  videoPlayer->setChannel(channel);
-  videoPlayer->play();
+  videoPlayer->tune(channel);
   Serial.printf("CHANNEL_UP %d\n", channel);
 }
 
@@ -212,8 +229,7 @@ void randomChannel(bool drawChannel) {
     }
   }
 
-  videoPlayer->setChannel(channel);
-  videoPlayer->play();
+  videoPlayer->tune(channel);
   Serial.printf("randomChannel: %d\n", channel);
 }
 
@@ -236,7 +252,10 @@ int moveToward(int current, int target, int step)
 // Put the device into deep sleep
 void softPowerOff(){
   videoPlayer->stop();
-  channelData->getVideoParser()->storePosition();
+  if (channelData->getVideoParser()) {
+    channelData->getVideoParser()->storePosition();
+  }
+  sleepAudioRate = audioOutput->getSampleRate();
 
   // animate crt power off
   display.fillScreen(65535);
@@ -278,14 +297,23 @@ void loop()
   }
   #endif
 
-  if (changeChannelPressed || videoPlayer->isFinished()){
+  // (holding the button flicks through channels as fast as they open)
+  if ((changeChannelPressed && !videoPlayer->isTuning()) || videoPlayer->isFinished()){
     Serial.println("Setting random channel.");
-    videoPlayer->stop();
-    delay(100);
     randomChannel(changeChannelPressed);
-    videoPlayer->play();
   }
 
+  // each press steps up through the fast forward/rewind speeds, then back to playing
+  static bool fastForwardWasPressed = false, rewindWasPressed = false;
+  if (fastForwardPressed && !fastForwardWasPressed) {
+    videoPlayer->fastForward();
+  }
+  if (rewindPressed && !rewindWasPressed) {
+    videoPlayer->rewind();
+  }
+  fastForwardWasPressed = fastForwardPressed;
+  rewindWasPressed = rewindPressed;
+
   #ifdef VOLUME_POT_PIN
   if (currentVolume != audioOutput->getVolume()){
     // Set volume, but with a limited step size (reduces popping as volume changes)
@@ -0,0 +1,96 @@
+// Parsing throughput benchmark for AVIParser.
+//
+//   avi_parser_bench [size in MB] [path]
+//
+// Writes a sparse synthetic OpenDML AVI of the given size (4GB by default), then times
+// reading every chunk the way the read-ahead task does, and seeking through the index.
+#include <Arduino.h>
+#include <unistd.h>
+#include "AVIParser/AVIParser.h"
+#include "SyntheticAVI.h"
+
+HostSerial Serial;
+
+static double seconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t sizeMB = argc > 1 ? atoll(argv[1]) : 4096;
+  std::string path = argc > 2 ? argv[2] : "avi_parser_bench.avi";
+
+  SyntheticAVIOptions options;
+  options.videoChunkSize = 12000;
+  options.audioChunkSize = 1000;
+  options.frames = sizeMB * 1024 * 1024 / (options.videoChunkSize + options.audioChunkSize + 16);
+  // ~1GB RIFF segments, like the OpenDML muxers write
+  options.framesPerSegment = 1024 * 1024 * 1024 / (options.videoChunkSize + options.audioChunkSize + 16);
+  options.sparse = true;
+
+  FILE *file = fopen(path.c_str(), "wb");
+  if (!file || !SyntheticAVIWriter(file, options).write())
+  {
+    fprintf(stderr, "Failed to write %s\n", path.c_str());
+    return 1;
+  }
+  off_t fileSize = ftello(file);
+  fclose(file);
+  printf("Wrote %s: %.1f MB, %u frames\n", path.c_str(), fileSize / 1048576.0, options.frames);
+
+  Serial.enabled = false;
+  double start = seconds();
+  AVIParser parser(path, AVIChunkType::VIDEO);
+  if (!parser.open())
+  {
+    fprintf(stderr, "Failed to open %s\n", path.c_str());
+    return 1;
+  }
+  double openTime = seconds() - start;
+
+  // every chunk, through the zero-copy path
+  start = seconds();
+  uint64_t headers = 0;
+  uint64_t bytes = 0;
+  while (true)
+  {
+    ChunkHeader header = parser.getNextHeader();
+    if (header.chunkType == EMPTY_CHUNK) {
+      break;
+    }
+    ChunkView view = parser.getNextChunkView(header);
+    headers++;
+    bytes += view.length;
+  }
+  double readTime = seconds() - start;
+
+  // random seeks through the index
+  start = seconds();
+  uint32_t frameCount = parser.getVideoFrameCount();
+  uint32_t seeks = 0;
+  for (uint32_t i = 0; frameCount && i < 10000; i++)
+  {
+    uint32_t frame = (i * 2654435761u) % frameCount;
+    if (parser.seekToFrame(frame)) {
+      parser.getNextHeader();
+      seeks++;
+    }
+  }
+  double seekTime = seconds() - start;
+
+  // every frame and audio chunk, plus the ix00 index at the end of each segment
+  uint64_t expectedHeaders = 2 * (uint64_t)options.frames + (options.frames + options.framesPerSegment - 1) / options.framesPerSegment;
+  bool ok = headers == expectedHeaders && seeks == 10000;
+  printf("open:  %.2f ms\n", openTime * 1000);
+  printf("read:  %llu headers in %.2f s (%.0f headers/s, %.0f MB/s)\n", (unsigned long long)headers, readTime,
+         headers / readTime, bytes / 1048576.0 / readTime);
+  printf("seek:  %u seeks in %.2f s (%.0f seeks/s)\n", seeks, seekTime, seeks / seekTime);
+  if (!ok) {
+    fprintf(stderr, "Expected %llu headers and 10000 seeks\n", (unsigned long long)expectedHeaders);
+  }
+  unlink(path.c_str());
+  return ok ? 0 : 1;
+}
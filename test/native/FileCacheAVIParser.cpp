@@ -0,0 +1,107 @@
+// Checks that files read into the file cache play from memory, and that the least recently used files
+// make way for new ones without pulling the memory out from under a file that's still playing.
+#include <Arduino.h>
+#include <sys/stat.h>
+#include "AVIParser/AVIParser.h"
+#include "FileCache/FileCache.h"
+#include "SyntheticAVI.h"
+
+HostSerial Serial;
+
+// A checksum of every video frame the parser returns.
+static std::vector<uint32_t> readFrames(AVIParser &parser, size_t count = SIZE_MAX)
+{
+  std::vector<uint32_t> frames;
+  while (frames.size() < count)
+  {
+    ChunkHeader header = parser.getNextHeader();
+    if (header.chunkType == EMPTY_CHUNK) {
+      break;
+    }
+    ChunkView view = parser.getNextChunkView(header);
+    if (header.chunkType == VIDEO_CHUNK && view.data)
+    {
+      uint32_t hash = 2166136261u;
+      for (size_t i = 0; i < view.length; i++) {
+        hash = (hash ^ view.data[i]) * 16777619u;
+      }
+      frames.push_back(hash);
+    }
+  }
+  return frames;
+}
+
+static std::vector<uint32_t> readFile(const std::string &fileName)
+{
+  AVIParser parser(fileName, AVIChunkType::VIDEO);
+  return parser.open() ? readFrames(parser) : std::vector<uint32_t>();
+}
+
+static void fillAll(FileCache &cache)
+{
+  while (cache.fill()) {}
+}
+
+int main()
+{
+  Serial.enabled = false;
+  const char *fileNames[3] = {"file_cache_0.avi", "file_cache_1.avi", "file_cache_2.avi"};
+  std::vector<uint32_t> frames[3];
+  size_t lengths[3];
+  for (int i = 0; i < 3; i++)
+  {
+    SyntheticAVIOptions options;
+    options.frames = 60 + i * 10;
+    options.videoChunkSize = 2001 + i * 500;
+    FILE *file = fopen(fileNames[i], "wb");
+    if (!file || !SyntheticAVIWriter(file, options).write() || fclose(file) != 0) {
+      return 1;
+    }
+    struct stat fileStat;
+    stat(fileNames[i], &fileStat);
+    lengths[i] = fileStat.st_size;
+    frames[i] = readFile(fileNames[i]);
+  }
+
+  // room for the two biggest files, but not all three
+  FileCache cache(lengths[1] + lengths[2]);
+  FileCache::setShared(&cache);
+  cache.request(fileNames[0], lengths[0]);
+  cache.request(fileNames[1], lengths[1]);
+  fillAll(cache);
+  bool ok = cache.isCached(fileNames[0]) && cache.isCached(fileNames[1]);
+
+  // a cached file plays from memory (even once it's gone from the disk)
+  rename(fileNames[0], "file_cache_moved.avi");
+  ok = ok && readFile(fileNames[0]) == frames[0];
+  rename("file_cache_moved.avi", fileNames[0]);
+  fprintf(stderr, "Played from the cache: %s\n", ok ? "OK" : "FAILED");
+
+  // file 0 is played again while file 1 is half played, so file 1 is the least recently used,
+  // and makes way for file 2 (while it's still playing)
+  {
+    AVIParser playing(fileNames[1], AVIChunkType::VIDEO);
+    std::vector<uint32_t> played = playing.open() ? readFrames(playing, 20) : std::vector<uint32_t>();
+    ok = ok && readFile(fileNames[0]) == frames[0];
+    cache.request(fileNames[2], lengths[2]);
+    fillAll(cache);
+    bool dropped = cache.isCached(fileNames[0]) && !cache.isCached(fileNames[1]) && cache.isCached(fileNames[2]);
+    std::vector<uint32_t> rest = readFrames(playing);
+    played.insert(played.end(), rest.begin(), rest.end());
+    ok = ok && dropped && played == frames[1] && cache.getCachedBytes() <= lengths[1] + lengths[2];
+    fprintf(stderr, "Least recently used file dropped: %s, and carried on playing: %s\n", dropped ? "OK" : "FAILED",
+            played == frames[1] ? "OK" : "FAILED");
+  }
+
+  // a file that's changed size since it was catalogued is read in again
+  cache.request(fileNames[2], lengths[2] + 1);
+  fillAll(cache);
+  ok = ok && !cache.isCached(fileNames[2]);
+  fprintf(stderr, "Changed file dropped: %s\n", !cache.isCached(fileNames[2]) ? "OK" : "FAILED");
+
+  FileCache::setShared(NULL);
+  for (int i = 0; i < 3; i++) {
+    remove(fileNames[i]);
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+// Checks the frame queue hands frames from one thread to another intact and in order, without a lock,
+// dropping frames only when it's full, while a third thread reserves bigger slots.
+// (built with ThreadSanitizer, which checks the handover)
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
+#include "FrameQueue/FrameQueue.h"
+
+#define FRAME_COUNT 20000
+
+// Frame `number`, with its number in the first 4 bytes and the rest filled from it.
+static size_t makeFrame(uint32_t number, uint8_t *frame)
+{
+  size_t length = 4 + number % 3000;
+  memcpy(frame, &number, 4);
+  for (size_t i = 4; i < length; i++) {
+    frame[i] = (uint8_t)(number + i);
+  }
+  return length;
+}
+
+static bool checkFrame(const uint8_t *frame, size_t length, uint32_t *number)
+{
+  memcpy(number, frame, 4);
+  if (length != 4 + *number % 3000) {
+    return false;
+  }
+  for (size_t i = 4; i < length; i++)
+  {
+    if (frame[i] != (uint8_t)(*number + i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main()
+{
+  // the depth absorbs a spike, and only the frame after that is dropped
+  bool ok = true;
+  {
+    uint8_t frame[4000];
+    FrameQueue queue(3);
+    for (uint32_t i = 0; i < 4; i++) {
+      ok = queue.push(frame, makeFrame(i, frame), {i, 1, 8, 16}) == (i < 3) && ok;
+    }
+    const uint8_t *data;
+    size_t length;
+    uint32_t number;
+    FrameInfo info;
+    ok = ok && queue.getDepth() == 3 && queue.getDroppedFrames() == 1 && queue.peek(&data, &length, &info)
+      && checkFrame(data, length, &number) && number == 0 && info.presentationTime == 0 && info.generation == 1
+      && info.x == 8 && info.y == 16;
+    // the slots handed back are grown to the reserved size
+    queue.reserve(5000);
+    for (int i = 0; i < 3; i++) {
+      queue.pop();
+    }
+    ok = ok && queue.isEmpty() && !queue.peek(&data, &length, &info)
+      && queue.getReservedLength() == 5000;
+    fprintf(stderr, "Absorbs a spike, then drops: %s\n", ok ? "OK" : "FAILED");
+  }
+
+  // one thread pushing, another decoding (slowly, now and then), and another reserving as channels change
+  FrameQueue queue(4);
+  queue.reserve(1000);
+  std::thread reserver([&queue]() {
+    for (size_t length = 1000; length <= 3000; length += 100)
+    {
+      queue.reserve(length);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  std::thread producer([&queue]() {
+    static uint8_t frame[4000];
+    for (uint32_t i = 0; i < FRAME_COUNT; i++)
+    {
+      queue.push(frame, makeFrame(i, frame), {i, 0, 0, 0});
+      if (i % 16 == 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }
+  });
+  uint32_t received = 0;
+  uint32_t lastNumber = 0;
+  bool inOrder = true;
+  auto start = std::chrono::steady_clock::now();
+  while (received + queue.getDroppedFrames() < FRAME_COUNT && std::chrono::steady_clock::now() - start < std::chrono::seconds(20))
+  {
+    const uint8_t *data;
+    size_t length;
+    FrameInfo info;
+    if (!queue.peek(&data, &length, &info)) {
+      continue;
+    }
+    uint32_t number;
+    inOrder = checkFrame(data, length, &number) && number == info.presentationTime && (received == 0 || number > lastNumber) && inOrder;
+    lastNumber = number;
+    received++;
+    if (received % 100 == 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    queue.pop();
+  }
+  producer.join();
+  reserver.join();
+  bool allAccountedFor = received + queue.getDroppedFrames() == FRAME_COUNT && queue.getMaxDepth() <= 4;
+  fprintf(stderr, "%u frames received intact and in order, %u dropped, at most %u queued: %s\n", received,
+          queue.getDroppedFrames(), queue.getMaxDepth(), inOrder && allAccountedFor ? "OK" : "FAILED");
+  return ok && inOrder && allAccountedFor ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+// Fuzz target for AVIParser: opens the input as an AVI file, then reads and seeks through it
+// (and reads through it again as a forward-only stream).
+// Built with libFuzzer when the compiler supports it, otherwise with the driver in FuzzMain.cpp.
+#include <Arduino.h>
+#include "AVIParser/AVIParser.h"
+
+HostSerial Serial;
+
+// Stop runaway inputs (like a movi list of empty chunks) from timing out the fuzzer.
+#define MAX_CHUNKS 10000
+
+// Memory, read forwards only (like a pipe or serial link).
+class ForwardMemorySource : public ForwardByteSource
+{
+private:
+  const uint8_t *mData;
+  size_t mLength;
+  size_t mOffset = 0;
+
+protected:
+  size_t _readSome(uint8_t *buffer, size_t length)
+  {
+    // hand the data out in small pieces, like a serial link would
+    length = min(min(length, mLength - mOffset), (size_t)700);
+    memcpy(buffer, mData + mOffset, length);
+    mOffset += length;
+    return length;
+  }
+
+public:
+  ForwardMemorySource(const uint8_t *data, size_t length) : mData(data), mLength(length) {}
+};
+
+static void readChunks(AVIParser &parser, int maxChunks)
+{
+  for (int i = 0; i < maxChunks; i++)
+  {
+    ChunkHeader header = parser.getNextHeader();
+    if (header.chunkType == EMPTY_CHUNK) {
+      break;
+    }
+    if (i % 2)
+    {
+      ChunkView view = parser.getNextChunkView(header);
+      // touch the whole view so ASan sees any read past the buffer
+      volatile uint8_t sum = 0;
+      for (size_t j = 0; view.data && j < view.length; j++) {sum += view.data[j];}
+    }
+    else
+    {
+      uint8_t *buffer = NULL;
+      size_t bufferLength = 0;
+      parser.getNextChunk(header, &buffer, bufferLength, header.chunkType == OTHER_CHUNK);
+      free(buffer);
+    }
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  Serial.enabled = false;
+  // streaming
+  {
+    AVIParser parser(new ForwardMemorySource(data, size), AVIChunkType::VIDEO);
+    if (parser.open()) {
+      readChunks(parser, MAX_CHUNKS);
+      parser.seekToFrame(1);
+    }
+  }
+
+  AVIParser parser(new MemoryByteSource(data, size), AVIChunkType::VIDEO);
+  if (!parser.open()) {
+    return 0;
+  }
+  parser.getHeaderInfo();
+  parser.getDurationMs();
+  readChunks(parser, MAX_CHUNKS);
+
+  // random access, using the last bytes of the input to pick where to go
+  uint32_t target = size >= 4 ? data[size - 1] | (data[size - 2] << 8) | (data[size - 3] << 16) : 0;
+  uint32_t frameCount = parser.getVideoFrameCount();
+  uint32_t byteCount = parser.getAudioByteCount();
+  if (parser.seekToFrame(frameCount ? target % frameCount : target)) {
+    readChunks(parser, 16);
+  }
+  parser.seekToFrame(frameCount);
+  uint32_t chunkStartByte = 0;
+  if (parser.seekToAudioByte(byteCount ? target % byteCount : target, &chunkStartByte)) {
+    readChunks(parser, 16);
+  }
+  parser.seekToAudioByte(byteCount, &chunkStartByte);
+  parser.storePosition();
+  return 0;
+}
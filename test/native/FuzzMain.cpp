@@ -0,0 +1,138 @@
+// Standalone driver for the AVIParser fuzz target, for compilers without libFuzzer.
+//
+//   avi_parser_fuzz [iterations] [seed]   mutate synthetic AVI files
+//   avi_parser_fuzz file...              replay inputs (e.g. crashes found by libFuzzer/AFL)
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <random>
+#include <vector>
+#include "SyntheticAVI.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static std::vector<uint8_t> readFile(const char *path)
+{
+  std::vector<uint8_t> data;
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return data;
+  }
+  uint8_t buffer[4096];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    data.insert(data.end(), buffer, buffer + length);
+  }
+  fclose(file);
+  return data;
+}
+
+static std::vector<uint8_t> makeSeed(const SyntheticAVIOptions &options)
+{
+  FILE *file = tmpfile();
+  SyntheticAVIWriter(file, options).write();
+  rewind(file);
+  std::vector<uint8_t> data;
+  uint8_t buffer[4096];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    data.insert(data.end(), buffer, buffer + length);
+  }
+  fclose(file);
+  return data;
+}
+
+static void mutate(std::vector<uint8_t> &data, std::mt19937 &random)
+{
+  int mutations = 1 + random() % 8;
+  for (int i = 0; i < mutations && !data.empty(); i++)
+  {
+    size_t position = random() % data.size();
+    switch (random() % 6)
+    {
+    case 0:
+      // flip a bit
+      data[position] ^= 1 << (random() % 8);
+      break;
+    case 1:
+      // random byte
+      data[position] = random();
+      break;
+    case 2:
+      // interesting 32 bit value (mostly hits chunk sizes and offsets)
+      if (position + 4 <= data.size())
+      {
+        static const uint32_t values[] = {0, 1, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF, 0xFFFFFFFE, 0x10000, 8};
+        uint32_t value = values[random() % 8];
+        memcpy(&data[position], &value, 4);
+      }
+      break;
+    case 3:
+      // truncate
+      data.resize(position);
+      break;
+    case 4:
+      // duplicate a block
+      if (position + 16 <= data.size())
+      {
+        size_t length = 1 + random() % std::min((size_t)512, data.size() - position);
+        std::vector<uint8_t> block(data.begin() + position, data.begin() + position + length);
+        data.insert(data.begin() + random() % data.size(), block.begin(), block.end());
+      }
+      break;
+    case 5:
+      // delete a block
+      data.erase(data.begin() + position, data.begin() + std::min(data.size(), position + 1 + random() % 64));
+      break;
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && !isdigit(argv[1][0]))
+  {
+    for (int i = 1; i < argc; i++)
+    {
+      std::vector<uint8_t> data = readFile(argv[i]);
+      printf("Running %s (%zu bytes)\n", argv[i], data.size());
+      LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    return 0;
+  }
+
+  int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+  unsigned seed = argc > 2 ? atoi(argv[2]) : 1;
+  std::mt19937 random(seed);
+
+  std::vector<std::vector<uint8_t>> seeds;
+  SyntheticAVIOptions options;
+  options.frames = 24;
+  options.videoChunkSize = 301;
+  options.audioChunkSize = 200;
+  seeds.push_back(makeSeed(options));
+  options.framesPerSegment = 7;
+  seeds.push_back(makeSeed(options));
+  options.framesPerSegment = 0;
+  options.recGroups = true;
+  seeds.push_back(makeSeed(options));
+  options.recGroups = false;
+  // (far enough apart to be read with independent cursors)
+  options.audioRun = 20;
+  options.videoChunkSize = 3001;
+  seeds.push_back(makeSeed(options));
+
+  // the unmodified seeds must parse
+  for (std::vector<uint8_t> &data : seeds) {
+    LLVMFuzzerTestOneInput(data.data(), data.size());
+  }
+  for (int i = 0; i < iterations; i++)
+  {
+    std::vector<uint8_t> data = seeds[i % seeds.size()];
+    mutate(data, random);
+    LLVMFuzzerTestOneInput(data.data(), data.size());
+  }
+  printf("Ran %d mutated inputs (seed %u) without crashing.\n", iterations, seed);
+  return 0;
+}
@@ -0,0 +1,135 @@
+// Checks that poorly interleaved files are read with separate audio and video cursors,
+// and come out of the parser in time order.
+#include <Arduino.h>
+#include "AVIParser/AVIParser.h"
+#include "SyntheticAVI.h"
+
+HostSerial Serial;
+
+#define TEST_FILE "avi_parser_interleave.avi"
+
+static bool writeAVI(const SyntheticAVIOptions &options)
+{
+  FILE *file = fopen(TEST_FILE, "wb");
+  return file && SyntheticAVIWriter(file, options).write() && fclose(file) == 0;
+}
+
+// Read every chunk, checking each frame comes after its audio and before the next audio chunk.
+static bool readInOrder(AVIParser &parser, uint32_t firstFrame, uint32_t frames)
+{
+  uint32_t nextFrame = firstFrame;
+  uint32_t nextAudio = firstFrame;
+  while (true)
+  {
+    ChunkHeader header = parser.getNextHeader();
+    if (header.chunkType == EMPTY_CHUNK) {
+      break;
+    }
+    ChunkView view = parser.getNextChunkView(header);
+    if (header.chunkType == VIDEO_CHUNK)
+    {
+      // (empty frames have no data to check)
+      if (nextAudio != nextFrame || (view.length > 2 && view.data[view.length - 1] != (uint8_t)nextFrame))
+      {
+        fprintf(stderr, "Frame %u came out of order (next audio chunk %u)\n", nextFrame, nextAudio);
+        return false;
+      }
+      nextFrame++;
+    }
+    else if (header.chunkType == AUDIO_CHUNK)
+    {
+      if (nextAudio + 1 != nextFrame || view.data[view.length - 1] != (uint8_t)nextAudio)
+      {
+        fprintf(stderr, "Audio chunk %u came out of order (next frame %u)\n", nextAudio, nextFrame);
+        return false;
+      }
+      nextAudio++;
+    }
+  }
+  if (nextFrame != frames || nextAudio != frames)
+  {
+    fprintf(stderr, "Read %u frames and %u audio chunks, expected %u\n", nextFrame, nextAudio, frames);
+    return false;
+  }
+  return true;
+}
+
+// Jump to frames out of order (like fast forward and rewind do), checking each one's chunk is read.
+static bool readFrameChunks(AVIParser &parser, uint32_t frames)
+{
+  for (uint32_t frame = 0; frame < frames; frame += 37)
+  {
+    // (backwards as well as forwards)
+    uint32_t target = (frame / 37) % 2 ? frames - 1 - frame : frame;
+    ChunkHeader header = parser.seekToFrameChunk(target);
+    ChunkView view = parser.getNextChunkView(header);
+    // empty frames go back to the last frame with image data
+    uint32_t shown = parser.getNextFrame() - 1;
+    if (header.chunkType != VIDEO_CHUNK || !view.data || shown > target || view.data[view.length - 1] != (uint8_t)shown)
+    {
+      fprintf(stderr, "Failed to read the chunk for frame %u\n", target);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Seek by time (as live TV mode does), and check playback carries on from the right frame.
+static bool seekToTime(AVIParser &parser, uint32_t ms, uint32_t frameRate)
+{
+  uint32_t frame = ms * frameRate / 1000;
+  bool ok = parser.seekToTimeMs(ms) && parser.getNextFrame() >= frame && parser.getNextFrame() <= frame + 1;
+  uint32_t nextFrame = parser.getNextFrame();
+  while (ok)
+  {
+    ChunkHeader header = parser.getNextHeader();
+    ChunkView view = parser.getNextChunkView(header);
+    if (header.chunkType == VIDEO_CHUNK) {
+      ok = view.data && view.data[view.length - 1] == (uint8_t)nextFrame;
+      break;
+    }
+    ok = header.chunkType == AUDIO_CHUNK;
+  }
+  if (!ok) {
+    fprintf(stderr, "Seeking to %ums went to frame %u, expected %u\n", ms, nextFrame, frame);
+  }
+  return ok;
+}
+
+int main()
+{
+  Serial.enabled = false;
+  SyntheticAVIOptions options;
+  options.frames = 400;
+  options.videoChunkSize = 3001;
+  options.audioChunkSize = 1000;
+  bool ok = true;
+
+  // well interleaved files are read in order
+  writeAVI(options);
+  {
+    AVIParser parser(TEST_FILE, AVIChunkType::VIDEO);
+    ok = parser.open() && !parser.hasIndependentCursors() && readInOrder(parser, 0, options.frames) && ok;
+    ok = readFrameChunks(parser, options.frames) && ok;
+    ok = seekToTime(parser, 12345, options.frameRate) && ok;
+  }
+
+  // long runs of audio after the video
+  options.audioRun = 100;
+  writeAVI(options);
+  {
+    AVIParser parser(TEST_FILE, AVIChunkType::VIDEO);
+    bool opened = parser.open() && parser.hasIndependentCursors();
+    ok = opened && readInOrder(parser, 0, options.frames) && ok;
+    ok = opened && readFrameChunks(parser, options.frames) && ok;
+    ok = opened && seekToTime(parser, 12345, options.frameRate) && ok;
+    // frame 203 is the first to show at its audio's start
+    ok = opened && parser.seekToFrame(203) && readInOrder(parser, 203, options.frames) && ok;
+    uint32_t chunkStartByte = 0;
+    ok = opened && parser.seekToAudioByte(150 * options.audioChunkSize + 10, &chunkStartByte)
+      && chunkStartByte == 150 * options.audioChunkSize && readInOrder(parser, 150, options.frames) && ok;
+  }
+  remove(TEST_FILE);
+  fprintf(stderr, ok ? "Interleaving OK\n" : "Interleaving FAILED\n");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,396 @@
+// Checks that files stored in one piece on a FAT16/FAT32 image are found and read as raw sectors,
+// that fragmented files aren't, and that the AVI parser gets the same frames either way.
+#include <Arduino.h>
+#include <map>
+#include <random>
+#include "AVIParser/AVIParser.h"
+#include "BlockDevice/FatVolume.h"
+#include "SyntheticAVI.h"
+
+HostSerial Serial;
+
+#define TEST_AVI "avi_parser_raw_sectors.avi"
+#define TEST_IMAGE "avi_parser_raw_sectors.img"
+#define SECTOR_SIZE 512
+
+typedef struct
+{
+  const char *description;
+  bool fat32;
+  uint32_t sectorsPerCluster;
+  uint32_t totalSectors;
+  // Where the volume starts (0 for a card with no partition table).
+  uint32_t partitionStart;
+  uint8_t partitionType;
+} ImageOptions;
+
+// Writes a FAT image, with files laid out in chosen clusters.
+class FatImageWriter
+{
+private:
+  const ImageOptions &mOptions;
+  uint32_t mReservedSectors;
+  uint32_t mRootEntries;
+  uint32_t mFatSectors = 0;
+  uint32_t mDataStart;
+  uint32_t mClusterCount = 0;
+  uint32_t mNextFreeCluster = 2;
+  std::vector<uint32_t> mFat;
+  std::map<uint32_t, std::vector<uint8_t>> mClusterData;
+  // Directory entries, by the directory's first cluster (0 for the FAT16 root directory).
+  std::map<uint32_t, std::vector<uint8_t>> mDirectories;
+  std::map<uint32_t, std::vector<uint32_t>> mDirectoryClusters;
+  // FAT32's root directory is a cluster chain like any other.
+  uint32_t mRootCluster = 0;
+  int mShortNames = 0;
+
+  uint32_t _endOfChain() { return mOptions.fat32 ? 0x0FFFFFFF : 0xFFFF; }
+
+  void _addEntry(uint32_t directory, const std::string &name, uint8_t attributes, uint32_t firstCluster, uint32_t size)
+  {
+    std::vector<uint8_t> &entries = mDirectories[directory];
+    uint8_t shortName[11];
+    snprintf((char *)shortName, sizeof(shortName), "F%06d~1", ++mShortNames);
+    memcpy(shortName + 8, "AVI", 3);
+    uint8_t checksum = 0;
+    for (int i = 0; i < 11; i++) {
+      checksum = ((checksum & 1) << 7) + (checksum >> 1) + shortName[i];
+    }
+    // the long name (as UCS-2, from two byte UTF-8 at most), last part first
+    std::vector<uint16_t> characters;
+    for (size_t i = 0; i < name.length(); i++)
+    {
+      uint8_t c = name[i];
+      characters.push_back(c < 0x80 ? c : ((c & 0x1F) << 6) | (name[++i] & 0x3F));
+    }
+    int parts = (characters.size() + 12) / 13;
+    characters.push_back(0);
+    characters.resize(parts * 13, 0xFFFF);
+    static const int characterOffsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+    for (int part = parts; part >= 1; part--)
+    {
+      uint8_t entry[32] = {0};
+      entry[0] = part | (part == parts ? 0x40 : 0);
+      entry[11] = 0x0F;
+      entry[13] = checksum;
+      for (int i = 0; i < 13; i++)
+      {
+        uint16_t character = characters[(part - 1) * 13 + i];
+        entry[characterOffsets[i]] = character & 0xFF;
+        entry[characterOffsets[i] + 1] = character >> 8;
+      }
+      entries.insert(entries.end(), entry, entry + 32);
+    }
+    uint8_t entry[32] = {0};
+    memcpy(entry, shortName, 11);
+    entry[11] = attributes;
+    entry[20] = (firstCluster >> 16) & 0xFF;
+    entry[21] = firstCluster >> 24;
+    entry[26] = firstCluster & 0xFF;
+    entry[27] = (firstCluster >> 8) & 0xFF;
+    memcpy(entry + 28, &size, 4);
+    entries.insert(entries.end(), entry, entry + 32);
+  }
+
+  void _writeSector(FILE *file, uint32_t sector, const uint8_t *data, size_t length = SECTOR_SIZE)
+  {
+    fseeko(file, (off_t)(mOptions.partitionStart + sector) * SECTOR_SIZE, SEEK_SET);
+    fwrite(data, 1, length, file);
+  }
+
+public:
+  FatImageWriter(const ImageOptions &options) : mOptions(options)
+  {
+    mReservedSectors = options.fat32 ? 32 : 4;
+    mRootEntries = options.fat32 ? 0 : 512;
+    uint32_t rootDirSectors = mRootEntries * 32 / SECTOR_SIZE;
+    // (the FAT and the number of clusters it covers depend on each other)
+    for (int i = 0; i < 4; i++)
+    {
+      mClusterCount = (options.totalSectors - mReservedSectors - rootDirSectors - 2 * mFatSectors) / options.sectorsPerCluster;
+      mFatSectors = ((mClusterCount + 2) * (options.fat32 ? 4 : 2) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    }
+    mClusterCount = (options.totalSectors - mReservedSectors - rootDirSectors - 2 * mFatSectors) / options.sectorsPerCluster;
+    mDataStart = mReservedSectors + 2 * mFatSectors + rootDirSectors;
+    mFat.assign(mClusterCount + 2, 0);
+    mFat[0] = options.fat32 ? 0x0FFFFFF8 : 0xFFF8;
+    mFat[1] = _endOfChain();
+    if (options.fat32)
+    {
+      mRootCluster = allocate(1, 0)[0];
+      mDirectoryClusters[mRootCluster] = {mRootCluster};
+    }
+  }
+
+  uint32_t clusterBytes() { return mOptions.sectorsPerCluster * SECTOR_SIZE; }
+
+  // Allocate a chain of clusters, leaving `gap` free clusters after every third one (0 for a file in one piece).
+  std::vector<uint32_t> allocate(uint32_t count, uint32_t gap)
+  {
+    std::vector<uint32_t> clusters;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      if (gap && i > 0 && i % 3 == 0) {
+        mNextFreeCluster += gap;
+      }
+      clusters.push_back(mNextFreeCluster++);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      mFat[clusters[i]] = i + 1 < count ? clusters[i + 1] : _endOfChain();
+    }
+    return clusters;
+  }
+
+  // Add a directory (in `parent`, 0 for the root directory), returning its first cluster.
+  uint32_t addDirectory(uint32_t parent, const std::string &name, uint32_t clusterCount)
+  {
+    std::vector<uint32_t> clusters = allocate(clusterCount, 1);
+    _addEntry(parent ? parent : mRootCluster, name, 0x10, clusters[0], 0);
+    mDirectoryClusters[clusters[0]] = clusters;
+    // "." and ".." (which should be skipped)
+    uint8_t entry[32] = {0};
+    memcpy(entry, ".          ", 11);
+    entry[11] = 0x10;
+    mDirectories[clusters[0]].insert(mDirectories[clusters[0]].end(), entry, entry + 32);
+    memcpy(entry, "..         ", 11);
+    mDirectories[clusters[0]].insert(mDirectories[clusters[0]].end(), entry, entry + 32);
+    return clusters[0];
+  }
+
+  void addFile(uint32_t directory, const std::string &name, const std::vector<uint8_t> &data, uint32_t gap)
+  {
+    std::vector<uint32_t> clusters = allocate((data.size() + clusterBytes() - 1) / clusterBytes(), gap);
+    for (size_t i = 0; i < clusters.size(); i++)
+    {
+      size_t start = i * clusterBytes();
+      size_t end = min(data.size(), start + clusterBytes());
+      mClusterData[clusters[i]].assign(data.begin() + start, data.begin() + end);
+    }
+    _addEntry(directory ? directory : mRootCluster, name, 0x20, clusters[0], data.size());
+  }
+
+  // An empty file (to fill up a directory).
+  void addEmptyFile(uint32_t directory, const std::string &name) { _addEntry(directory, name, 0x20, 0, 0); }
+
+  bool write(const char *fileName)
+  {
+    FILE *file = fopen(fileName, "w+b");
+    if (!file || ftruncate(fileno(file), (off_t)(mOptions.partitionStart + mOptions.totalSectors) * SECTOR_SIZE) != 0) {
+      return false;
+    }
+    // directories go into their clusters (or the FAT16 root directory region)
+    for (auto &directory : mDirectories)
+    {
+      if (directory.first == 0)
+      {
+        if (directory.second.size() > mRootEntries * 32) {
+          return false;
+        }
+        for (size_t offset = 0; offset < directory.second.size(); offset += SECTOR_SIZE) {
+          _writeSector(file, mReservedSectors + 2 * mFatSectors + offset / SECTOR_SIZE, directory.second.data() + offset,
+                       min((size_t)SECTOR_SIZE, directory.second.size() - offset));
+        }
+        continue;
+      }
+      std::vector<uint32_t> &clusters = mDirectoryClusters[directory.first];
+      if (directory.second.size() > clusters.size() * clusterBytes()) {
+        return false;
+      }
+      for (size_t i = 0; i * clusterBytes() < directory.second.size(); i++)
+      {
+        size_t start = i * clusterBytes();
+        size_t end = min(directory.second.size(), start + clusterBytes());
+        mClusterData[clusters[i]].assign(directory.second.begin() + start, directory.second.begin() + end);
+      }
+    }
+    for (auto &cluster : mClusterData)
+    {
+      fseeko(file, (off_t)(mOptions.partitionStart + mDataStart + (cluster.first - 2) * mOptions.sectorsPerCluster) * SECTOR_SIZE, SEEK_SET);
+      fwrite(cluster.second.data(), 1, cluster.second.size(), file);
+    }
+    // both copies of the FAT
+    std::vector<uint8_t> fat(mFatSectors * SECTOR_SIZE, 0);
+    for (size_t i = 0; i < mFat.size(); i++)
+    {
+      if (mOptions.fat32) {
+        memcpy(fat.data() + i * 4, &mFat[i], 4);
+      }
+      else {
+        uint16_t entry = mFat[i];
+        memcpy(fat.data() + i * 2, &entry, 2);
+      }
+    }
+    for (uint32_t copy = 0; copy < 2; copy++)
+    {
+      fseeko(file, (off_t)(mOptions.partitionStart + mReservedSectors + copy * mFatSectors) * SECTOR_SIZE, SEEK_SET);
+      fwrite(fat.data(), 1, fat.size(), file);
+    }
+    // the boot sector
+    uint8_t boot[SECTOR_SIZE] = {0xEB, (uint8_t)(mOptions.fat32 ? 0x58 : 0x3C), 0x90, 'M', 'S', 'W', 'I', 'N', '4', '.', '1'};
+    uint16_t bytesPerSector = SECTOR_SIZE;
+    memcpy(boot + 11, &bytesPerSector, 2);
+    boot[13] = mOptions.sectorsPerCluster;
+    memcpy(boot + 14, &mReservedSectors, 2);
+    boot[16] = 2;
+    memcpy(boot + 17, &mRootEntries, 2);
+    boot[21] = 0xF8;
+    memcpy(boot + 28, &mOptions.partitionStart, 4);
+    memcpy(boot + 32, &mOptions.totalSectors, 4);
+    if (mOptions.fat32)
+    {
+      memcpy(boot + 36, &mFatSectors, 4);
+      memcpy(boot + 44, &mRootCluster, 4);
+    }
+    else {
+      memcpy(boot + 22, &mFatSectors, 2);
+    }
+    boot[510] = 0x55;
+    boot[511] = 0xAA;
+    _writeSector(file, 0, boot);
+    // and the partition table
+    if (mOptions.partitionStart)
+    {
+      uint8_t mbr[SECTOR_SIZE] = {0};
+      mbr[446 + 4] = mOptions.partitionType;
+      memcpy(mbr + 446 + 8, &mOptions.partitionStart, 4);
+      memcpy(mbr + 446 + 12, &mOptions.totalSectors, 4);
+      mbr[510] = 0x55;
+      mbr[511] = 0xAA;
+      fseeko(file, 0, SEEK_SET);
+      fwrite(mbr, 1, SECTOR_SIZE, file);
+    }
+    return fclose(file) == 0;
+  }
+};
+
+// A checksum of every video frame the parser returns.
+static std::vector<uint32_t> readFrames(AVIParser &parser)
+{
+  std::vector<uint32_t> frames;
+  while (true)
+  {
+    ChunkHeader header = parser.getNextHeader();
+    if (header.chunkType == EMPTY_CHUNK) {
+      break;
+    }
+    ChunkView view = parser.getNextChunkView(header);
+    if (header.chunkType == VIDEO_CHUNK && view.data)
+    {
+      uint32_t hash = 2166136261u;
+      for (size_t i = 0; i < view.length; i++) {
+        hash = (hash ^ view.data[i]) * 16777619u;
+      }
+      frames.push_back(hash);
+    }
+  }
+  return frames;
+}
+
+static bool testImage(const ImageOptions &options, const std::vector<uint8_t> &avi, const std::vector<uint32_t> &expectedFrames)
+{
+  FatImageWriter writer(options);
+  uint32_t folder = writer.addDirectory(0, "Vid\xC3\xA9os", 16);
+  // enough names to spill the folder over a few clusters
+  for (int i = 0; i < 40; i++) {
+    writer.addEmptyFile(folder, "Filler file number " + std::to_string(i) + ".txt");
+  }
+  writer.addFile(folder, "A long file name.avi", avi, 0);
+  writer.addFile(folder, "fragmented.avi", avi, 2);
+  writer.addFile(0, "root.avi", avi, 0);
+  if (!writer.write(TEST_IMAGE)) {
+    fprintf(stderr, "%s: couldn't write the image\n", options.description);
+    return false;
+  }
+
+  FileBlockDevice device(fopen(TEST_IMAGE, "rb"));
+  FatVolume volume(&device);
+  FatExtent extent;
+  bool ok = volume.mount();
+  ok = ok && volume.findContiguousFile("/Vid\xC3\xA9os/A long file name.avi", &extent) && extent.length == (int64_t)avi.size();
+  // (names are matched ignoring case)
+  ok = ok && volume.findContiguousFile("vid\xC3\xA9os/a LONG file name.AVI", &extent);
+  ok = ok && volume.findContiguousFile("/root.avi", &extent);
+  ok = ok && !volume.findContiguousFile("/Vid\xC3\xA9os/fragmented.avi", &extent);
+  ok = ok && !volume.findContiguousFile("/Vid\xC3\xA9os/missing.avi", &extent);
+  ok = ok && !volume.findContiguousFile("/Vid\xC3\xA9os", &extent);
+  if (!ok)
+  {
+    fprintf(stderr, "%s: files weren't found as expected\n", options.description);
+    return false;
+  }
+
+  // random reads match the file
+  volume.findContiguousFile("/Vid\xC3\xA9os/A long file name.avi", &extent);
+  SectorByteSource source(&device, extent.startSector, extent.length);
+  std::mt19937 random(1234);
+  std::vector<uint8_t> buffer;
+  for (int i = 0; i < 500 && ok; i++)
+  {
+    int64_t position = random() % (avi.size() + 100);
+    size_t length = random() % (i % 10 == 0 ? 20000 : 1500);
+    buffer.assign(length, 0);
+    size_t expected = position >= (int64_t)avi.size() ? 0 : min(length, avi.size() - position);
+    ok = source.seek(position) && source.read(buffer.data(), length) == expected
+      && memcmp(buffer.data(), avi.data() + min((size_t)position, avi.size()), expected) == 0;
+  }
+  if (!ok)
+  {
+    fprintf(stderr, "%s: raw reads don't match the file\n", options.description);
+    return false;
+  }
+
+  // the parser reads the file as raw sectors (it isn't anywhere else), and the fragmented one not at all
+  FatVolume::setMounted("/card", &volume);
+  {
+    AVIParser parser("/card/Vid\xC3\xA9os/A long file name.avi", AVIChunkType::VIDEO);
+    ok = parser.open() && readFrames(parser) == expectedFrames;
+  }
+  {
+    AVIParser parser("/card/Vid\xC3\xA9os/fragmented.avi", AVIChunkType::VIDEO);
+    ok = ok && !parser.open();
+  }
+  FatVolume::setMounted(NULL, NULL);
+  fprintf(stderr, "%s: %s\n", options.description, ok ? "OK" : "FAILED");
+  return ok;
+}
+
+int main()
+{
+  Serial.enabled = false;
+  SyntheticAVIOptions aviOptions;
+  aviOptions.frames = 150;
+  aviOptions.videoChunkSize = 3001;
+  aviOptions.audioChunkSize = 1000;
+  FILE *file = fopen(TEST_AVI, "w+b");
+  if (!file || !SyntheticAVIWriter(file, aviOptions).write()) {
+    return 1;
+  }
+  std::vector<uint8_t> avi(ftello(file));
+  fseeko(file, 0, SEEK_SET);
+  if (fread(avi.data(), 1, avi.size(), file) != avi.size()) {
+    return 1;
+  }
+  fclose(file);
+  std::vector<uint32_t> expectedFrames;
+  {
+    AVIParser parser(TEST_AVI, AVIChunkType::VIDEO);
+    if (!parser.open()) {
+      return 1;
+    }
+    expectedFrames = readFrames(parser);
+  }
+
+  static const ImageOptions images[] = {
+    {"FAT16", false, 4, 40000, 0, 0},
+    {"FAT16 partition", false, 4, 40000, 63, 0x06},
+    {"FAT32 partition", true, 1, 72000, 2048, 0x0C},
+    {"FAT32", true, 8, 600000, 0, 0},
+  };
+  bool ok = expectedFrames.size() == aviOptions.frames;
+  for (const ImageOptions &options : images) {
+    ok = testImage(options, avi, expectedFrames) && ok;
+  }
+  remove(TEST_IMAGE);
+  remove(TEST_AVI);
+  return ok ? 0 : 1;
+}
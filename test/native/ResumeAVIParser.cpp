@@ -0,0 +1,117 @@
+// Checks that a file reopened after storePosition (as on waking from deep sleep) skips the header scan
+// and carries on from where it was, even with another file probed (or opened ahead of time) in between.
+#include <Arduino.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include "AVIParser/AVIParser.h"
+#include "SyntheticAVI.h"
+
+HostSerial Serial;
+
+#define TEST_FILE "avi_parser_resume.avi"
+#define PROBE_FILE "avi_parser_probe.avi"
+#define PROBE_INDEX_CACHE "avi_parser_probe.idx"
+
+// Read up to `count` frames, returning the number of the last one (from its last byte).
+static int readFrames(AVIParser &parser, int count)
+{
+  int lastFrame = -1;
+  while (count > 0)
+  {
+    ChunkHeader header = parser.getNextHeader();
+    if (header.chunkType == EMPTY_CHUNK) {
+      break;
+    }
+    ChunkView view = parser.getNextChunkView(header);
+    if (header.chunkType == VIDEO_CHUNK && view.data && view.length > 2)
+    {
+      lastFrame = view.data[view.length - 1];
+      count--;
+    }
+  }
+  return lastFrame;
+}
+
+// Overwrite the start of the file without changing its size or modified time.
+static bool damageRiffHeader(const char *fill)
+{
+  struct stat fileStat;
+  FILE *file = fopen(TEST_FILE, "r+b");
+  if (stat(TEST_FILE, &fileStat) != 0 || !file) {
+    return false;
+  }
+  fwrite(fill, 1, 4, file);
+  fclose(file);
+  struct utimbuf times = {fileStat.st_atime, fileStat.st_mtime};
+  return utime(TEST_FILE, &times) == 0;
+}
+
+int main()
+{
+  Serial.enabled = false;
+  SyntheticAVIOptions options;
+  options.frames = 200;
+  options.videoChunkSize = 3001;
+  options.audioChunkSize = 1000;
+  FILE *file = fopen(TEST_FILE, "wb");
+  if (!file || !SyntheticAVIWriter(file, options).write() || fclose(file) != 0) {
+    return 1;
+  }
+
+  int lastFrame;
+  {
+    AVIParser parser(TEST_FILE, AVIChunkType::VIDEO);
+    lastFrame = parser.open() ? readFrames(parser, 50) : -1;
+    parser.storePosition();
+  }
+  // probing another file (as the catalog does while this one plays) reads its headers and nothing else
+  bool ok = lastFrame > 0;
+  file = fopen(PROBE_FILE, "wb");
+  if (!file || !SyntheticAVIWriter(file, options).write() || fclose(file) != 0) {
+    return 1;
+  }
+  AVIHeaderInfo headerInfo;
+  uint32_t durationMs = 0;
+  bool probed = AVIParser::probe(PROBE_FILE, &headerInfo, &durationMs) && headerInfo.width == 320
+    && durationMs == options.frames * 1000 / options.frameRate;
+  struct stat cacheStat;
+  bool wroteIndex = stat(PROBE_INDEX_CACHE, &cacheStat) == 0;
+  fprintf(stderr, "Probed %s (%ums), %s: %s\n", probed ? "headers" : "nothing", durationMs,
+          wroteIndex ? "wrote an index" : "no index", probed && !wroteIndex ? "OK" : "FAILED");
+  ok = ok && probed && !wroteIndex;
+  // and opening it ahead of time (as the next channel) doesn't use up the stored position either
+  {
+    AVIParser ahead(PROBE_FILE, AVIChunkType::VIDEO);
+    bool openedAhead = ahead.open(false) && readFrames(ahead, 1) >= 0;
+    fprintf(stderr, "Opened the next file ahead of time: %s\n", openedAhead ? "OK" : "FAILED");
+    ok = ok && openedAhead;
+  }
+  remove(PROBE_FILE);
+  remove(PROBE_INDEX_CACHE);
+
+  // the header scan would fail on this, so the file only opens if it's skipped
+  ok = ok && damageRiffHeader("XXXX");
+  {
+    AVIParser parser(TEST_FILE, AVIChunkType::VIDEO);
+    int nextFrame = parser.open() ? readFrames(parser, 1) : -1;
+    // (resuming goes back to the last chunk before the stored position)
+    ok = ok && nextFrame >= lastFrame && nextFrame <= lastFrame + 2;
+    fprintf(stderr, "Stopped after frame %d, resumed at frame %d without the header scan: %s\n", lastFrame, nextFrame,
+            ok ? "OK" : "FAILED");
+    parser.storePosition();
+  }
+
+  // a file changed while we were asleep is scanned again (and the damaged header is found)
+  struct stat fileStat;
+  stat(TEST_FILE, &fileStat);
+  struct utimbuf times = {fileStat.st_atime, fileStat.st_mtime + 10};
+  utime(TEST_FILE, &times);
+  {
+    AVIParser parser(TEST_FILE, AVIChunkType::VIDEO);
+    bool opened = parser.open();
+    fprintf(stderr, "Changed file %s: %s\n", opened ? "opened" : "rejected", opened ? "FAILED" : "OK");
+    ok = ok && !opened;
+  }
+  remove(TEST_FILE);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+// Checks that AVIParser skips over a damaged chunk header and carries on from the next good chunk,
+// both with an index to jump with and when streaming (scanning for the next chunk).
+#include <Arduino.h>
+#include <algorithm>
+#include <vector>
+#include "AVIParser/AVIParser.h"
+#include "SyntheticAVI.h"
+
+HostSerial Serial;
+
+// Memory, read forwards only.
+class ForwardMemorySource : public ForwardByteSource
+{
+private:
+  const uint8_t *mData;
+  size_t mLength;
+  size_t mOffset = 0;
+
+protected:
+  size_t _readSome(uint8_t *buffer, size_t length)
+  {
+    length = min(length, mLength - mOffset);
+    memcpy(buffer, mData + mOffset, length);
+    mOffset += length;
+    return length;
+  }
+
+public:
+  ForwardMemorySource(const uint8_t *data, size_t length) : mData(data), mLength(length) {}
+};
+
+static std::vector<uint8_t> makeAVI(const SyntheticAVIOptions &options)
+{
+  FILE *file = tmpfile();
+  SyntheticAVIWriter(file, options).write();
+  std::vector<uint8_t> data(ftello(file));
+  rewind(file);
+  if (fread(data.data(), 1, data.size(), file) != data.size()) {
+    data.clear();
+  }
+  fclose(file);
+  return data;
+}
+
+// Offset of the header of the given frame's video chunk (found by the frame number in its last byte).
+static size_t findFrame(const std::vector<uint8_t> &data, uint32_t frame)
+{
+  for (size_t i = 0; i + 8 <= data.size(); i += 2)
+  {
+    uint32_t size;
+    memcpy(&size, &data[i + 4], 4);
+    if (memcmp(&data[i], "00dc", 4) == 0 && size > 2 && size <= data.size() - i - 8 && data[i + 7 + size] == frame) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+// Read all the frames, returning the numbers of the (non-empty) frames that came out.
+static std::vector<uint32_t> readFrames(AVIParser &parser)
+{
+  std::vector<uint32_t> frames;
+  if (!parser.open()) {
+    return frames;
+  }
+  while (true)
+  {
+    ChunkHeader header = parser.getNextHeader();
+    if (header.chunkType == EMPTY_CHUNK) {
+      break;
+    }
+    ChunkView view = parser.getNextChunkView(header);
+    if (header.chunkType == VIDEO_CHUNK && view.data && view.length > 2) {
+      frames.push_back(view.data[view.length - 1]);
+    }
+  }
+  return frames;
+}
+
+// Only the damaged frame should be lost.
+static bool check(const char *name, const std::vector<uint32_t> &frames, std::vector<uint32_t> expected,
+                  uint32_t damagedFrame)
+{
+  expected.erase(std::remove(expected.begin(), expected.end(), damagedFrame), expected.end());
+  bool ok = frames == expected;
+  fprintf(stderr, "%s: read %zu of %zu frames: %s\n", name, frames.size(), expected.size(), ok ? "OK" : "FAILED");
+  return ok;
+}
+
+static bool testDamage(const char *name, const SyntheticAVIOptions &options, const char *fourCC, uint32_t size)
+{
+  const uint32_t damagedFrame = 100;
+  std::vector<uint8_t> data = makeAVI(options);
+  AVIParser goodParser(new MemoryByteSource(data.data(), data.size()), AVIChunkType::VIDEO);
+  std::vector<uint32_t> expected = readFrames(goodParser);
+  size_t position = findFrame(data, damagedFrame);
+  if (!position) {
+    return false;
+  }
+  memcpy(&data[position], fourCC, 4);
+  memcpy(&data[position + 4], &size, 4);
+
+  AVIParser indexedParser(new MemoryByteSource(data.data(), data.size()), AVIChunkType::VIDEO);
+  std::string indexedName = std::string(name) + " (indexed)";
+  bool ok = check(indexedName.c_str(), readFrames(indexedParser), expected, damagedFrame);
+  AVIParser streamParser(new ForwardMemorySource(data.data(), data.size()), AVIChunkType::VIDEO);
+  std::string streamName = std::string(name) + " (streaming)";
+  ok = check(streamName.c_str(), readFrames(streamParser), expected, damagedFrame) && ok;
+  return ok;
+}
+
+int main()
+{
+  Serial.enabled = false;
+  SyntheticAVIOptions options;
+  options.frames = 200;
+  options.videoChunkSize = 3001;
+  options.audioChunkSize = 1000;
+  bool ok = testDamage("Huge size", options, "00dc", 0x7FFFFFF0);
+  ok = testDamage("Unknown FourCC", options, "\x13\x37zz", 3001) && ok;
+  // a scan that has to cross a few read blocks
+  options.videoChunkSize = AVI_READ_BLOCK_SIZE * 3 + 1;
+  ok = testDamage("Large chunks", options, "xxxx", 0xFFFFFFFF) && ok;
+  options.videoChunkSize = 3001;
+  options.framesPerSegment = 64;
+  ok = testDamage("OpenDML", options, "00dc", 0x7FFFFFF0) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+// Checks that the channel shuffle visits every channel exactly once, for any number of channels.
+#include <stdio.h>
+#include <vector>
+#include "ChannelData/ChannelShuffle.h"
+
+static bool checkShuffle(uint32_t count, uint32_t seed, uint32_t *fixedPoints)
+{
+  std::vector<bool> seen(count);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t channel = shuffledIndex(i, count, seed);
+    if (channel >= count || seen[channel]) {
+      fprintf(stderr, "%u channels, seed %u: channel %u repeated or out of range at %u\n", count, seed, channel, i);
+      return false;
+    }
+    seen[channel] = true;
+    *fixedPoints += channel == i;
+  }
+  return true;
+}
+
+int main()
+{
+  bool ok = true;
+  uint32_t fixedPoints = 0, checked = 0;
+  for (uint32_t count = 1; count <= 300; count++)
+  {
+    for (uint32_t seed = 1; seed <= 5; seed++)
+    {
+      ok = ok && checkShuffle(count, seed * 2654435761u, &fixedPoints);
+      checked += count;
+    }
+  }
+  for (uint32_t count : {1000u, 4096u, 4097u, 50000u})
+  {
+    ok = ok && checkShuffle(count, 12345, &fixedPoints);
+    checked += count;
+  }
+  // a shuffle leaves about one channel in place, so many more than that means it isn't shuffling
+  fprintf(stderr, "Shuffled %u channels, %u left in place: %s\n", checked, fixedPoints, ok ? "OK" : "FAILED");
+  ok = ok && fixedPoints < checked / 100;
+  // different seeds give different orders
+  ok = ok && shuffledIndex(0, 50000, 1) != shuffledIndex(0, 50000, 2);
+  return ok ? 0 : 1;
+}
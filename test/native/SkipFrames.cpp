@@ -0,0 +1,100 @@
+// Plays a simulated clip through the frame skipper: the read-ahead task reading frames half a second before
+// they're due, the audio task queueing them as they come up, and the frame task decoding them one at a time
+// (dropping ones that are too late). Checks a decoder that keeps up skips nothing, one a little slower than
+// the frame rate still shows nearly every frame (not every other one), and one much slower has frames
+// skipped before they're read rather than dropped late.
+#include <stdio.h>
+#include <stdint.h>
+#include <deque>
+#include "FrameSkipper/FrameSkipper.h"
+
+#define FRAME_MICROS 66667
+#define READ_AHEAD_MICROS 500000
+#define LATE_DROP_MICROS 40000
+#define QUEUE_DEPTH 3
+#define FRAMES 900
+
+typedef struct
+{
+  uint32_t shown;
+  uint32_t skipped;
+  uint32_t late;
+  uint32_t dropped;
+} Result;
+
+static Result play(uint32_t decodeMicros)
+{
+  FrameSkipper skipper;
+  Result result = {0, 0, 0, 0};
+  // frames read ahead (waiting for their audio to play), and frames queued for the frame task (by when they're due)
+  std::deque<int64_t> readAhead;
+  std::deque<int64_t> queue;
+  uint32_t nextFrame = 0;
+  int64_t busyUntil = 0;
+  int64_t end = (int64_t)FRAMES * FRAME_MICROS + 2 * READ_AHEAD_MICROS;
+  for (int64_t now = 0; now < end; now += 1000)
+  {
+    while (nextFrame < FRAMES && (int64_t)nextFrame * FRAME_MICROS - READ_AHEAD_MICROS <= now)
+    {
+      int64_t due = (int64_t)nextFrame++ * FRAME_MICROS;
+      if (!skipper.skipFrame(FRAME_MICROS, queue.size())) {
+        readAhead.push_back(due);
+      }
+    }
+    // (a frame is queued once the audio before it has played)
+    while (!readAhead.empty() && readAhead.front() - FRAME_MICROS / 2 <= now)
+    {
+      if (queue.size() < QUEUE_DEPTH) {
+        queue.push_back(readAhead.front());
+      }
+      else {
+        result.dropped++;
+      }
+      readAhead.pop_front();
+    }
+    if (busyUntil <= now && !queue.empty() && queue.front() <= now) {
+      skipper.setLag((int32_t)(now - queue.front()));
+    }
+    while (busyUntil <= now && !queue.empty() && queue.front() <= now)
+    {
+      int64_t lag = now - queue.front();
+      queue.pop_front();
+      if (lag > LATE_DROP_MICROS && !queue.empty())
+      {
+        result.late++;
+        continue;
+      }
+      skipper.frameDecoded(decodeMicros);
+      busyUntil = now + decodeMicros;
+      result.shown++;
+    }
+  }
+  result.skipped = skipper.getSkippedFrames();
+  return result;
+}
+
+static bool check(const char *name, uint32_t decodeMicros, uint32_t minShown, uint32_t maxShown, uint32_t maxLate)
+{
+  Result result = play(decodeMicros);
+  bool ok = result.shown >= minShown && result.shown <= maxShown && result.late + result.dropped <= maxLate
+    && result.shown + result.skipped + result.late + result.dropped == FRAMES;
+  printf("%s (%u us a frame): %u of %u frames shown, %u skipped, %u late, %u dropped%s\n", name, decodeMicros,
+         result.shown, FRAMES, result.skipped, result.late, result.dropped, ok ? "" : " - FAILED");
+  return ok;
+}
+
+int main()
+{
+  bool ok = true;
+  // a decoder that keeps up shows every frame
+  ok = check("Fast decoder", FRAME_MICROS * 8 / 10, FRAMES, FRAMES, 0) && ok;
+  ok = check("Just fast enough", FRAME_MICROS - 1000, FRAMES, FRAMES, 0) && ok;
+  // 5% too slow shows close to the 95% it has time for (with the odd frame still late, as the lag builds up
+  // to a frame between skips)
+  ok = check("A little slow", FRAME_MICROS * 105 / 100, FRAMES * 90 / 100, FRAMES * 96 / 100, FRAMES * 6 / 100) && ok;
+  // twice too slow shows about half, mostly skipped before they're read
+  ok = check("Twice too slow", FRAME_MICROS * 2, FRAMES * 45 / 100, FRAMES * 51 / 100, FRAMES * 5 / 100) && ok;
+
+  printf(ok ? "Frame skipping OK\n" : "Frame skipping FAILED\n");
+  return ok ? 0 : 1;
+}
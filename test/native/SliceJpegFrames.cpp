@@ -0,0 +1,169 @@
+// Checks JPEG frames with restart markers are cut in two at a row of MCUs near the middle, with each half
+// a JPEG of its own, and that frames which can't be cut (or are damaged) are left alone.
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "JpegSlicer/JpegSlicer.h"
+
+typedef std::vector<uint8_t> Bytes;
+
+static void putSegment(Bytes &jpeg, uint8_t marker, const Bytes &data)
+{
+  size_t length = data.size() + 2;
+  jpeg.insert(jpeg.end(), {0xFF, marker, (uint8_t)(length >> 8), (uint8_t)length});
+  jpeg.insert(jpeg.end(), data.begin(), data.end());
+}
+
+// The scan data for one row of MCUs (with a stuffed 0xFF in it, and the row number so rows can be told apart).
+static Bytes rowData(int row)
+{
+  return {(uint8_t)row, 0x12, 0xFF, 0x00, 0x34, (uint8_t)row};
+}
+
+static Bytes header(int width, int height, uint8_t frameMarker, uint32_t restartInterval)
+{
+  Bytes jpeg = {0xFF, 0xD8};
+  putSegment(jpeg, 0xE0, {'J', 'F', 'I', 'F', 0});
+  // 4:2:0, so the MCUs are 16x16
+  putSegment(jpeg, frameMarker, {8, (uint8_t)(height >> 8), (uint8_t)height, (uint8_t)(width >> 8), (uint8_t)width, 3,
+                                  1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1});
+  putSegment(jpeg, 0xC4, {0x00, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00});
+  if (restartInterval) {
+    putSegment(jpeg, 0xDD, {(uint8_t)(restartInterval >> 8), (uint8_t)restartInterval});
+  }
+  putSegment(jpeg, 0xDA, {3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0});
+  return jpeg;
+}
+
+// A frame with a restart marker after every `rowsPerRestart` rows of MCUs.
+static Bytes makeFrame(int width, int height, uint32_t restartInterval, int rowsPerRestart, size_t *headerLength,
+                       uint8_t frameMarker = 0xC0)
+{
+  Bytes jpeg = header(width, height, frameMarker, restartInterval);
+  *headerLength = jpeg.size();
+  int rows = (height + 15) / 16;
+  int restarts = 0;
+  for (int row = 0; row < rows; row++)
+  {
+    Bytes data = rowData(row);
+    jpeg.insert(jpeg.end(), data.begin(), data.end());
+    if (restartInterval && (row + 1) % rowsPerRestart == 0 && row + 1 < rows) {
+      jpeg.insert(jpeg.end(), {0xFF, (uint8_t)(0xD0 + restarts++ % 8)});
+    }
+  }
+  jpeg.insert(jpeg.end(), {0xFF, 0xD9});
+  return jpeg;
+}
+
+static int frameHeight(const uint8_t *jpeg, size_t length)
+{
+  for (size_t i = 2; i + 8 < length; i++)
+  {
+    if (jpeg[i] == 0xFF && jpeg[i + 1] == 0xC0) {
+      return (jpeg[i + 5] << 8) | jpeg[i + 6];
+    }
+  }
+  return -1;
+}
+
+// The half holds the headers, rows `first` to `last`, restart markers counting from RST0, and an EOI.
+static bool checkHalf(const uint8_t *half, size_t length, const Bytes &frame, size_t headerLength, int first, int last,
+                      int rowsPerRestart, int height)
+{
+  if (length < headerLength || frameHeight(half, length) != height) {
+    return false;
+  }
+  // (the headers are the same apart from the height)
+  Bytes halfHeader(half, half + headerLength);
+  for (size_t i = 2; i + 6 < headerLength; i++)
+  {
+    if (halfHeader[i] == 0xFF && halfHeader[i + 1] == 0xC0) {
+      halfHeader[i + 5] = frame[i + 5];
+      halfHeader[i + 6] = frame[i + 6];
+      break;
+    }
+  }
+  if (memcmp(halfHeader.data(), frame.data(), headerLength) != 0) {
+    return false;
+  }
+  Bytes expected;
+  int restarts = 0;
+  for (int row = first; row <= last; row++)
+  {
+    Bytes data = rowData(row);
+    expected.insert(expected.end(), data.begin(), data.end());
+    if ((row + 1 - first) % rowsPerRestart == 0 && row < last) {
+      expected.insert(expected.end(), {0xFF, (uint8_t)(0xD0 + restarts++ % 8)});
+    }
+  }
+  expected.insert(expected.end(), {0xFF, 0xD9});
+  return length == headerLength + expected.size() && memcmp(half + headerLength, expected.data(), expected.size()) == 0;
+}
+
+static bool checkSplit(int width, int height, uint32_t restartInterval, int rowsPerRestart, int expectedSplitY)
+{
+  size_t headerLength;
+  Bytes frame = makeFrame(width, height, restartInterval, rowsPerRestart, &headerLength);
+  JpegSlicer slicer;
+  slicer.reserve(frame.size());
+  if (!slicer.split(frame.data(), frame.size()) || slicer.getSplitY() != expectedSplitY) {
+    printf("%dx%d (restart every %u MCUs) split at %d, not %d\n", width, height, restartInterval, slicer.getSplitY(), expectedSplitY);
+    return false;
+  }
+  int rows = (height + 15) / 16;
+  int splitRow = expectedSplitY / 16;
+  bool ok = checkHalf(slicer.getTop(), slicer.getTopLength(), frame, headerLength, 0, splitRow - 1, rowsPerRestart, expectedSplitY)
+    && checkHalf(slicer.getBottom(), slicer.getBottomLength(), frame, headerLength, splitRow, rows - 1, rowsPerRestart, height - expectedSplitY);
+  if (!ok) {
+    printf("%dx%d (restart every %u MCUs) has a bad half\n", width, height, restartInterval);
+  }
+  return ok;
+}
+
+int main()
+{
+  bool ok = true;
+  // a restart every row (as ffmpeg writes them), split in the middle
+  ok = checkSplit(320, 240, 20, 1, 112) && ok;
+  ok = checkSplit(240, 240, 15, 1, 112) && ok;
+  // more than 8 restarts before the cut (so the bottom half's markers are renumbered from a wrapped count)
+  ok = checkSplit(320, 480, 20, 1, 240) && ok;
+  // a height that isn't a whole number of MCUs
+  ok = checkSplit(320, 250, 20, 1, 128) && ok;
+  // restarts every 3 rows, so the nearest boundary is below the middle
+  ok = checkSplit(320, 240, 60, 3, 96) && ok;
+
+  // frames that can't be split
+  size_t headerLength;
+  JpegSlicer slicer;
+  Bytes noRestarts = makeFrame(320, 240, 0, 1, &headerLength);
+  Bytes progressive = makeFrame(320, 240, 20, 1, &headerLength, 0xC2);
+  Bytes oneRow = makeFrame(320, 16, 20, 1, &headerLength);
+  // (restarts every 15 rows, so none end between rows)
+  Bytes noBoundary = makeFrame(320, 240, 300, 15, &headerLength);
+  // (the restart interval is a row, but the markers are missing)
+  Bytes missingMarkers = makeFrame(320, 240, 20, 100, &headerLength);
+  if (slicer.split(noRestarts.data(), noRestarts.size()) || slicer.split(progressive.data(), progressive.size())
+      || slicer.split(oneRow.data(), oneRow.size()) || slicer.split(noBoundary.data(), noBoundary.size())
+      || slicer.split(missingMarkers.data(), missingMarkers.size())) {
+    printf("Split a frame that can't be split\n");
+    ok = false;
+  }
+
+  // truncated and damaged frames are turned down (or split) without reading past the end (checked by ASan)
+  Bytes frame = makeFrame(320, 240, 20, 1, &headerLength);
+  for (size_t length = 0; length < frame.size(); length++)
+  {
+    Bytes truncated(frame.begin(), frame.begin() + length);
+    slicer.split(truncated.data(), truncated.size());
+  }
+  for (size_t i = 0; i < frame.size(); i++)
+  {
+    Bytes damaged = frame;
+    damaged[i] ^= 0xFF;
+    slicer.split(damaged.data(), damaged.size());
+  }
+
+  printf(ok ? "JPEG slicing OK\n" : "JPEG slicing FAILED\n");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+// Checks that AVIParser reads the same chunks from a pipe as it does from memory.
+#include <Arduino.h>
+#include <unistd.h>
+#include <random>
+#include <thread>
+#include <vector>
+#include "AVIParser/AVIParser.h"
+#include "SyntheticAVI.h"
+
+HostSerial Serial;
+
+typedef struct
+{
+  chunk_type chunkType;
+  size_t length;
+  uint32_t checksum;
+} ChunkRecord;
+
+static std::vector<uint8_t> makeAVI(const SyntheticAVIOptions &options)
+{
+  FILE *file = tmpfile();
+  SyntheticAVIWriter(file, options).write();
+  std::vector<uint8_t> data(ftello(file));
+  rewind(file);
+  if (fread(data.data(), 1, data.size(), file) != data.size()) {
+    data.clear();
+  }
+  fclose(file);
+  return data;
+}
+
+static std::vector<ChunkRecord> readChunks(AVIParser &parser)
+{
+  std::vector<ChunkRecord> chunks;
+  if (!parser.open()) {
+    return chunks;
+  }
+  while (true)
+  {
+    ChunkHeader header = parser.getNextHeader();
+    if (header.chunkType == EMPTY_CHUNK) {
+      break;
+    }
+    ChunkView view = parser.getNextChunkView(header);
+    uint32_t checksum = 0;
+    for (size_t i = 0; view.data && i < view.length; i++) {
+      checksum = checksum * 31 + view.data[i];
+    }
+    chunks.push_back({header.chunkType, view.length, checksum});
+  }
+  return chunks;
+}
+
+static bool testStream(const char *name, const SyntheticAVIOptions &options)
+{
+  std::vector<uint8_t> data = makeAVI(options);
+  AVIParser memoryParser(new MemoryByteSource(data.data(), data.size()), AVIChunkType::VIDEO);
+  std::vector<ChunkRecord> expected = readChunks(memoryParser);
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  // write the file into the pipe in uneven pieces, with pauses
+  std::thread writer([&]() {
+    std::mt19937 random(1);
+    size_t offset = 0;
+    while (offset < data.size())
+    {
+      size_t length = min(data.size() - offset, (size_t)(1 + random() % 10000));
+      ssize_t written = write(fds[1], data.data() + offset, length);
+      if (written <= 0) {break;}
+      offset += written;
+      if (random() % 16 == 0) {usleep(200);}
+    }
+    close(fds[1]);
+  });
+  AVIParser pipeParser(new FdByteSource(fds[0]), AVIChunkType::VIDEO);
+  std::vector<ChunkRecord> actual = readChunks(pipeParser);
+  writer.join();
+  close(fds[0]);
+
+  bool matches = !expected.empty() && actual.size() == expected.size();
+  for (size_t i = 0; matches && i < actual.size(); i++)
+  {
+    matches = actual[i].chunkType == expected[i].chunkType && actual[i].length == expected[i].length
+      && actual[i].checksum == expected[i].checksum;
+  }
+  fprintf(stderr, "%s: %zu chunks from memory, %zu from the pipe: %s\n", name, expected.size(), actual.size(),
+          matches ? "OK" : "MISMATCH");
+  return matches;
+}
+
+int main()
+{
+  Serial.enabled = false;
+  SyntheticAVIOptions options;
+  options.frames = 500;
+  options.videoChunkSize = 9001;
+  options.audioChunkSize = 1001;
+  bool ok = testStream("AVI", options);
+
+  options.framesPerSegment = 120;
+  ok = testStream("OpenDML", options) && ok;
+
+  options.framesPerSegment = 0;
+  options.recGroups = true;
+  ok = testStream("rec groups", options) && ok;
+
+  // chunks bigger than the read ring
+  options.videoChunkSize = AVI_READ_RING_SIZE * 2 + 3;
+  options.frames = 40;
+  options.framesPerSegment = 0;
+  ok = testStream("Large chunks", options) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,284 @@
+#pragma once
+// Writes synthetic MJPEG/PCM AVI files for the native fuzzer and benchmark.
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+typedef struct
+{
+  // Total number of video frames. Each frame is followed by one audio chunk.
+  uint32_t frames = 100;
+  uint32_t videoChunkSize = 4000;
+  uint32_t audioChunkSize = 1000;
+  uint32_t audioRate = 16000;
+  uint32_t frameRate = 16;
+  // Frames per RIFF segment. 0 writes a single 'AVI ' RIFF with an idx1 index,
+  // anything else writes an OpenDML file with 'AVIX' extensions and indx/ix00 indexes.
+  uint32_t framesPerSegment = 0;
+  // Seek over the chunk data instead of writing it (gives fast, sparse multi-GB files).
+  bool sparse = false;
+  // Group each frame and its audio in a LIST 'rec ' (AVI only).
+  bool recGroups = false;
+  // Write the audio in runs of this many chunks, after the frames they go with (a poorly interleaved file).
+  uint32_t audioRun = 1;
+} SyntheticAVIOptions;
+
+class SyntheticAVIWriter
+{
+private:
+  FILE *mFile;
+  const SyntheticAVIOptions &mOptions;
+
+  void _write32(uint32_t value) { fwrite(&value, 4, 1, mFile); }
+  void _write16(uint16_t value) { fwrite(&value, 2, 1, mFile); }
+  void _write64(uint64_t value) { fwrite(&value, 8, 1, mFile); }
+  void _writeId(const char *id) { fwrite(id, 4, 1, mFile); }
+  void _writeZeros(size_t count)
+  {
+    static const uint8_t zeros[256] = {0};
+    while (count > 0)
+    {
+      size_t length = count < sizeof(zeros) ? count : sizeof(zeros);
+      fwrite(zeros, 1, length, mFile);
+      count -= length;
+    }
+  }
+  off_t _tell() { return ftello(mFile); }
+
+  // Start a chunk and return the position of its size field.
+  off_t _beginChunk(const char *id, const char *listType = NULL)
+  {
+    _writeId(id);
+    off_t sizePosition = _tell();
+    _write32(0);
+    if (listType) {_writeId(listType);}
+    return sizePosition;
+  }
+  void _endChunk(off_t sizePosition)
+  {
+    off_t end = _tell();
+    uint32_t size = end - sizePosition - 4;
+    fseeko(mFile, sizePosition, SEEK_SET);
+    _write32(size);
+    fseeko(mFile, end, SEEK_SET);
+    if (size % 2) {_writeZeros(1);}
+  }
+
+  void _writeChunkData(uint32_t size, uint8_t fill)
+  {
+    if (mOptions.sparse && size > 16)
+    {
+      // keep a little real data at the start (a jpeg SOI marker for video) and skip the rest
+      uint8_t start[2] = {0xFF, 0xD8};
+      fwrite(start, 1, 2, mFile);
+      fseeko(mFile, size - 2, SEEK_CUR);
+    }
+    else
+    {
+      std::vector<uint8_t> data(size, fill);
+      if (size >= 2) {data[0] = 0xFF; data[1] = 0xD8;}
+      if (size > 0) {fwrite(data.data(), 1, size, mFile);}
+    }
+    if (size % 2) {_writeZeros(1);}
+  }
+
+  void _writeStreamHeader(const char *type, uint32_t scale, uint32_t rate, uint32_t sampleSize,
+                          uint32_t length, uint32_t suggestedBufferSize)
+  {
+    off_t strh = _beginChunk("strh");
+    _writeId(type);
+    _write32(0); // handler
+    _write32(0); // flags
+    _write32(0); // priority, language
+    _write32(0); // initial frames
+    _write32(scale);
+    _write32(rate);
+    _write32(0); // start
+    _write32(length);
+    _write32(suggestedBufferSize);
+    _write32(0xFFFFFFFF); // quality
+    _write32(sampleSize);
+    _writeZeros(8); // frame rect
+    _endChunk(strh);
+  }
+
+public:
+  SyntheticAVIWriter(FILE *file, const SyntheticAVIOptions &options) : mFile(file), mOptions(options) {}
+
+  bool write()
+  {
+    const SyntheticAVIOptions &o = mOptions;
+    bool openDML = o.framesPerSegment > 0;
+    uint32_t segmentCount = openDML ? (o.frames + o.framesPerSegment - 1) / o.framesPerSegment : 1;
+    uint32_t framesPerSegment = openDML ? o.framesPerSegment : o.frames;
+    if (segmentCount == 0) {segmentCount = 1;}
+
+    // headers
+    off_t riff = _beginChunk("RIFF", "AVI ");
+    off_t hdrl = _beginChunk("LIST", "hdrl");
+    off_t avih = _beginChunk("avih");
+    _write32(1000000 / o.frameRate);
+    _write32(0); // max bytes per second
+    _write32(0); // padding granularity
+    _write32(0x10); // AVIF_HASINDEX
+    _write32(openDML ? framesPerSegment : o.frames);
+    _write32(0); // initial frames
+    _write32(2); // streams
+    _write32(o.videoChunkSize);
+    _write32(320);
+    _write32(240);
+    _writeZeros(16);
+    _endChunk(avih);
+
+    off_t strl = _beginChunk("LIST", "strl");
+    _writeStreamHeader("vids", 1, o.frameRate, 0, o.frames, o.videoChunkSize);
+    off_t strf = _beginChunk("strf");
+    _write32(40);
+    _write32(320);
+    _write32(240);
+    _write16(1);
+    _write16(24);
+    _writeId("MJPG");
+    _writeZeros(20);
+    _endChunk(strf);
+    off_t indxEntries = 0;
+    if (openDML)
+    {
+      // the super index is filled in once the standard indexes have been written
+      off_t indx = _beginChunk("indx");
+      _write16(4);
+      fputc(0, mFile);
+      fputc(0, mFile); // AVI_INDEX_OF_INDEXES
+      _write32(segmentCount);
+      _writeId("00dc");
+      _writeZeros(12);
+      indxEntries = _tell();
+      _writeZeros(16 * segmentCount);
+      _endChunk(indx);
+    }
+    _endChunk(strl);
+
+    strl = _beginChunk("LIST", "strl");
+    _writeStreamHeader("auds", 1, o.audioRate, 1, o.frames * o.audioChunkSize, o.audioChunkSize);
+    strf = _beginChunk("strf");
+    _write16(1); // PCM
+    _write16(1);
+    _write32(o.audioRate);
+    _write32(o.audioRate);
+    _write16(1);
+    _write16(8);
+    _endChunk(strf);
+    _endChunk(strl);
+    _endChunk(hdrl);
+
+    // each segment's movi list (and ix00 index for OpenDML)
+    typedef struct { off_t offset; uint32_t size; } Entry;
+    std::vector<Entry> videoEntries;
+    std::vector<Entry> audioEntries;
+    std::vector<Entry> groupEntries;
+    std::vector<Entry> standardIndexes;
+    uint32_t frame = 0;
+    for (uint32_t segment = 0; segment < segmentCount; segment++)
+    {
+      if (segment > 0) {riff = _beginChunk("RIFF", "AVIX");}
+      off_t movi = _beginChunk("LIST", "movi");
+      off_t moviStart = movi + 4;
+      videoEntries.clear();
+      audioEntries.clear();
+      for (uint32_t i = 0; i < framesPerSegment && frame < o.frames; i++, frame++)
+      {
+        // every 8th frame is empty (a repeat of the previous frame)
+        uint32_t videoSize = frame % 8 == 7 ? 0 : o.videoChunkSize - (frame % 5) * 2;
+        off_t group = 0;
+        if (o.recGroups && !openDML)
+        {
+          groupEntries.push_back({_tell(), 0});
+          group = _beginChunk("LIST", "rec ");
+        }
+        videoEntries.push_back({_tell(), videoSize});
+        _writeId("00dc");
+        _write32(videoSize);
+        _writeChunkData(videoSize, frame);
+        // the audio chunks are numbered in their last byte
+        bool endOfSegment = i + 1 == framesPerSegment || frame + 1 == o.frames;
+        while (audioEntries.size() < videoEntries.size() && ((frame + 1) % o.audioRun == 0 || endOfSegment))
+        {
+          uint32_t audioFrame = frame - (videoEntries.size() - audioEntries.size() - 1);
+          audioEntries.push_back({_tell(), o.audioChunkSize});
+          _writeId("01wb");
+          _write32(o.audioChunkSize);
+          _writeChunkData(o.audioChunkSize, audioFrame);
+        }
+        if (group) {
+          _endChunk(group);
+        }
+      }
+      if (openDML)
+      {
+        off_t ix = _tell();
+        off_t ixSize = _beginChunk("ix00");
+        _write16(2);
+        fputc(0, mFile);
+        fputc(1, mFile); // AVI_INDEX_OF_CHUNKS
+        _write32(videoEntries.size());
+        _writeId("00dc");
+        _write64(moviStart);
+        _write32(0);
+        for (Entry &entry : videoEntries)
+        {
+          // offsets point at the chunk data
+          _write32(entry.offset + 8 - moviStart);
+          _write32(entry.size);
+        }
+        _endChunk(ixSize);
+        standardIndexes.push_back({ix, (uint32_t)videoEntries.size()});
+      }
+      _endChunk(movi);
+
+      if (!openDML)
+      {
+        // idx1, with offsets relative to the 'movi' fourcc
+        off_t idx1 = _beginChunk("idx1");
+        for (size_t i = 0; i < videoEntries.size(); i++)
+        {
+          if (i < groupEntries.size())
+          {
+            _writeId("rec ");
+            _write32(0);
+            _write32(groupEntries[i].offset - moviStart);
+            _write32(0);
+          }
+          _writeId("00dc");
+          _write32(0x10);
+          _write32(videoEntries[i].offset - moviStart);
+          _write32(videoEntries[i].size);
+          _writeId("01wb");
+          _write32(0x10);
+          _write32(audioEntries[i].offset - moviStart);
+          _write32(audioEntries[i].size);
+        }
+        _endChunk(idx1);
+      }
+      _endChunk(riff);
+    }
+
+    if (openDML)
+    {
+      off_t end = _tell();
+      fseeko(mFile, indxEntries, SEEK_SET);
+      for (Entry &entry : standardIndexes)
+      {
+        _write64(entry.offset);
+        _write32(24 + 8 * entry.size);
+        _write32(entry.size);
+      }
+      fseeko(mFile, end, SEEK_SET);
+    }
+    fflush(mFile);
+    // a sparse file might end in a hole
+    return ftruncate(fileno(mFile), _tell()) == 0 && !ferror(mFile);
+  }
+};
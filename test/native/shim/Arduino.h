@@ -0,0 +1,50 @@
+#pragma once
+// Just enough of Arduino.h to build the AVI parser on a Linux host.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <algorithm>
+
+#define RTC_DATA_ATTR
+
+using std::min;
+using std::max;
+
+class HostSerial
+{
+public:
+  // set to false to keep the parser's logging out of benchmark/fuzzer output
+  bool enabled = true;
+
+  template <typename... Args>
+  int printf(const char *format, Args... args)
+  {
+    return enabled ? ::printf(format, args...) : 0;
+  }
+  int printf(const char *text)
+  {
+    return enabled ? ::printf("%s", text) : 0;
+  }
+  void print(const char *text)
+  {
+    if (enabled) {fputs(text, stdout);}
+  }
+  void println(const char *text = "")
+  {
+    if (enabled) {puts(text);}
+  }
+};
+
+extern HostSerial Serial;
+
+static inline unsigned long millis()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static inline bool psramFound() { return false; }
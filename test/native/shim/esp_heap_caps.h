@@ -0,0 +1,13 @@
+#pragma once
+// Host versions of the ESP-IDF heap_caps allocators (there's only one kind of memory here).
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MALLOC_CAP_DEFAULT (1 << 12)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_8BIT (1 << 2)
+
+static inline void *heap_caps_malloc(size_t size, uint32_t /*caps*/) { return malloc(size); }
+static inline void *heap_caps_malloc_prefer(size_t size, size_t /*num*/, ...) { return malloc(size); }
+static inline void *heap_caps_realloc_prefer(void *ptr, size_t size, size_t /*num*/, ...) { return realloc(ptr, size); }